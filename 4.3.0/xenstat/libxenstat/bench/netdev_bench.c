@@ -0,0 +1,289 @@
+/* libxenstat: statistics-collection library for Xen
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/* Microbenchmark of the network statistics collection.  Built with
+ * "make bench", it includes xenstat_linux.c to reach its static functions.
+ *
+ *   netdev_bench parse [INTERFACES [PASSES]]
+ *	Times the old regular expression based /proc/net/dev line parser
+ *	against parseNetDevLine() on a generated file, and checks that both
+ *	read the same counters.
+ *
+ *   netdev_bench collect [PASSES]
+ *	Times collecting the statistics of all the links of this host from
+ *	/proc/net/dev and from an rtnetlink dump.  Run it in a dom0 with the
+ *	number of vifs of interest. */
+
+#include <regex.h>
+#include <time.h>
+
+#include "../src/xenstat_linux.c"
+
+#define DEFAULT_INTERFACES 5000
+#define DEFAULT_PASSES 20
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The parser libxenstat used before, compiling its regular expression for
+ * each line, kept here as the baseline */
+static int parse_regex(char *line, char *iface,
+		       unsigned long long counters[NETDEV_NUM_COUNTERS])
+{
+	int ret;
+	char *tmp;
+	int i = 0, x = 0, col = 0;
+	regex_t r;
+	regmatch_t matches[19];
+	int num = 19;
+
+	char *regex = "([^:]*):([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)"
+			"[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*"
+			"([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)";
+
+	iface[0] = '\0';
+	memset(counters, 0, NETDEV_NUM_COUNTERS * sizeof(*counters));
+
+	if ((ret = regcomp(&r, regex, REG_EXTENDED))) {
+		regfree(&r);
+		return ret;
+	}
+
+	tmp = (char *)malloc( sizeof(char) );
+	if (regexec (&r, line, num, matches, REG_EXTENDED) == 0){
+		for (i = 1; i < num; i++) {
+			if (matches[i].rm_eo - matches[i].rm_so > 0) {
+				col++;
+				tmp = (char *)realloc(tmp, (matches[i].rm_eo -
+							matches[i].rm_so + 1) * sizeof(char));
+				for (x = matches[i].rm_so; x < matches[i].rm_eo; x++)
+					tmp[x - matches[i].rm_so] = line[x];
+				tmp[x - matches[i].rm_so] = '\0';
+
+				if (i > 1) {
+					if (col >= 2 && col < 2 + NETDEV_NUM_COUNTERS)
+						counters[col - 2] = strtoull(tmp, NULL, 10);
+				}
+				else
+					strcpy(iface, strpbrk(tmp, "abcdefghijklmnopqrstvuwxyz0123456789"));
+			}
+		}
+	}
+
+	free(tmp);
+	regfree(&r);
+
+	return 0;
+}
+
+/* Builds a /proc/net/dev body (without its header) with one vif per line */
+static char *make_procnetdev(unsigned int interfaces, size_t *size)
+{
+	size_t len = 0, alloc = (size_t)interfaces * 160 + 1;
+	char *buf = malloc(alloc);
+	unsigned int i;
+
+	if (buf == NULL)
+		return NULL;
+	for (i = 0; i < interfaces; i++) {
+		unsigned long long n = 1000003ULL * (i + 1);
+		char name[IFACE_NAME_LEN];
+
+		snprintf(name, sizeof(name), "vif%u.0", i + 1);
+		len += snprintf(buf + len, alloc - len,
+				"%6s:%8llu %7llu %4llu %4llu %4llu %5llu %10llu %9llu "
+				"%8llu %7llu %4llu %4llu %4llu %5llu %7llu %10llu\n",
+				name, n * 1500, n, n % 7, n % 11, 0ULL, 0ULL,
+				0ULL, n % 13, n * 900, n / 2, n % 3, n % 5, 0ULL,
+				0ULL, 0ULL, 0ULL);
+	}
+	*size = len;
+	return buf;
+}
+
+static int bench_parse(unsigned int interfaces, unsigned int passes)
+{
+	char iface[IFACE_NAME_LEN], iface2[IFACE_NAME_LEN];
+	unsigned long long counters[NETDEV_NUM_COUNTERS];
+	unsigned long long counters2[NETDEV_NUM_COUNTERS];
+	char *buf, *copy, **lines, *p, *end;
+	unsigned int i, n, pass;
+	double start, t_regex, t_single;
+	size_t size;
+
+	buf = make_procnetdev(interfaces, &size);
+	copy = malloc(size + 1);
+	lines = calloc(interfaces, sizeof(*lines));
+	if (buf == NULL || copy == NULL || lines == NULL) {
+		fprintf(stderr, "Failed to allocate memory\n");
+		return 1;
+	}
+
+	/* The old parser took one NUL terminated line at a time, from fgets() */
+	memcpy(copy, buf, size);
+	copy[size] = '\0';
+	for (p = copy, n = 0; n < interfaces; n++) {
+		lines[n] = p;
+		p = strchr(p, '\n');
+		*p++ = '\0';
+	}
+
+	/* Both must agree before their times mean anything */
+	for (p = buf, end = buf + size, n = 0; p < end; n++) {
+		p = parseNetDevLine(p, end, iface, counters);
+		parse_regex(lines[n], iface2, counters2);
+		if (strcmp(iface, iface2) != 0 ||
+		    memcmp(counters, counters2, sizeof(counters)) != 0) {
+			fprintf(stderr, "Parsers disagree on line %u\n", n + 1);
+			return 1;
+		}
+	}
+
+	start = now();
+	for (pass = 0; pass < passes; pass++)
+		for (i = 0; i < interfaces; i++)
+			parse_regex(lines[i], iface, counters);
+	t_regex = (now() - start) / passes;
+
+	start = now();
+	for (pass = 0; pass < passes; pass++)
+		for (p = buf, end = buf + size; p < end; )
+			p = parseNetDevLine(p, end, iface, counters);
+	t_single = (now() - start) / passes;
+
+	printf("%u interfaces, %u passes\n", interfaces, passes);
+	printf("regex:       %10.3f ms/pass %8.3f us/line\n",
+	       t_regex * 1e3, t_regex * 1e6 / interfaces);
+	printf("single pass: %10.3f ms/pass %8.3f us/line\n",
+	       t_single * 1e3, t_single * 1e6 / interfaces);
+	printf("speedup:     %10.1fx\n", t_regex / t_single);
+
+	free(lines);
+	free(copy);
+	free(buf);
+	return 0;
+}
+
+/* The node has no domains, so every vif found would be reported missing */
+static int no_domains(xenstat_domain *domain, void *arg)
+{
+	return 0;
+}
+
+static int bench_collect(unsigned int passes)
+{
+	char devBridge[16] = { 0 }, devNoBridge[16] = { 0 };
+	xenstat_handle handle;
+	xenstat_node node;
+	struct priv_data *priv;
+	unsigned int pass, links = 0;
+	double start, t_procfs, t_netlink;
+	char *p, *end;
+	ssize_t len;
+	int ret = 1;
+
+	memset(&handle, 0, sizeof(handle));
+	memset(&node, 0, sizeof(node));
+	handle.filter = no_domains;
+	node.handle = &handle;
+	priv = get_priv_data(&handle);
+	if (priv == NULL) {
+		fprintf(stderr, "Failed to allocate memory\n");
+		return 1;
+	}
+	snprintf(devBridge, 16, "%s", get_bridge(priv));
+	snprintf(devNoBridge, 16, "p%s", devBridge);
+
+	start = now();
+	for (pass = 0; pass < passes && ret == 1; pass++) {
+		reset_networks(&node, priv);
+		ret = collect_networks_procfs(&node, priv, devBridge,
+					      devNoBridge);
+	}
+	t_procfs = (now() - start) / passes;
+	if (ret != 1) {
+		fprintf(stderr, "Collecting from /proc/net/dev failed\n");
+		return 1;
+	}
+
+	start = now();
+	for (pass = 0; pass < passes && ret == 1; pass++) {
+		reset_networks(&node, priv);
+		ret = collect_networks_netlink(&node, priv, devBridge,
+					       devNoBridge);
+	}
+	t_netlink = (now() - start) / passes;
+	if (ret != 1) {
+		fprintf(stderr, "Collecting over rtnetlink failed\n");
+		return 1;
+	}
+
+	/* Lines of /proc/net/dev, past its two header lines */
+	len = read_procnetdev(priv);
+	end = priv->procnetdev_buf + (len > 0 ? len : 0);
+	for (p = priv->procnetdev_buf; p < end; p++)
+		if (*p == '\n')
+			links++;
+	links = links > 2 ? links - 2 : 0;
+
+	printf("%u links, %u passes\n", links, passes);
+	printf("procfs:  %10.3f ms/pass\n", t_procfs * 1e3);
+	printf("netlink: %10.3f ms/pass\n", t_netlink * 1e3);
+	printf("speedup: %10.1fx\n", t_procfs / t_netlink);
+
+	xenstat_uninit_networks(&handle);
+	return 0;
+}
+
+static void usage(const char *program)
+{
+	fprintf(stderr, "Usage: %s parse [INTERFACES [PASSES]]\n"
+		"       %s collect [PASSES]\n", program, program);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc >= 2 && strcmp(argv[1], "parse") == 0 && argc <= 4) {
+		unsigned int interfaces = DEFAULT_INTERFACES;
+		unsigned int passes = DEFAULT_PASSES;
+
+		if (argc >= 3)
+			interfaces = strtoul(argv[2], NULL, 10);
+		if (argc >= 4)
+			passes = strtoul(argv[3], NULL, 10);
+		if (interfaces == 0 || passes == 0) {
+			usage(argv[0]);
+			return 1;
+		}
+		return bench_parse(interfaces, passes);
+	}
+	if (argc >= 2 && strcmp(argv[1], "collect") == 0 && argc <= 3) {
+		unsigned int passes = DEFAULT_PASSES;
+
+		if (argc >= 3)
+			passes = strtoul(argv[2], NULL, 10);
+		if (passes == 0) {
+			usage(argv[0]);
+			return 1;
+		}
+		return bench_collect(passes);
+	}
+
+	usage(argv[0]);
+	return 1;
+}
@@ -0,0 +1,232 @@
+/* libxenstat: statistics-collection library for Xen
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/* Microbenchmark of the VBD statistics collection.  Built with "make bench",
+ * it includes xenstat_linux.c with the backend directory moved to a tree of
+ * fake blkback devices that it builds on /tmp.
+ *
+ *   vbd_bench [VBDS [PASSES]]
+ *	Times a collection of VBDS fake devices, 16 per domain, with the
+ *	statistics files read by pread() and by io_uring, and reports how
+ *	many files are kept open.  The backing device of every VBD is a
+ *	block device of this host, if any.  Raise the limit on open
+ *	files (ulimit -n) to see the effect of the budget. */
+
+#define _GNU_SOURCE
+#include <ftw.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define SYSFS_VBD_PATH "/tmp/xenstat_vbd_bench"
+#include "../src/xenstat_linux.c"
+
+#define DEFAULT_VBDS 1000
+#define DEFAULT_PASSES 20
+#define VBDS_PER_DOMAIN 16
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void write_file(const char *path, const char *value)
+{
+	FILE *fp = fopen(path, "w");
+
+	if (fp == NULL || fputs(value, fp) == EOF || fclose(fp) == EOF) {
+		perror(path);
+		exit(1);
+	}
+}
+
+static int remove_entry(const char *path, const struct stat *sb, int flag,
+			struct FTW *ftw)
+{
+	return remove(path);
+}
+
+/* Finds a block device of this host to stand for the backing devices,
+ * preferring one that has done some I/O */
+static int find_backing(char *buf, size_t size)
+{
+	char path[64];
+	struct dirent *dp;
+	unsigned int major, minor;
+	unsigned long long ios;
+	DIR *dir = opendir("/sys/dev/block");
+	FILE *fp;
+	int found = 0;
+
+	if (dir == NULL)
+		return 0;
+	while (found < 2 && (dp = readdir(dir)) != NULL) {
+		if (sscanf(dp->d_name, "%u:%u", &major, &minor) != 2)
+			continue;
+		snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/stat",
+			 major, minor);
+		fp = fopen(path, "r");
+		ios = 0;
+		if (fp != NULL) {
+			if (fscanf(fp, "%llu", &ios) != 1)
+				ios = 0;
+			fclose(fp);
+		}
+		if (!found || ios > 0) {
+			snprintf(buf, size, "%x:%x\n", major, minor);
+			found = ios > 0 ? 2 : 1;
+		}
+	}
+	closedir(dir);
+	return found;
+}
+
+static void make_vbds(unsigned int vbds)
+{
+	char path[256], value[32], backing[32];
+	unsigned int i, stat;
+	int has_backing = find_backing(backing, sizeof(backing));
+
+	nftw(SYSFS_VBD_PATH, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+	if (mkdir(SYSFS_VBD_PATH, 0755) == -1) {
+		perror(SYSFS_VBD_PATH);
+		exit(1);
+	}
+	for (i = 0; i < vbds; i++) {
+		int len = snprintf(path, sizeof(path), "%s/vbd-%u-%u",
+				   SYSFS_VBD_PATH, 1 + i / VBDS_PER_DOMAIN,
+				   51712 + (i % VBDS_PER_DOMAIN) * 16);
+
+		mkdir(path, 0755);
+		if (has_backing) {
+			snprintf(path + len, sizeof(path) - len,
+				 "/physical_device");
+			write_file(path, backing);
+		}
+		snprintf(path + len, sizeof(path) - len, "/statistics");
+		mkdir(path, 0755);
+		for (stat = 0; stat < VBD_NUM_STATS; stat++) {
+			snprintf(path + len, sizeof(path) - len,
+				 "/statistics/%s", vbd_stat_names[stat]);
+			snprintf(value, sizeof(value), "%u\n", i + stat);
+			write_file(path, value);
+		}
+	}
+}
+
+static void reset_vbds(xenstat_node *node)
+{
+	unsigned int i;
+
+	for (i = 0; i < node->num_domains; i++) {
+		free(node->domains[i].vbds);
+		node->domains[i].vbds = NULL;
+		node->domains[i].num_vbds = 0;
+	}
+}
+
+/* Collects the VBDs passes times, returning the time of one collection */
+static double time_collect(xenstat_node *node, unsigned int passes)
+{
+	unsigned int pass;
+	double start = now();
+
+	for (pass = 0; pass < passes; pass++) {
+		reset_vbds(node);
+		if (!xenstat_collect_vbds(node)) {
+			fprintf(stderr, "Collecting the VBDs failed\n");
+			exit(1);
+		}
+	}
+	return (now() - start) / passes;
+}
+
+static int bench_vbd(unsigned int vbds, unsigned int passes)
+{
+	unsigned int i, num_domains = (vbds + VBDS_PER_DOMAIN - 1) / VBDS_PER_DOMAIN;
+	char no_qmp[] = "";
+	xenstat_handle handle;
+	xenstat_node node;
+	struct priv_data *priv;
+	double t_pread, t_ring;
+	int ret = 0;
+
+	make_vbds(vbds);
+
+	memset(&handle, 0, sizeof(handle));
+	handle.qmp_path = no_qmp;
+	memset(&node, 0, sizeof(node));
+	node.handle = &handle;
+	node.num_domains = num_domains;
+	node.domains = calloc(num_domains, sizeof(*node.domains));
+	priv = get_priv_data(&handle);
+	if (node.domains == NULL || priv == NULL) {
+		fprintf(stderr, "Failed to allocate memory\n");
+		return 1;
+	}
+	for (i = 0; i < num_domains; i++)
+		node.domains[i].id = i + 1;
+
+	/* The first collection scans the tree and opens the files */
+	time_collect(&node, 1);
+	if (node.domains[0].num_vbds == 0 ||
+	    node.domains[0].vbds[0].rd_reqs != VBD_STAT_RD_REQ) {
+		fprintf(stderr, "The fake VBDs were not read back\n");
+		ret = 1;
+		goto out;
+	}
+
+	t_pread = time_collect(&node, passes);
+	handle.batch_reads = 1;
+	time_collect(&node, 1);
+	t_ring = time_collect(&node, passes);
+
+	printf("%u VBDs, %u passes, %u of %u files kept open\n",
+	       vbds, passes, priv->num_vbd_fds, priv->max_vbd_fds);
+	printf("pread:    %10.3f ms/pass\n", t_pread * 1e3);
+#ifdef HAVE_IO_URING
+	printf("io_uring: %10.3f ms/pass%s\n", t_ring * 1e3,
+	       priv->ring_failed ? " (unavailable, fell back to pread)" : "");
+#else
+	printf("io_uring: not built in (%.3f ms/pass with pread)\n",
+	       t_ring * 1e3);
+#endif
+
+out:
+	reset_vbds(&node);
+	free(node.domains);
+	xenstat_uninit_vbds(&handle);
+	nftw(SYSFS_VBD_PATH, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int vbds = DEFAULT_VBDS, passes = DEFAULT_PASSES;
+
+	if (argc > 3) {
+		fprintf(stderr, "Usage: %s [VBDS [PASSES]]\n", argv[0]);
+		return 1;
+	}
+	if (argc >= 2)
+		vbds = strtoul(argv[1], NULL, 10);
+	if (argc >= 3)
+		passes = strtoul(argv[2], NULL, 10);
+	if (vbds == 0 || passes == 0) {
+		fprintf(stderr, "Usage: %s [VBDS [PASSES]]\n", argv[0]);
+		return 1;
+	}
+	return bench_vbd(vbds, passes);
+}
@@ -60,6 +60,15 @@ static void xenstat_free_xen_version(xenstat_node * node);
 static void xenstat_free_vbds(xenstat_node * node);
 static void xenstat_uninit_vcpus(xenstat_handle * handle);
 static void xenstat_uninit_xen_version(xenstat_handle * handle);
+static int  xenstat_collect_devnames(xenstat_node * node);
+static void xenstat_free_devnames(xenstat_node * node);
+static void xenstat_uninit_devnames(xenstat_handle * handle);
+static int  xenstat_collect_numa(xenstat_node * node);
+static void xenstat_free_numa(xenstat_node * node);
+static void xenstat_uninit_numa(xenstat_handle * handle);
+static int  xenstat_collect_pcpus(xenstat_node * node);
+static void xenstat_free_pcpus(xenstat_node * node);
+static void xenstat_uninit_pcpus(xenstat_handle * handle);
 static char *xenstat_get_domain_name(xenstat_handle * handle, unsigned int domain_id);
 static void xenstat_prune_domain(xenstat_node *node, unsigned int entry);
 
@@ -71,7 +80,14 @@ static xenstat_collector collectors[] = {
 	{ XENSTAT_XEN_VERSION, xenstat_collect_xen_version,
 	  xenstat_free_xen_version, xenstat_uninit_xen_version },
 	{ XENSTAT_VBD, xenstat_collect_vbds,
-	  xenstat_free_vbds, xenstat_uninit_vbds }
+	  xenstat_free_vbds, xenstat_uninit_vbds },
+	{ XENSTAT_NUMA, xenstat_collect_numa,
+	  xenstat_free_numa, xenstat_uninit_numa },
+	{ XENSTAT_PCPU, xenstat_collect_pcpus,
+	  xenstat_free_pcpus, xenstat_uninit_pcpus },
+	/* Must come after the network and VBD collectors */
+	{ XENSTAT_DEVNAMES, xenstat_collect_devnames,
+	  xenstat_free_devnames, xenstat_uninit_devnames }
 };
 
 #define NUM_COLLECTORS (sizeof(collectors)/sizeof(xenstat_collector))
@@ -82,6 +98,7 @@ static xenstat_collector collectors[] = {
 xenstat_handle *xenstat_init(void)
 {
 	xenstat_handle *handle;
+	const char *qmp_path;
 
 	handle = (xenstat_handle *) calloc(1, sizeof(xenstat_handle));
 	if (handle == NULL)
@@ -115,6 +132,10 @@ xenstat_handle *xenstat_init(void)
 		return NULL;
 	}
 
+	qmp_path = getenv("XENSTAT_QMP_SOCKET");
+	if (qmp_path != NULL && !xenstat_set_qmp_path(handle, qmp_path))
+		fprintf(stderr, "Ignoring invalid XENSTAT_QMP_SOCKET\n");
+
 	return handle;
 }
 
@@ -126,11 +147,52 @@ void xenstat_uninit(xenstat_handle * handle)
 			collectors[i].uninit(handle);
 		xc_interface_close(handle->xc_handle);
 		xs_daemon_close(handle->xshandle);
+		free(handle->qmp_path);
 		free(handle->priv);
 		free(handle);
 	}
 }
 
+void xenstat_set_network_source(xenstat_handle * handle, unsigned int source)
+{
+	handle->net_source = source;
+}
+
+void xenstat_set_batch_reads(xenstat_handle * handle, int enable)
+{
+	handle->batch_reads = enable;
+}
+
+int xenstat_set_qmp_path(xenstat_handle * handle, const char *path)
+{
+	const char *p;
+	char *copy = NULL;
+	int conversions = 0;
+
+	/* One %u for the domain id, and no other conversion */
+	if (path != NULL) {
+		for (p = path; (p = strchr(p, '%')) != NULL; p += 2)
+			if (p[1] != 'u' || ++conversions > 1)
+				return 0;
+		if (path[0] != '\0' && conversions != 1)
+			return 0;
+		copy = strdup(path);
+		if (copy == NULL)
+			return 0;
+	}
+
+	free(handle->qmp_path);
+	handle->qmp_path = copy;
+	return 1;
+}
+
+void xenstat_set_domain_filter(xenstat_handle * handle,
+			       xenstat_domain_filter filter, void *arg)
+{
+	handle->filter = filter;
+	handle->filter_arg = arg;
+}
+
 static inline unsigned long long parse(char *s, char *match)
 {
 	char *s1 = strstr(s,match);
@@ -165,6 +227,7 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 	xc_physinfo_t physinfo = { 0 };
 	xc_domaininfo_t domaininfo[DOMAIN_CHUNK_SIZE];
 	unsigned int new_domains;
+	unsigned int next_domid = 0;
 	unsigned int i;
 
 	/* Create the node */
@@ -204,10 +267,14 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 	do {
 		xenstat_domain *domain, *tmp;
 
+		/* Domains filtered out leave gaps, so continue from the last
+		 * domain listed rather than from the count kept */
 		new_domains = xc_domain_getinfolist(handle->xc_handle,
-						    node->num_domains, 
+						    next_domid,
 						    DOMAIN_CHUNK_SIZE, 
 						    domaininfo);
+		if (new_domains > 0 && new_domains <= DOMAIN_CHUNK_SIZE)
+			next_domid = domaininfo[new_domains-1].domain + 1;
 
 		tmp = realloc(node->domains,
 			      (node->num_domains + new_domains)
@@ -259,6 +326,12 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 			domain->networks = NULL;
 			domain->num_vbds = 0;
 			domain->vbds = NULL;
+			if (handle->filter != NULL &&
+			    !handle->filter(domain, handle->filter_arg)) {
+				free(domain->name);
+				domain->name = NULL;
+				continue;
+			}
 			domain_get_tmem_stats(handle,domain);
 
 			domain++;
@@ -512,6 +585,7 @@ static int xenstat_collect_vcpus(xenstat_node * node)
 			else {
 				node->domains[i].vcpus[vcpu].online = info.online;
 				node->domains[i].vcpus[vcpu].ns = info.cpu_time;
+				node->domains[i].vcpus[vcpu].cpu = info.cpu;
 			}
 		}
 	}
@@ -543,6 +617,12 @@ unsigned long long xenstat_vcpu_ns(xenstat_vcpu * vcpu)
 	return vcpu->ns;
 }
 
+/* Get the physical CPU the VCPU last ran on */
+unsigned int xenstat_vcpu_cpu(xenstat_vcpu * vcpu)
+{
+	return vcpu->cpu;
+}
+
 /*
  * Network functions
  */
@@ -561,6 +641,24 @@ unsigned int xenstat_network_id(xenstat_network * network)
 	return network->id;
 }
 
+/* Get the host interface name of a network */
+const char *xenstat_network_name(xenstat_network * network)
+{
+	return network->name;
+}
+
+/* Get the MAC address of a network */
+const char *xenstat_network_mac(xenstat_network * network)
+{
+	return network->mac;
+}
+
+/* Get the xenstore backend path of a network */
+const char *xenstat_network_backend(xenstat_network * network)
+{
+	return network->backend;
+}
+
 /* Get the number of receive bytes */
 unsigned long long xenstat_network_rbytes(xenstat_network * network)
 {
@@ -609,6 +707,54 @@ unsigned long long xenstat_network_tdrop(xenstat_network * network)
 	return network->tdrop;
 }
 
+/* Get the number of receive FIFO overruns */
+unsigned long long xenstat_network_rfifo(xenstat_network * network)
+{
+	return network->rfifo;
+}
+
+/* Get the number of receive framing errors */
+unsigned long long xenstat_network_rframe(xenstat_network * network)
+{
+	return network->rframe;
+}
+
+/* Get the number of receive compressed packets */
+unsigned long long xenstat_network_rcompressed(xenstat_network * network)
+{
+	return network->rcompressed;
+}
+
+/* Get the number of receive multicast packets */
+unsigned long long xenstat_network_rmcast(xenstat_network * network)
+{
+	return network->rmcast;
+}
+
+/* Get the number of transmit FIFO overruns */
+unsigned long long xenstat_network_tfifo(xenstat_network * network)
+{
+	return network->tfifo;
+}
+
+/* Get the number of transmit collisions */
+unsigned long long xenstat_network_tcolls(xenstat_network * network)
+{
+	return network->tcolls;
+}
+
+/* Get the number of transmit carrier losses */
+unsigned long long xenstat_network_tcarrier(xenstat_network * network)
+{
+	return network->tcarrier;
+}
+
+/* Get the number of transmit compressed packets */
+unsigned long long xenstat_network_tcompressed(xenstat_network * network)
+{
+	return network->tcompressed;
+}
+
 /*
  * Xen version functions
  */
@@ -703,6 +849,559 @@ unsigned long long xenstat_vbd_wr_sects(xenstat_vbd * vbd)
 	return vbd->wr_sects;
 }
 
+/* Get the number of FLUSH requests */
+unsigned long long xenstat_vbd_f_reqs(xenstat_vbd * vbd)
+{
+	return vbd->f_reqs;
+}
+
+/* Get the number of DISCARD requests */
+unsigned long long xenstat_vbd_ds_reqs(xenstat_vbd * vbd)
+{
+	return vbd->ds_reqs;
+}
+
+/* Get the number of READ bytes */
+unsigned long long xenstat_vbd_rd_bytes(xenstat_vbd * vbd)
+{
+	return vbd->rd_sects * VBD_SECTOR_SIZE;
+}
+
+/* Get the number of WRITE bytes */
+unsigned long long xenstat_vbd_wr_bytes(xenstat_vbd * vbd)
+{
+	return vbd->wr_sects * VBD_SECTOR_SIZE;
+}
+
+/* Get the device name seen by the guest */
+const char *xenstat_vbd_name(xenstat_vbd * vbd)
+{
+	return vbd->name;
+}
+
+/* Get the xenstore backend path of a VBD */
+const char *xenstat_vbd_backend(xenstat_vbd * vbd)
+{
+	return vbd->backend;
+}
+
+/* Get the number of I/Os completed by the backing device */
+unsigned long long xenstat_vbd_bd_ios(xenstat_vbd * vbd)
+{
+	return vbd->bd_ios;
+}
+
+/* Get the milliseconds the backing device spent on them */
+unsigned long long xenstat_vbd_bd_ticks(xenstat_vbd * vbd)
+{
+	return vbd->bd_ticks;
+}
+
+/* Get the milliseconds the backing device was busy */
+unsigned long long xenstat_vbd_io_ticks(xenstat_vbd * vbd)
+{
+	return vbd->io_ticks;
+}
+
+/* Get the milliseconds weighted by the backing device queue length */
+unsigned long long xenstat_vbd_queue_ticks(xenstat_vbd * vbd)
+{
+	return vbd->queue_ticks;
+}
+
+/* Get the number of requests in flight on the backing device */
+unsigned int xenstat_vbd_inflight(xenstat_vbd * vbd)
+{
+	return vbd->inflight;
+}
+
+/*
+ * Device name functions
+ */
+
+/* Frontend device class of each devname type; every VBD type has a vbd frontend */
+static const char *devname_frontend_type[] = {
+	"vif",		/* networks */
+	NULL,		/* unidentified VBD */
+	"vbd",		/* BlkBack */
+	"vbd",		/* BlkTap */
+	"vbd",		/* QDisk */
+};
+
+#define NUM_DEVNAME_TYPES \
+	(sizeof(devname_frontend_type)/sizeof(devname_frontend_type[0]))
+
+static int compare_devname(const void *a, const void *b)
+{
+	const struct xenstat_devname *d1 = a, *d2 = b;
+
+	if (d1->type != d2->type)
+		return d1->type < d2->type ? -1 : 1;
+	if (d1->domid != d2->domid)
+		return d1->domid < d2->domid ? -1 : 1;
+	if (d1->devid != d2->devid)
+		return d1->devid < d2->devid ? -1 : 1;
+	return 0;
+}
+
+/* Copy xenstore key dir/key to buf, or "" if it cannot be read */
+static void xenstat_read_devname(xenstat_handle * handle, const char *dir,
+				 const char *key, char *buf, size_t size)
+{
+	char path[BACKEND_PATH_SIZE + 16], *value;
+
+	buf[0] = '\0';
+	snprintf(path, sizeof(path), "%s/%s", dir, key);
+	value = xs_read(handle->xshandle, XBT_NULL, path, NULL);
+	if (value == NULL)
+		return;
+	snprintf(buf, size, "%s", value);
+	free(value);
+}
+
+/* Read the names of a device from xenstore.  The backend, which may run in a */
+/* driver domain, is found from the frontend.  Keys not written yet, while the */
+/* device is being set up, leave it incomplete, to be read again next sample. */
+static void xenstat_read_devnames(xenstat_handle * handle,
+				  struct xenstat_devname *devname)
+{
+	char frontend[BACKEND_PATH_SIZE];
+
+	devname->name[0] = devname->mac[0] = devname->backend[0] = '\0';
+	devname->complete = 1;
+	if (devname->type >= NUM_DEVNAME_TYPES ||
+	    devname_frontend_type[devname->type] == NULL)
+		return;
+
+	snprintf(frontend, sizeof(frontend), "/local/domain/%u/device/%s/%u",
+		 devname->domid, devname_frontend_type[devname->type],
+		 devname->devid);
+	xenstat_read_devname(handle, frontend, "backend", devname->backend,
+			     sizeof(devname->backend));
+
+	if (devname->type == 0) {
+		if (devname->backend[0] != '\0') {
+			xenstat_read_devname(handle, devname->backend,
+					     "vifname", devname->name,
+					     sizeof(devname->name));
+			xenstat_read_devname(handle, devname->backend, "mac",
+					     devname->mac, sizeof(devname->mac));
+		}
+		devname->complete = devname->mac[0] != '\0';
+		if (devname->name[0] == '\0')
+			snprintf(devname->name, sizeof(devname->name),
+				 "vif%u.%u", devname->domid, devname->devid);
+	} else {
+		if (devname->backend[0] != '\0')
+			xenstat_read_devname(handle, devname->backend, "dev",
+					     devname->name,
+					     sizeof(devname->name));
+		devname->complete = devname->name[0] != '\0';
+	}
+}
+
+/* Return the names of a device, reading them from xenstore if they are not known */
+/* yet.  The cache is only sorted again at the end of the sample, but as a device */
+/* comes once per sample, the entries appended since can't match and only the */
+/* first num_sorted are searched.  Returns NULL if memory could not be allocated. */
+static struct xenstat_devname *
+xenstat_get_devname(xenstat_handle * handle, unsigned int num_sorted,
+		    unsigned int type, unsigned int domid, unsigned int devid)
+{
+	struct xenstat_devname key, *devname;
+
+	key.type = type;
+	key.domid = domid;
+	key.devid = devid;
+	devname = bsearch(&key, handle->devnames, num_sorted,
+			  sizeof(key), compare_devname);
+	if (devname != NULL) {
+		devname->gen = handle->devnames_gen;
+		if (!devname->complete)
+			xenstat_read_devnames(handle, devname);
+		return devname;
+	}
+
+	if (handle->num_devnames == handle->max_devnames) {
+		unsigned int max = handle->max_devnames ?
+			2 * handle->max_devnames : 64;
+
+		devname = realloc(handle->devnames, max * sizeof(*devname));
+		if (devname == NULL)
+			return NULL;
+		handle->devnames = devname;
+		handle->max_devnames = max;
+	}
+
+	devname = &handle->devnames[handle->num_devnames++];
+	*devname = key;
+	devname->gen = handle->devnames_gen;
+	xenstat_read_devnames(handle, devname);
+
+	return devname;
+}
+
+/* Name the networks and VBDs of each domain.  Names are read from xenstore the */
+/* first time a device is seen, until they are all there, and kept in the handle */
+/* while the device exists. */
+static int xenstat_collect_devnames(xenstat_node * node)
+{
+	xenstat_handle *handle = node->handle;
+	struct xenstat_devname *devname;
+	unsigned int i, j, num_sorted = handle->num_devnames;
+
+	handle->devnames_gen++;
+
+	for (i = 0; i < node->num_domains; i++) {
+		xenstat_domain *domain = &node->domains[i];
+
+		for (j = 0; j < domain->num_networks; j++) {
+			xenstat_network *network = &domain->networks[j];
+
+			devname = xenstat_get_devname(handle, num_sorted, 0,
+						      domain->id, network->id);
+			if (devname == NULL)
+				return 0;
+			strcpy(network->name, devname->name);
+			strcpy(network->mac, devname->mac);
+			strcpy(network->backend, devname->backend);
+		}
+
+		for (j = 0; j < domain->num_vbds; j++) {
+			xenstat_vbd *vbd = &domain->vbds[j];
+
+			devname = xenstat_get_devname(handle, num_sorted,
+						      vbd->back_type + 1,
+						      domain->id, vbd->dev);
+			if (devname == NULL)
+				return 0;
+			strcpy(vbd->name, devname->name);
+			strcpy(vbd->backend, devname->backend);
+		}
+	}
+
+	/* Forget the devices that went away */
+	for (i = j = 0; i < handle->num_devnames; i++) {
+		if (handle->devnames[i].gen != handle->devnames_gen)
+			continue;
+		if (i != j)
+			handle->devnames[j] = handle->devnames[i];
+		j++;
+	}
+	handle->num_devnames = j;
+	qsort(handle->devnames, handle->num_devnames,
+	      sizeof(struct xenstat_devname), compare_devname);
+
+	return 1;
+}
+
+/* Free device names - nothing to do, they live in the networks and VBDs */
+static void xenstat_free_devnames(xenstat_node * node)
+{
+}
+
+/* Free the device names cached in handle */
+static void xenstat_uninit_devnames(xenstat_handle * handle)
+{
+	free(handle->devnames);
+}
+
+/*
+ * Physical CPU functions
+ */
+
+/* Collect the time the physical CPUs spent idle */
+static int xenstat_collect_pcpus(xenstat_node * node)
+{
+	xc_interface *xch = node->handle->xc_handle;
+	xc_cpuinfo_t *info;
+	int i, max_cpus, nr_cpus = 0, ret = 0;
+
+	max_cpus = xc_get_max_cpus(xch);
+	if (max_cpus <= 0)
+		return 0;
+
+	info = malloc(max_cpus * sizeof(xc_cpuinfo_t));
+	if (info == NULL)
+		return 0;
+
+	if (xc_getcpuinfo(xch, max_cpus, info, &nr_cpus) == 0) {
+		node->idle_ns = 0;
+		for (i = 0; i < nr_cpus; i++)
+			node->idle_ns += info[i].idletime;
+		ret = 1;
+	}
+
+	free(info);
+	return ret;
+}
+
+/* Free physical CPU information - nothing to do */
+static void xenstat_free_pcpus(xenstat_node * node)
+{
+}
+
+/* Free physical CPU information in handle - nothing to do */
+static void xenstat_uninit_pcpus(xenstat_handle * handle)
+{
+}
+
+/* Get the time the physical CPUs spent idle, summed over all of them */
+unsigned long long xenstat_node_idle_ns(xenstat_node * node)
+{
+	return node->idle_ns;
+}
+
+/*
+ * NUMA functions
+ */
+
+/* Fill in the per-NUMA-node memory, CPU counts and distances of the node.
+ * cpu_to_node receives the node of each physical CPU (max_cpus entries).
+ * Returns 1 on success, 0 if the hypervisor gave no NUMA information and -1
+ * if memory could not be allocated. */
+static int xenstat_collect_numa_topology(xenstat_node * node,
+					 unsigned int *cpu_to_node,
+					 int max_cpus)
+{
+	xc_interface *xch = node->handle->xc_handle;
+	xc_numainfo_t ninfo;
+	xc_topologyinfo_t tinfo;
+	DECLARE_HYPERCALL_BUFFER(xc_node_to_memsize_t, memsize);
+	DECLARE_HYPERCALL_BUFFER(xc_node_to_memfree_t, memfree);
+	DECLARE_HYPERCALL_BUFFER(uint32_t, distance);
+	DECLARE_HYPERCALL_BUFFER(xc_cpu_to_node_t, cpunode);
+	unsigned int i, j, num_nodes;
+	int max_nodes, ret = 0;
+
+	max_nodes = xc_get_max_nodes(xch);
+	if (max_nodes <= 0)
+		return 0;
+
+	memsize = xc_hypercall_buffer_alloc(xch, memsize,
+					    sizeof(*memsize) * max_nodes);
+	memfree = xc_hypercall_buffer_alloc(xch, memfree,
+					    sizeof(*memfree) * max_nodes);
+	distance = xc_hypercall_buffer_alloc(xch, distance, sizeof(*distance)
+					     * max_nodes * max_nodes);
+	cpunode = xc_hypercall_buffer_alloc(xch, cpunode,
+					    sizeof(*cpunode) * max_cpus);
+	if (memsize == NULL || memfree == NULL || distance == NULL
+	    || cpunode == NULL) {
+		ret = -1;
+		goto out;
+	}
+
+	set_xen_guest_handle(ninfo.node_to_memsize, memsize);
+	set_xen_guest_handle(ninfo.node_to_memfree, memfree);
+	set_xen_guest_handle(ninfo.node_to_node_distance, distance);
+	ninfo.max_node_index = max_nodes - 1;
+	if (xc_numainfo(xch, &ninfo) != 0)
+		goto out;
+
+	set_xen_guest_handle(tinfo.cpu_to_core, HYPERCALL_BUFFER_NULL);
+	set_xen_guest_handle(tinfo.cpu_to_socket, HYPERCALL_BUFFER_NULL);
+	set_xen_guest_handle(tinfo.cpu_to_node, cpunode);
+	tinfo.max_cpu_index = max_cpus - 1;
+	if (xc_topologyinfo(xch, &tinfo) != 0)
+		goto out;
+
+	num_nodes = ninfo.max_node_index + 1;
+	if (num_nodes > max_nodes)
+		num_nodes = max_nodes;
+
+	node->numa_nodes = calloc(num_nodes, sizeof(xenstat_numa_node));
+	node->numa_distance = calloc(num_nodes * num_nodes,
+				     sizeof(unsigned int));
+	if (node->numa_nodes == NULL || node->numa_distance == NULL) {
+		ret = -1;
+		goto out;
+	}
+	node->num_numa_nodes = num_nodes;
+
+	for (i = 0; i < num_nodes; i++) {
+		/* Holes in the node numbering are reported as invalid */
+		if (memsize[i] != INVALID_NUMAINFO_ID) {
+			node->numa_nodes[i].tot_mem = memsize[i];
+			node->numa_nodes[i].free_mem = memfree[i];
+		}
+		for (j = 0; j < num_nodes; j++)
+			node->numa_distance[i * num_nodes + j] =
+				distance[i * max_nodes + j];
+	}
+
+	for (i = 0; i < max_cpus; i++) {
+		cpu_to_node[i] = INVALID_TOPOLOGY_ID;
+		if (i > tinfo.max_cpu_index || cpunode[i] >= num_nodes)
+			continue;
+		cpu_to_node[i] = cpunode[i];
+		node->numa_nodes[cpunode[i]].num_cpus++;
+	}
+	ret = 1;
+
+out:
+	xc_hypercall_buffer_free(xch, memsize);
+	xc_hypercall_buffer_free(xch, memfree);
+	xc_hypercall_buffer_free(xch, distance);
+	xc_hypercall_buffer_free(xch, cpunode);
+	return ret;
+}
+
+/* Collect NUMA topology and the NUMA placement of each domain */
+static int xenstat_collect_numa(xenstat_node * node)
+{
+	xc_interface *xch = node->handle->xc_handle;
+	xc_nodemap_t nodemap;
+	unsigned int *cpu_to_node;
+	unsigned int i, nid, vcpu, num_affine;
+	unsigned char *home;
+	int max_cpus, ret = 0;
+
+	max_cpus = xc_get_max_cpus(xch);
+	if (max_cpus <= 0)
+		return 0;
+
+	cpu_to_node = malloc(max_cpus * sizeof(unsigned int));
+	nodemap = xc_nodemap_alloc(xch);
+	if (cpu_to_node == NULL || nodemap == NULL)
+		goto out;
+
+	ret = xenstat_collect_numa_topology(node, cpu_to_node, max_cpus);
+	if (ret <= 0) {
+		/* Not fatal: the hypervisor may not expose NUMA information */
+		ret = (ret == 0);
+		goto out;
+	}
+	ret = 0;
+
+	/* Nodes some VCPU of the current domain runs on, one flag per node */
+	home = malloc(node->num_numa_nodes);
+	if (home == NULL)
+		goto out;
+
+	for (i = 0; i < node->num_domains; i++) {
+		xenstat_domain *domain = &node->domains[i];
+
+		domain->numa_mem = calloc(node->num_numa_nodes,
+					  sizeof(unsigned long long));
+		if (domain->numa_mem == NULL)
+			break;
+		domain->num_numa_nodes = node->num_numa_nodes;
+
+		/* Domain is in transition if this fails; leave it unplaced */
+		if (xc_domain_node_getaffinity(xch, domain->id, nodemap) != 0)
+			continue;
+
+		num_affine = 0;
+		for (nid = 0; nid < node->num_numa_nodes; nid++)
+			if (nodemap[nid / 8] & (1 << (nid % 8)))
+				num_affine++;
+		if (num_affine == 0)
+			continue;
+
+		/* Xen stripes a domain's allocations over its node affinity, so
+		 * an even split is the best estimate without per-node counts */
+		for (nid = 0; nid < node->num_numa_nodes; nid++)
+			if (nodemap[nid / 8] & (1 << (nid % 8)))
+				domain->numa_mem[nid] =
+					domain->cur_mem / num_affine;
+
+		if (domain->vcpus == NULL)
+			continue;
+
+		memset(home, 0, node->num_numa_nodes);
+		for (vcpu = 0; vcpu < domain->num_vcpus; vcpu++) {
+			unsigned int cpu = domain->vcpus[vcpu].cpu;
+			if (domain->vcpus[vcpu].online && cpu < max_cpus
+			    && cpu_to_node[cpu] != INVALID_TOPOLOGY_ID)
+				home[cpu_to_node[cpu]] = 1;
+		}
+
+		for (nid = 0; nid < node->num_numa_nodes; nid++)
+			if (!home[nid])
+				domain->numa_remote_mem +=
+					domain->numa_mem[nid];
+	}
+	free(home);
+	ret = (i == node->num_domains);
+
+out:
+	free(nodemap);
+	free(cpu_to_node);
+	return ret;
+}
+
+/* Free NUMA information */
+static void xenstat_free_numa(xenstat_node * node)
+{
+	unsigned int i;
+	for (i = 0; i < node->num_domains; i++)
+		free(node->domains[i].numa_mem);
+	free(node->numa_nodes);
+	free(node->numa_distance);
+}
+
+/* Free NUMA information in handle - nothing to do */
+static void xenstat_uninit_numa(xenstat_handle * handle)
+{
+}
+
+unsigned int xenstat_node_num_numa_nodes(xenstat_node * node)
+{
+	return node->num_numa_nodes;
+}
+
+/* Get amount of total memory on a NUMA node */
+unsigned long long xenstat_node_numa_tot_mem(xenstat_node * node,
+					     unsigned int nid)
+{
+	if (nid < node->num_numa_nodes)
+		return node->numa_nodes[nid].tot_mem;
+	return 0;
+}
+
+/* Get amount of free memory on a NUMA node */
+unsigned long long xenstat_node_numa_free_mem(xenstat_node * node,
+					      unsigned int nid)
+{
+	if (nid < node->num_numa_nodes)
+		return node->numa_nodes[nid].free_mem;
+	return 0;
+}
+
+/* Find the number of CPUs on a NUMA node */
+unsigned int xenstat_node_numa_num_cpus(xenstat_node * node,
+					unsigned int nid)
+{
+	if (nid < node->num_numa_nodes)
+		return node->numa_nodes[nid].num_cpus;
+	return 0;
+}
+
+/* Get the distance between two NUMA nodes */
+unsigned int xenstat_node_numa_distance(xenstat_node * node,
+					unsigned int from, unsigned int to)
+{
+	if (from < node->num_numa_nodes && to < node->num_numa_nodes)
+		return node->numa_distance[from * node->num_numa_nodes + to];
+	return 0;
+}
+
+/* Get the estimate of the domain's memory on a NUMA node */
+unsigned long long xenstat_domain_numa_mem_est(xenstat_domain * domain,
+					       unsigned int nid)
+{
+	if (domain->numa_mem && nid < domain->num_numa_nodes)
+		return domain->numa_mem[nid];
+	return 0;
+}
+
+/* Get the estimate of the domain's memory away from its VCPUs */
+unsigned long long xenstat_domain_numa_remote_mem_est(xenstat_domain * domain)
+{
+	return domain->numa_remote_mem;
+}
+
 /*
  * Tmem functions
  */
@@ -43,7 +43,50 @@ void xenstat_uninit(xenstat_handle * handle);
 #define XENSTAT_VBD 0x8
 #define XENSTAT_ALL (XENSTAT_VCPU|XENSTAT_NETWORK|XENSTAT_XEN_VERSION|XENSTAT_VBD)
 
-/* Get all available information about a node */
+/* Collectors that cost extra work each sample, not part of XENSTAT_ALL and
+ * only run when asked for */
+#define XENSTAT_NUMA 0x10
+#define XENSTAT_DEVNAMES 0x20
+#define XENSTAT_PCPU 0x40
+
+/* Sources of network statistics, see xenstat_set_network_source() */
+#define XENSTAT_NETSRC_AUTO 0
+#define XENSTAT_NETSRC_PROCFS 1
+#define XENSTAT_NETSRC_NETLINK 2
+
+/* Select where network statistics are read from on Linux.  The default,
+ * XENSTAT_NETSRC_AUTO, dumps link statistics over rtnetlink and falls back
+ * to /proc/net/dev if that fails. */
+void xenstat_set_network_source(xenstat_handle * handle, unsigned int source);
+
+/* Submit the reads of all VBD statistics files of a sample as one io_uring
+ * batch on Linux, falling back to pread() where io_uring is not available.
+ * Off by default: sysfs reads are not asynchronous, so the kernel hands
+ * each of them to a worker thread and the batch is usually slower. */
+void xenstat_set_batch_reads(xenstat_handle * handle, int enable);
+
+/* Set the path of the QMP socket the device model of each domain serves to
+ * libxenstat, with %u standing for the domain id.  qdisk statistics are
+ * queried over it, for the domains xenstore lists a device model for in
+ * dom0.  The default is the XENSTAT_QMP_SOCKET environment variable, else
+ * /var/run/xen/qmp-libxenstat-%u; NULL restores it and an empty path stops
+ * querying device models.  Returns 0 if path is not valid or could not be
+ * copied. */
+int xenstat_set_qmp_path(xenstat_handle * handle, const char *path);
+
+/* Only collect the domains for which filter returns non-zero.  It is called
+ * with the id, name and state of each domain as soon as the hypervisor has
+ * listed it, so domains filtered out never reach the collectors.  A NULL
+ * filter, the default, keeps every domain. */
+typedef int (*xenstat_domain_filter)(xenstat_domain * domain, void *arg);
+void xenstat_set_domain_filter(xenstat_handle * handle,
+			       xenstat_domain_filter filter, void *arg);
+
+/* Get all available information about a node.  On Linux XENSTAT_VBD keeps
+ * the VBD statistics files open across calls, using up to half of the soft
+ * RLIMIT_NOFILE (at most 32768 files); applications monitoring many VBDs
+ * should raise that limit first.  The files past the budget are opened and
+ * closed on each call. */
 xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags);
 
 /* Free the information */
@@ -82,6 +125,27 @@ unsigned int xenstat_node_num_cpus(xenstat_node * node);
 /* Get information about the CPU speed */
 unsigned long long xenstat_node_cpu_hz(xenstat_node * node);
 
+/* Get the time in nanoseconds the physical CPUs spent idle, summed over all
+ * of them (XENSTAT_PCPU) */
+unsigned long long xenstat_node_idle_ns(xenstat_node * node);
+
+/* Find the number of NUMA nodes on a node (XENSTAT_NUMA) */
+unsigned int xenstat_node_num_numa_nodes(xenstat_node * node);
+
+/* Get amount of total/free memory on the given NUMA node */
+unsigned long long xenstat_node_numa_tot_mem(xenstat_node * node,
+					     unsigned int nid);
+unsigned long long xenstat_node_numa_free_mem(xenstat_node * node,
+					      unsigned int nid);
+
+/* Find the number of CPUs on the given NUMA node */
+unsigned int xenstat_node_numa_num_cpus(xenstat_node * node,
+					unsigned int nid);
+
+/* Get the distance between two NUMA nodes, as reported by the SLIT */
+unsigned int xenstat_node_numa_distance(xenstat_node * node,
+					unsigned int from, unsigned int to);
+
 /*
  * Domain functions - extract information from a xenstat_domain
  */
@@ -136,6 +200,18 @@ xenstat_vbd *xenstat_domain_vbd(xenstat_domain * domain,
 /* Get the tmem information for a given domain */
 xenstat_tmem *xenstat_domain_tmem(xenstat_domain * domain);
 
+/* Get an estimate of the domain's memory on the given NUMA node.  Xen does
+ * not report per-node page counts, so this is not a measurement: it is the
+ * current reservation split evenly over the nodes of the domain's node
+ * affinity, and 0 for the nodes outside it. */
+unsigned long long xenstat_domain_numa_mem_est(xenstat_domain * domain,
+					       unsigned int nid);
+
+/* Get an estimate, as above, of the domain's memory on NUMA nodes none of
+ * its VCPUs are running on.  Only meaningful when XENSTAT_VCPU is collected
+ * as well. */
+unsigned long long xenstat_domain_numa_remote_mem_est(xenstat_domain * domain);
+
 /*
  * VCPU functions - extract information from a xenstat_vcpu
  */
@@ -144,6 +220,9 @@ xenstat_tmem *xenstat_domain_tmem(xenstat_domain * domain);
 unsigned int xenstat_vcpu_online(xenstat_vcpu * vcpu);
 unsigned long long xenstat_vcpu_ns(xenstat_vcpu * vcpu);
 
+/* Get the physical CPU the VCPU last ran on */
+unsigned int xenstat_vcpu_cpu(xenstat_vcpu * vcpu);
+
 
 /*
  * Network functions - extract information from a xenstat_network
@@ -152,6 +231,13 @@ unsigned long long xenstat_vcpu_ns(xenstat_vcpu * vcpu);
 /* Get the ID for this network */
 unsigned int xenstat_network_id(xenstat_network * network);
 
+/* Get the host interface name (eg. "vif3.0"), the MAC address seen by the
+ * guest and the xenstore backend path of this network, or "" if unknown.
+ * Needs XENSTAT_DEVNAMES. */
+const char *xenstat_network_name(xenstat_network * network);
+const char *xenstat_network_mac(xenstat_network * network);
+const char *xenstat_network_backend(xenstat_network * network);
+
 /* Get the number of receive bytes for this network */
 unsigned long long xenstat_network_rbytes(xenstat_network * network);
 
@@ -176,6 +262,20 @@ unsigned long long xenstat_network_terrs(xenstat_network * network);
 /* Get the number of transmit drops for this network */
 unsigned long long xenstat_network_tdrop(xenstat_network * network);
 
+/* Get the number of receive FIFO overruns, framing errors, compressed
+ * packets and multicast packets for this network */
+unsigned long long xenstat_network_rfifo(xenstat_network * network);
+unsigned long long xenstat_network_rframe(xenstat_network * network);
+unsigned long long xenstat_network_rcompressed(xenstat_network * network);
+unsigned long long xenstat_network_rmcast(xenstat_network * network);
+
+/* Get the number of transmit FIFO overruns, collisions, carrier losses and
+ * compressed packets for this network */
+unsigned long long xenstat_network_tfifo(xenstat_network * network);
+unsigned long long xenstat_network_tcolls(xenstat_network * network);
+unsigned long long xenstat_network_tcarrier(xenstat_network * network);
+unsigned long long xenstat_network_tcompressed(xenstat_network * network);
+
 /*
  * VBD functions - extract information from a xen_vbd
  */
@@ -193,6 +293,29 @@ unsigned long long xenstat_vbd_wr_reqs(xenstat_vbd * vbd);
 unsigned long long xenstat_vbd_rd_sects(xenstat_vbd * vbd);
 unsigned long long xenstat_vbd_wr_sects(xenstat_vbd * vbd);
 
+/* Get the number of FLUSH/DISCARD requests for vbd */
+unsigned long long xenstat_vbd_f_reqs(xenstat_vbd * vbd);
+unsigned long long xenstat_vbd_ds_reqs(xenstat_vbd * vbd);
+
+/* Get the number of bytes read/written for vbd */
+unsigned long long xenstat_vbd_rd_bytes(xenstat_vbd * vbd);
+unsigned long long xenstat_vbd_wr_bytes(xenstat_vbd * vbd);
+
+/* Get the device name seen by the guest (eg. "xvda") and the xenstore
+ * backend path of vbd, or "" if unknown.  Needs XENSTAT_DEVNAMES. */
+const char *xenstat_vbd_name(xenstat_vbd * vbd);
+const char *xenstat_vbd_backend(xenstat_vbd * vbd);
+
+/* Get the statistics of the block device backing vbd, as in
+ * /sys/block/<dev>/stat: I/Os completed and milliseconds spent on them,
+ * milliseconds busy, milliseconds weighted by the queue length, and
+ * requests in flight.  All zero when the backing device is unknown. */
+unsigned long long xenstat_vbd_bd_ios(xenstat_vbd * vbd);
+unsigned long long xenstat_vbd_bd_ticks(xenstat_vbd * vbd);
+unsigned long long xenstat_vbd_io_ticks(xenstat_vbd * vbd);
+unsigned long long xenstat_vbd_queue_ticks(xenstat_vbd * vbd);
+unsigned int xenstat_vbd_inflight(xenstat_vbd * vbd);
+
 /*
  * Tmem functions - extract tmem information
  */
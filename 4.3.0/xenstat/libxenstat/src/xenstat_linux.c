@@ -24,19 +24,176 @@
 #include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <regex.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_link.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+/* IORING_OP_READ is an enumerator; IORING_FEAT_RW_CUR_POS came with it in 5.6 */
+#ifdef IORING_FEAT_RW_CUR_POS
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING
+#endif
+#endif
+#endif
 
 #include "xenstat_priv.h"
 
+/* Overridden by the benchmark, to run against fake backends */
+#ifndef SYSFS_VBD_PATH
 #define SYSFS_VBD_PATH "/sys/bus/xen-backend/devices"
+#endif
+#define IFACE_NAME_LEN 16
+#define NETLINK_BUF_SIZE 32768
+#define VBD_NAME_LEN 32
+#define STAT_BUF_LEN 32
+#define BD_STAT_BUF_LEN 256
+#define RING_ENTRIES 256
+#define VBD_MAX_NOFILE 65536
+
+/* Kinds of struct bridge_dev, in order of preference for dom0's stats */
+enum {
+	UPLINK_BRIDGE,
+	UPLINK_BOND
+};
+
+struct bridge_dev {
+	int ifindex;
+	int kind;			/* UPLINK_* */
+	int has_vifs;			/* A vif was seen enslaved to it */
+	char name[IFACE_NAME_LEN];
+};
+
+/* Device statistics queued until every domain's device count is known */
+struct pending_net {
+	xenstat_domain *domain;
+	int bridge;			/* Bridge stats for idle dom0 vifs */
+	xenstat_network net;
+};
+
+/* Statistics files of a VBD backend */
+enum {
+	VBD_STAT_OO_REQ,
+	VBD_STAT_RD_REQ,
+	VBD_STAT_WR_REQ,
+	VBD_STAT_F_REQ,
+	VBD_STAT_DS_REQ,
+	VBD_STAT_RD_SECT,
+	VBD_STAT_WR_SECT,
+	VBD_NUM_STATS
+};
+
+/* stat of struct stat_read for the stat file of the backing block device */
+#define VBD_STAT_BACKING VBD_NUM_STATS
+
+/* Statistics without which a VBD is not reported */
+#define VBD_REQUIRED_STATS ((1 << VBD_STAT_OO_REQ) | (1 << VBD_STAT_RD_REQ) | \
+			    (1 << VBD_STAT_WR_REQ) | (1 << VBD_STAT_RD_SECT) | \
+			    (1 << VBD_STAT_WR_SECT))
+
+static const char *vbd_stat_names[VBD_NUM_STATS] = {
+	"oo_req", "rd_req", "wr_req", "f_req", "ds_req", "rd_sect", "wr_sect"
+};
+
+/* A VBD backend directory, with its statistics files kept open across samples */
+struct vbd_dev {
+	char name[VBD_NAME_LEN];
+	unsigned int domid;
+	unsigned int back_type;
+	unsigned int dev;
+	int fd[VBD_NUM_STATS];
+	unsigned int missing;		/* Statistics files not present */
+	int seen;
+	xenstat_domain *domain;		/* Owner in the current sample */
+	unsigned long long val[VBD_NUM_STATS];
+	unsigned int valid;		/* Statistics read in this sample */
+	int bd_fd;			/* stat of the backing block device */
+	int bd_missing;			/* No physical_device attribute */
+	int bd_res;			/* Backing stat read in this sample */
+};
+
+/* One read of a batch */
+struct stat_read {
+	int fd;
+	unsigned int dev;		/* Index in vbd_devs */
+	int stat;			/* VBD_STAT_*, or VBD_STAT_BACKING */
+	int res;			/* Bytes read, or -errno */
+	char *buf;			/* val, or the backing stat buffer */
+	size_t size;
+	char val[STAT_BUF_LEN];
+};
+
+#ifdef HAVE_IO_URING
+/* Rings shared with the kernel, see io_uring_setup(2) */
+struct io_ring {
+	int fd;
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+#endif
+
+struct pending_vbd {
+	xenstat_domain *domain;
+	xenstat_vbd vbd;
+};
 
 struct priv_data {
-	FILE *procnetdev;
+	int procnetdev;
+	char *procnetdev_buf;		/* Contents of the last read */
+	size_t procnetdev_buf_size;
+	int netlink;			/* rtnetlink socket for link dumps */
+	char *netlink_buf;
+	unsigned int netlink_seq;
+	int link_monitor;		/* rtnetlink socket for link changes */
+	int link_monitor_failed;
+	struct bridge_dev *bridges;	/* Bridges and bonds of the host */
+	unsigned int num_bridges;
+	unsigned int max_bridges;
+	int bridges_valid;
+	struct pending_net *pending_nets;
+	unsigned int num_pending_nets;
+	unsigned int max_pending_nets;
 	DIR *sysfsvbd;
+	struct vbd_dev *vbd_devs;	/* Sorted by name */
+	unsigned int num_vbd_devs;
+	unsigned int max_vbd_devs;
+	int vbds_valid;
+	int uevent;			/* Kernel uevents on backend devices */
+	int uevent_failed;
+	unsigned int num_vbd_fds;
+	unsigned int max_vbd_fds;
+	struct stat_read *stat_reads;
+	unsigned int max_stat_reads;
+	char *bd_bufs;			/* BD_STAT_BUF_LEN per vbd_devs entry */
+#ifdef HAVE_IO_URING
+	struct io_ring *ring;
+	int ring_failed;
+#endif
+	xenstat_qmp *qmp;		/* Device model connections */
+	struct pending_vbd *pending_vbds;
+	unsigned int num_pending_vbds;
+	unsigned int max_pending_vbds;
 };
 
 static struct priv_data *
@@ -49,8 +206,41 @@ get_priv_data(xenstat_handle *handle)
 	if (handle->priv == NULL)
 		return (NULL);
 
-	((struct priv_data *)handle->priv)->procnetdev = NULL;
+	((struct priv_data *)handle->priv)->procnetdev = -1;
+	((struct priv_data *)handle->priv)->procnetdev_buf = NULL;
+	((struct priv_data *)handle->priv)->procnetdev_buf_size = 0;
+	((struct priv_data *)handle->priv)->netlink = -1;
+	((struct priv_data *)handle->priv)->netlink_buf = NULL;
+	((struct priv_data *)handle->priv)->netlink_seq = 0;
+	((struct priv_data *)handle->priv)->link_monitor = -1;
+	((struct priv_data *)handle->priv)->link_monitor_failed = 0;
+	((struct priv_data *)handle->priv)->bridges = NULL;
+	((struct priv_data *)handle->priv)->num_bridges = 0;
+	((struct priv_data *)handle->priv)->max_bridges = 0;
+	((struct priv_data *)handle->priv)->bridges_valid = 0;
+	((struct priv_data *)handle->priv)->pending_nets = NULL;
+	((struct priv_data *)handle->priv)->num_pending_nets = 0;
+	((struct priv_data *)handle->priv)->max_pending_nets = 0;
 	((struct priv_data *)handle->priv)->sysfsvbd = NULL;
+	((struct priv_data *)handle->priv)->vbd_devs = NULL;
+	((struct priv_data *)handle->priv)->num_vbd_devs = 0;
+	((struct priv_data *)handle->priv)->max_vbd_devs = 0;
+	((struct priv_data *)handle->priv)->vbds_valid = 0;
+	((struct priv_data *)handle->priv)->uevent = -1;
+	((struct priv_data *)handle->priv)->uevent_failed = 0;
+	((struct priv_data *)handle->priv)->num_vbd_fds = 0;
+	((struct priv_data *)handle->priv)->max_vbd_fds = 0;
+	((struct priv_data *)handle->priv)->stat_reads = NULL;
+	((struct priv_data *)handle->priv)->max_stat_reads = 0;
+	((struct priv_data *)handle->priv)->bd_bufs = NULL;
+#ifdef HAVE_IO_URING
+	((struct priv_data *)handle->priv)->ring = NULL;
+	((struct priv_data *)handle->priv)->ring_failed = 0;
+#endif
+	((struct priv_data *)handle->priv)->qmp = NULL;
+	((struct priv_data *)handle->priv)->pending_vbds = NULL;
+	((struct priv_data *)handle->priv)->num_pending_vbds = 0;
+	((struct priv_data *)handle->priv)->max_pending_vbds = 0;
 
 	return handle->priv;
 }
@@ -62,186 +252,733 @@ static const char PROCNETDEV_HEADER[] =
     " face |bytes    packets errs drop fifo frame compressed multicast|"
     "bytes    packets errs drop fifo colls carrier compressed\n";
 
-/* We need to get the name of the bridge interface for use with bonding interfaces */
-/* Use excludeName parameter to avoid adding bridges we don't care about, eg. virbr0 */
-char *getBridge(char *excludeName)
+/* We need to get the name of the bridge interface for use with bonding interfaces.  The */
+/* bridges of the host are scanned from sysfs once, then kept up to date from rtnetlink */
+/* link notifications, so a tick only has to drain the (usually empty) socket.  Bonds */
+/* are tracked the same way, for hosts whose vifs reach the bond through a switch */
+/* that is not a Linux bridge, eg. Open vSwitch. */
+
+/* Bridges we don't care about, eg. virbr0 */
+#define BRIDGE_EXCLUDE "vir"
+
+/* Remember bridge or bond ifindex, named name, unless it is excluded */
+static int bridge_add(struct priv_data *priv, int ifindex, const char *name,
+		      int kind)
+{
+	unsigned int i;
+
+	for (i = 0; i < priv->num_bridges; i++)
+		if (priv->bridges[i].ifindex == ifindex)
+			break;
+
+	if (strstr(name, BRIDGE_EXCLUDE) != NULL) {
+		/* Renamed to something we ignore */
+		if (i < priv->num_bridges)
+			priv->bridges[i] = priv->bridges[--priv->num_bridges];
+		return 1;
+	}
+
+	if (i == priv->num_bridges) {
+		if (priv->num_bridges == priv->max_bridges) {
+			unsigned int max = priv->max_bridges ?
+				2 * priv->max_bridges : 4;
+			struct bridge_dev *tmp = realloc(priv->bridges,
+							 max * sizeof(*tmp));
+			if (tmp == NULL)
+				return 0;
+			priv->bridges = tmp;
+			priv->max_bridges = max;
+		}
+		priv->num_bridges++;
+		priv->bridges[i].has_vifs = 0;
+	}
+
+	priv->bridges[i].ifindex = ifindex;
+	priv->bridges[i].kind = kind;
+	snprintf(priv->bridges[i].name, IFACE_NAME_LEN, "%s", name);
+	return 1;
+}
+
+/* Forget bridge or bond ifindex */
+static void bridge_del(struct priv_data *priv, int ifindex)
+{
+	unsigned int i;
+
+	for (i = 0; i < priv->num_bridges; i++)
+		if (priv->bridges[i].ifindex == ifindex) {
+			priv->bridges[i] = priv->bridges[--priv->num_bridges];
+			return;
+		}
+}
+
+/* Mark the bridge or bond ifindex as having vifs enslaved */
+static void bridge_set_vifs(struct priv_data *priv, int ifindex)
+{
+	unsigned int i;
+
+	for (i = 0; i < priv->num_bridges; i++)
+		if (priv->bridges[i].ifindex == ifindex)
+			priv->bridges[i].has_vifs = 1;
+}
+
+/* Whether any vif is listed in the brif directory of a bridge */
+static int bridge_has_vifs(const char *brif)
 {
 	struct dirent *de;
 	DIR *d;
+	int ret = 0;
 
-	char tmp[256] = { 0 }, *bridge;
+	d = opendir(brif);
+	if (d == NULL)
+		return 0;
+	while ((de = readdir(d)) != NULL)
+		if (strncmp(de->d_name, "vif", 3) == 0) {
+			ret = 1;
+			break;
+		}
+	closedir(d);
+
+	return ret;
+}
+
+/* Rebuild the list of bridges and bonds from /sys/class/net */
+static int scan_bridges(struct priv_data *priv)
+{
+	struct dirent *de;
+	DIR *d;
+	char tmp[sizeof(de->d_name) + sizeof("/sys/class/net//bonding")];
+	int kind, ret = 1;
 
-	bridge = (char *)malloc(16 * sizeof(char));
+	priv->num_bridges = 0;
 
 	d = opendir("/sys/class/net");
+	if (d == NULL)
+		return 0;
 	while ((de = readdir(d)) != NULL) {
-		if ((strlen(de->d_name) > 0) && (de->d_name[0] != '.')
-			&& (strstr(de->d_name, excludeName) == NULL)) {
-				sprintf(tmp, "/sys/class/net/%s/bridge", de->d_name);
+		if (de->d_name[0] == '\0' || de->d_name[0] == '.')
+			continue;
+		snprintf(tmp, sizeof(tmp), "/sys/class/net/%s/bridge",
+			 de->d_name);
+		if (access(tmp, F_OK) == 0)
+			kind = UPLINK_BRIDGE;
+		else {
+			snprintf(tmp, sizeof(tmp), "/sys/class/net/%s/bonding",
+				 de->d_name);
+			if (access(tmp, F_OK) != 0)
+				continue;
+			kind = UPLINK_BOND;
+		}
+		if (!bridge_add(priv, if_nametoindex(de->d_name), de->d_name,
+				kind)) {
+			ret = 0;
+			break;
+		}
+		snprintf(tmp, sizeof(tmp), "/sys/class/net/%s/brif",
+			 de->d_name);
+		if (kind == UPLINK_BRIDGE && bridge_has_vifs(tmp))
+			bridge_set_vifs(priv, if_nametoindex(de->d_name));
+	}
+	closedir(d);
+
+	return ret;
+}
 
-				if (access(tmp, F_OK) == 0)
-					bridge = de->d_name;
+/* Apply one RTM_NEWLINK/RTM_DELLINK notification to the list of bridges */
+static int bridge_notification(struct priv_data *priv, struct nlmsghdr *nlh)
+{
+	struct ifinfomsg *ifi = NLMSG_DATA(nlh);
+	struct rtattr *rta, *info;
+	const char *name = NULL, *kind = NULL;
+	int attrlen = IFLA_PAYLOAD(nlh), infolen, master = 0;
+
+	for (rta = IFLA_RTA(ifi); RTA_OK(rta, attrlen);
+	     rta = RTA_NEXT(rta, attrlen)) {
+		if (rta->rta_type == IFLA_IFNAME)
+			name = RTA_DATA(rta);
+		else if (rta->rta_type == IFLA_MASTER &&
+			 RTA_PAYLOAD(rta) >= sizeof(int))
+			memcpy(&master, RTA_DATA(rta), sizeof(int));
+		else if (rta->rta_type == IFLA_LINKINFO) {
+			infolen = RTA_PAYLOAD(rta);
+			for (info = RTA_DATA(rta); RTA_OK(info, infolen);
+			     info = RTA_NEXT(info, infolen))
+				if (info->rta_type == IFLA_INFO_KIND)
+					kind = RTA_DATA(info);
 		}
 	}
 
-	closedir(d);
+	if (nlh->nlmsg_type == RTM_DELLINK) {
+		bridge_del(priv, ifi->ifi_index);
+		return 1;
+	}
+	if (name == NULL)
+		return 1;
+	if (master != 0 && strncmp(name, "vif", 3) == 0) {
+		bridge_set_vifs(priv, master);
+		return 1;
+	}
+	if (kind != NULL && strcmp(kind, "bridge") == 0)
+		return bridge_add(priv, ifi->ifi_index, name, UPLINK_BRIDGE);
+	if (kind != NULL && strcmp(kind, "bond") == 0)
+		return bridge_add(priv, ifi->ifi_index, name, UPLINK_BOND);
+	return 1;
+}
+
+/* Open the socket receiving link notifications, non-blocking */
+static int open_link_monitor(struct priv_data *priv)
+{
+	struct sockaddr_nl addr;
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+	if (fd == -1)
+		return 0;
 
-	return bridge;
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = RTMGRP_LINK;
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+	    fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+		close(fd);
+		return 0;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	priv->link_monitor = fd;
+	return 1;
 }
 
-/* parseNetLine provides regular expression based parsing for lines from /proc/net/dev, all the */
-/* information are parsed but not all are used in our case, ie. for xenstat */
-int parseNetDevLine(char *line, char *iface, unsigned long long *rxBytes, unsigned long long *rxPackets,
-		unsigned long long *rxErrs, unsigned long long *rxDrops, unsigned long long *rxFifo,
-		unsigned long long *rxFrames, unsigned long long *rxComp, unsigned long long *rxMcast,
-		unsigned long long *txBytes, unsigned long long *txPackets, unsigned long long *txErrs,
-		unsigned long long *txDrops, unsigned long long *txFifo, unsigned long long *txColls,
-		unsigned long long *txCarrier, unsigned long long *txComp)
+/* Rank of a bridge or bond as the device whose stats go to dom0, lowest first */
+static int bridge_rank(const struct bridge_dev *dev)
 {
-	/* Temporary/helper variables */
-	int ret;
-	char *tmp;
-	int i = 0, x = 0, col = 0;
-	regex_t r;
-	regmatch_t matches[19];
-	int num = 19;
-
-	/* Regular exception to parse all the information from /proc/net/dev line */
-	char *regex = "([^:]*):([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)"
-			"[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*"
-			"([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)";
-
-	/* Initialize all variables called has passed as non-NULL to zeros */
-	if (iface != NULL)
-		memset(iface, 0, sizeof(iface));
-	if (rxBytes != NULL)
-		*rxBytes = 0;
-	if (rxPackets != NULL)
-		*rxPackets = 0;
-	if (rxErrs != NULL)
-		*rxErrs = 0;
-	if (rxDrops != NULL)
-		*rxDrops = 0;
-	if (rxFifo != NULL)
-		*rxFifo = 0;
-	if (rxFrames != NULL)
-		*rxFrames = 0;
-	if (rxPackets != NULL)
-		*rxPackets = 0;
-	if (rxComp != NULL)
-		*rxComp = 0;
-	if (txBytes != NULL)
-		*txBytes = 0;
-	if (txPackets != NULL)
-		*txPackets = 0;
-	if (txErrs != NULL)
-		*txErrs = 0;
-	if (txDrops != NULL)
-		*txDrops = 0;
-	if (txFifo != NULL)
-		*txFifo = 0;
-	if (txColls != NULL)
-		*txColls = 0;
-	if (txCarrier != NULL)
-		*txCarrier = 0;
-	if (txComp != NULL)
-		*txComp = 0;
-
-	if ((ret = regcomp(&r, regex, REG_EXTENDED))) {
-		regfree(&r);
-		return ret;
-	}
-
-	tmp = (char *)malloc( sizeof(char) );
-	if (regexec (&r, line, num, matches, REG_EXTENDED) == 0){
-		for (i = 1; i < num; i++) {
-			/* The expression matches are empty sometimes so we need to check it first */
-			if (matches[i].rm_eo - matches[i].rm_so > 0) {
-				/* Col variable contains current id of non-empty match */
-				col++;
-				tmp = (char *)realloc(tmp, (matches[i].rm_eo - 
-							matches[i].rm_so + 1) * sizeof(char));
-				for (x = matches[i].rm_so; x < matches[i].rm_eo; x++)
-					tmp[x - matches[i].rm_so] = line[x];
-
-				/* We populate all the fields from /proc/net/dev line */
-				if (i > 1) {
-					unsigned long long ullTmp = strtoull(tmp, NULL, 10);
-
-					switch (col) {
-						case 2: if (rxBytes != NULL)
-								*rxBytes = ullTmp;
-							break;
-						case 3: if (rxPackets != NULL)
-								*rxPackets = ullTmp;
-							break;
-						case 4: if (rxErrs != NULL)
-								*rxErrs = ullTmp;
-							break;
-						case 5: if (rxDrops != NULL)
-								*rxDrops = ullTmp;
-							break;
-						case 6: if (rxFifo != NULL)
-								*rxFifo = ullTmp;
-							break;
-						case 7: if (rxFrames != NULL)
-								*rxFrames = ullTmp;
-							break;
-						case 8: if (rxComp != NULL)
-								*rxComp = ullTmp;
-							break;
-						case 9: if (rxMcast != NULL)
-								*rxMcast = ullTmp;
-							break;
-						case 10: if (txBytes != NULL)
-								*txBytes = ullTmp;
-							break;
-						case 11: if (txPackets != NULL)
-								*txPackets = ullTmp;
-							break;
-						case 12: if (txErrs != NULL)
-								*txErrs = ullTmp;
-							break;
-						case 13: if (txDrops != NULL)
-								*txDrops = ullTmp;
-							break;
-						case 14: if (txFifo != NULL)
-								*txFifo = ullTmp;
-							break;
-						case 15: if (txColls != NULL)
-								*txColls = ullTmp;
-							break;
-						case 16: if (txCarrier != NULL)
-								*txCarrier = ullTmp;
-							break;
-						case 17: if (txComp != NULL)
-								*txComp = ullTmp;
-							break;
-					}
-				}
-				else
-				/* There were errors when parsing this directly in RE. strpbrk() helps */
-				if (iface != NULL)
-					strcpy(iface, strpbrk(tmp, "abcdefghijklmnopqrstvuwxyz0123456789"));
-
-				memset(tmp, 0, matches[i].rm_eo - matches[i].rm_so);
+	if (dev->kind == UPLINK_BRIDGE)
+		return dev->has_vifs ? 0 : 1;
+	return 2;
+}
+
+/* Bring the list of bridges up to date and return the one to account to dom0, or an */
+/* empty string if there is none.  That is the bridge the vifs are enslaved to, else */
+/* any bridge, else a bond, the lowest ifindex breaking ties. */
+static const char *get_bridge(struct priv_data *priv)
+{
+	struct bridge_dev *best = NULL;
+	unsigned int i;
+	struct nlmsghdr *nlh;
+	ssize_t len;
+	int rescan = !priv->bridges_valid;
+
+	/* Subscribe before the initial scan so no change can be missed */
+	if (priv->link_monitor == -1 && !priv->link_monitor_failed) {
+		if (!open_link_monitor(priv))
+			priv->link_monitor_failed = 1;
+		rescan = 1;
+	}
+
+	/* Without notifications the only option is to rescan every time */
+	if (priv->link_monitor == -1)
+		rescan = 1;
+	else if (priv->netlink_buf != NULL ||
+		 (priv->netlink_buf = malloc(NETLINK_BUF_SIZE)) != NULL) {
+		for (;;) {
+			len = recv(priv->link_monitor, priv->netlink_buf,
+				   NETLINK_BUF_SIZE, MSG_TRUNC);
+			if (len < 0) {
+				if (errno == EINTR)
+					continue;
+				/* ENOBUFS: notifications were dropped */
+				if (errno != EAGAIN && errno != EWOULDBLOCK)
+					rescan = 1;
+				break;
+			}
+			if (len > NETLINK_BUF_SIZE) {
+				rescan = 1;
+				continue;
 			}
+			for (nlh = (struct nlmsghdr *)priv->netlink_buf;
+			     NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len))
+				if ((nlh->nlmsg_type == RTM_NEWLINK ||
+				     nlh->nlmsg_type == RTM_DELLINK) &&
+				    !bridge_notification(priv, nlh))
+					rescan = 1;
+		}
+	}
+	else
+		rescan = 1;
+
+	if (rescan)
+		priv->bridges_valid = scan_bridges(priv);
+
+	for (i = 0; i < priv->num_bridges; i++) {
+		struct bridge_dev *dev = &priv->bridges[i];
+
+		if (best == NULL || bridge_rank(dev) < bridge_rank(best) ||
+		    (bridge_rank(dev) == bridge_rank(best) &&
+		     dev->ifindex < best->ifindex))
+			best = dev;
+	}
+
+	return best != NULL ? best->name : "";
+}
+
+/* Counters of a /proc/net/dev line, in column order */
+enum {
+	NETDEV_RX_BYTES,
+	NETDEV_RX_PACKETS,
+	NETDEV_RX_ERRS,
+	NETDEV_RX_DROP,
+	NETDEV_RX_FIFO,
+	NETDEV_RX_FRAME,
+	NETDEV_RX_COMPRESSED,
+	NETDEV_RX_MCAST,
+	NETDEV_TX_BYTES,
+	NETDEV_TX_PACKETS,
+	NETDEV_TX_ERRS,
+	NETDEV_TX_DROP,
+	NETDEV_TX_FIFO,
+	NETDEV_TX_COLLS,
+	NETDEV_TX_CARRIER,
+	NETDEV_TX_COMPRESSED,
+	NETDEV_NUM_COUNTERS
+};
+
+/* parseNetDevLine parses the /proc/net/dev line starting at p in place, in a single pass */
+/* and without allocating.  The interface name is copied to iface (empty if the line is */
+/* malformed) and all the counters to counters[].  Returns the start of the next line. */
+static char *parseNetDevLine(char *p, char *end, char *iface,
+			     unsigned long long counters[NETDEV_NUM_COUNTERS])
+{
+	int i, len = 0;
+
+	/* The interface name is right aligned in front of the colon */
+	while (p < end && *p == ' ')
+		p++;
+	while (p < end && *p != ':' && *p != '\n') {
+		if (len < IFACE_NAME_LEN - 1)
+			iface[len++] = *p;
+		p++;
+	}
+	iface[len] = '\0';
+
+	if (p < end && *p == ':') {
+		p++;
+		for (i = 0; i < NETDEV_NUM_COUNTERS; i++) {
+			unsigned long long value = 0;
+
+			while (p < end && *p == ' ')
+				p++;
+			while (p < end && *p >= '0' && *p <= '9')
+				value = value * 10 + (*p++ - '0');
+			counters[i] = value;
 		}
 	}
+	else
+		iface[0] = '\0';
+
+	while (p < end && *p++ != '\n')
+		;
 
-	free(tmp);
-	regfree(&r);
+	return p;
+}
 
-	return 0;
+/* Read the whole of /proc/net/dev into the priv buffer, growing it as needed.  Returns */
+/* the number of bytes read, or -1 on error. */
+static ssize_t read_procnetdev(struct priv_data *priv)
+{
+	size_t len = 0;
+	ssize_t num_read;
+
+	if (lseek(priv->procnetdev, 0, SEEK_SET) == (off_t)-1)
+		return -1;
+
+	for (;;) {
+		if (len == priv->procnetdev_buf_size) {
+			size_t size = priv->procnetdev_buf_size ?
+				2 * priv->procnetdev_buf_size : 16384;
+			char *tmp = realloc(priv->procnetdev_buf, size);
+			if (tmp == NULL)
+				return -1;
+			priv->procnetdev_buf = tmp;
+			priv->procnetdev_buf_size = size;
+		}
+		num_read = read(priv->procnetdev, priv->procnetdev_buf + len,
+				priv->procnetdev_buf_size - len);
+		if (num_read < 0)
+			return -1;
+		if (num_read == 0)
+			return len;
+		len += num_read;
+	}
+}
+
+/* Queue the counters of interface iface for the domain it belongs to.  Returns 0 if */
+/* memory could not be allocated, 1 otherwise. */
+static int add_network(xenstat_node * node, struct priv_data *priv,
+		       const char *iface,
+		       unsigned long long counters[NETDEV_NUM_COUNTERS],
+		       const char *devBridge, const char *devNoBridge)
+{
+	struct pending_net *pending;
+	xenstat_domain *domain;
+	unsigned int domid, id;
+	int bridge = 0;
+
+	/* If the device parsed is network bridge and both tx & rx packets are zero, we are most */
+	/* likely using bonding so we alter the configuration for dom0 to have bridge stats */
+	if ((devBridge[0] != '\0') &&
+	    (strstr(iface, devBridge) != NULL) &&
+	    (strstr(iface, devNoBridge) == NULL) &&
+	    ((domain = xenstat_node_domain(node, 0)) != NULL)) {
+		bridge = 1;
+		id = 0;
+	} else {
+		/* Otherwise we need to preserve old behaviour */
+		if (strstr(iface, "vif") == NULL)
+			return 1;
+
+		if (sscanf(iface, "vif%u.%u", &domid, &id) != 2)
+			return 1;
+
+		/* FIXME: this does a search for the domid */
+		domain = xenstat_node_domain(node, domid);
+		if (domain == NULL) {
+			/* Domains the filter left out are expected */
+			if (node->handle->filter == NULL)
+				fprintf(stderr,
+					"Found interface vif%u.%u but domain %u"
+					" does not exist.\n", domid, id,
+					domid);
+			return 1;
+		}
+	}
+
+	if (priv->num_pending_nets == priv->max_pending_nets) {
+		unsigned int max = priv->max_pending_nets ?
+			2 * priv->max_pending_nets : 64;
+		pending = realloc(priv->pending_nets, max * sizeof(*pending));
+		if (pending == NULL)
+			return 0;
+		priv->pending_nets = pending;
+		priv->max_pending_nets = max;
+	}
+
+	pending = &priv->pending_nets[priv->num_pending_nets++];
+	pending->domain = domain;
+	pending->bridge = bridge;
+	pending->net.id = id;
+	pending->net.name[0] = '\0';
+	pending->net.mac[0] = '\0';
+	pending->net.backend[0] = '\0';
+	pending->net.rbytes = counters[NETDEV_RX_BYTES];
+	pending->net.rpackets = counters[NETDEV_RX_PACKETS];
+	pending->net.rerrs = counters[NETDEV_RX_ERRS];
+	pending->net.rdrop = counters[NETDEV_RX_DROP];
+	pending->net.rfifo = counters[NETDEV_RX_FIFO];
+	pending->net.rframe = counters[NETDEV_RX_FRAME];
+	pending->net.rcompressed = counters[NETDEV_RX_COMPRESSED];
+	pending->net.rmcast = counters[NETDEV_RX_MCAST];
+	pending->net.tbytes = counters[NETDEV_TX_BYTES];
+	pending->net.tpackets = counters[NETDEV_TX_PACKETS];
+	pending->net.terrs = counters[NETDEV_TX_ERRS];
+	pending->net.tdrop = counters[NETDEV_TX_DROP];
+	pending->net.tfifo = counters[NETDEV_TX_FIFO];
+	pending->net.tcolls = counters[NETDEV_TX_COLLS];
+	pending->net.tcarrier = counters[NETDEV_TX_CARRIER];
+	pending->net.tcompressed = counters[NETDEV_TX_COMPRESSED];
+	if (!bridge)
+		domain->num_networks++;
+
+	return 1;
+}
+
+/* Move the queued networks, already counted per domain, into their domains so that */
+/* each domain's array is allocated once.  Returns 0 if memory could not be */
+/* allocated, 1 otherwise. */
+static int distribute_networks(xenstat_node * node, struct priv_data *priv)
+{
+	struct pending_net *pending, *end;
+	xenstat_domain *domain;
+	unsigned int i;
+
+	for (i = 0; i < node->num_domains; i++) {
+		domain = &node->domains[i];
+		if (domain->num_networks == 0)
+			continue;
+		domain->networks = malloc(domain->num_networks *
+					  sizeof(xenstat_network));
+		if (domain->networks == NULL)
+			return 0;
+		domain->num_networks = 0;
+	}
+
+	end = priv->pending_nets + priv->num_pending_nets;
+	for (pending = priv->pending_nets; pending < end; pending++) {
+		if (pending->bridge)
+			continue;
+		domain = pending->domain;
+		domain->networks[domain->num_networks++] = pending->net;
+	}
+
+	/* The bridge stats replace those of the idle dom0 vifs */
+	for (pending = priv->pending_nets; pending < end; pending++) {
+		if (!pending->bridge)
+			continue;
+		domain = pending->domain;
+		for (i = 0; i < domain->num_networks; i++) {
+			if ((domain->networks[i].id != 0) ||
+			    (domain->networks[i].tbytes != 0) ||
+			    (domain->networks[i].rbytes != 0))
+				continue;
+			domain->networks[i] = pending->net;
+		}
+	}
+
+	return 1;
+}
+
+/* Forget the networks queued so far, before retrying with another source */
+static void reset_networks(xenstat_node * node, struct priv_data *priv)
+{
+	unsigned int i;
+
+	for (i = 0; i < node->num_domains; i++)
+		node->domains[i].num_networks = 0;
+	priv->num_pending_nets = 0;
+}
+
+/* Collect information about networks from /proc/net/dev */
+static int collect_networks_procfs(xenstat_node * node, struct priv_data *priv,
+				   const char *devBridge, const char *devNoBridge)
+{
+	/* Helper variables for parseNetDevLine() function defined above */
+	char iface[IFACE_NAME_LEN] = { 0 };
+	unsigned long long counters[NETDEV_NUM_COUNTERS];
+	char *line, *end;
+	ssize_t len;
+
+	/* Open /proc/net/dev if we haven't already */
+	if (priv->procnetdev == -1) {
+		priv->procnetdev = open("/proc/net/dev", O_RDONLY | O_CLOEXEC);
+		if (priv->procnetdev == -1) {
+			perror("Error opening /proc/net/dev");
+			return 0;
+		}
+	}
+
+	/* Read it whole and validate its format */
+	len = read_procnetdev(priv);
+	if (len < 0) {
+		perror("Error reading /proc/net/dev");
+		return 0;
+	}
+	if (len < sizeof(PROCNETDEV_HEADER) - 1 ||
+	    memcmp(priv->procnetdev_buf, PROCNETDEV_HEADER,
+		   sizeof(PROCNETDEV_HEADER) - 1) != 0) {
+		fprintf(stderr,
+			"Unexpected /proc/net/dev format\n");
+		return 0;
+	}
+
+	/* Fill in networks */
+	line = priv->procnetdev_buf + sizeof(PROCNETDEV_HEADER) - 1;
+	end = priv->procnetdev_buf + len;
+
+	while (line < end) {
+		line = parseNetDevLine(line, end, iface, counters);
+		if (iface[0] == '\0')
+			continue;
+
+		if (!add_network(node, priv, iface, counters, devBridge,
+				 devNoBridge))
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Convert rtnetlink link statistics to /proc/net/dev counters, folding the detailed */
+/* error counters the same way the kernel does when it formats /proc/net/dev */
+static void netlink_stats_to_counters(const struct rtnl_link_stats64 *st,
+				      unsigned long long counters[NETDEV_NUM_COUNTERS])
+{
+	counters[NETDEV_RX_BYTES] = st->rx_bytes;
+	counters[NETDEV_RX_PACKETS] = st->rx_packets;
+	counters[NETDEV_RX_ERRS] = st->rx_errors;
+	counters[NETDEV_RX_DROP] = st->rx_dropped + st->rx_missed_errors;
+	counters[NETDEV_RX_FIFO] = st->rx_fifo_errors;
+	counters[NETDEV_RX_FRAME] = st->rx_length_errors + st->rx_over_errors +
+				    st->rx_crc_errors + st->rx_frame_errors;
+	counters[NETDEV_RX_COMPRESSED] = st->rx_compressed;
+	counters[NETDEV_RX_MCAST] = st->multicast;
+	counters[NETDEV_TX_BYTES] = st->tx_bytes;
+	counters[NETDEV_TX_PACKETS] = st->tx_packets;
+	counters[NETDEV_TX_ERRS] = st->tx_errors;
+	counters[NETDEV_TX_DROP] = st->tx_dropped;
+	counters[NETDEV_TX_FIFO] = st->tx_fifo_errors;
+	counters[NETDEV_TX_COLLS] = st->collisions;
+	counters[NETDEV_TX_CARRIER] = st->tx_carrier_errors +
+				      st->tx_aborted_errors +
+				      st->tx_window_errors +
+				      st->tx_heartbeat_errors;
+	counters[NETDEV_TX_COMPRESSED] = st->tx_compressed;
+}
+
+/* Widen the 32-bit statistics of kernels without IFLA_STATS64 */
+static void netlink_stats32_to_stats64(const struct rtnl_link_stats *st32,
+				       struct rtnl_link_stats64 *st)
+{
+	st->rx_packets = st32->rx_packets;
+	st->tx_packets = st32->tx_packets;
+	st->rx_bytes = st32->rx_bytes;
+	st->tx_bytes = st32->tx_bytes;
+	st->rx_errors = st32->rx_errors;
+	st->tx_errors = st32->tx_errors;
+	st->rx_dropped = st32->rx_dropped;
+	st->tx_dropped = st32->tx_dropped;
+	st->multicast = st32->multicast;
+	st->collisions = st32->collisions;
+	st->rx_length_errors = st32->rx_length_errors;
+	st->rx_over_errors = st32->rx_over_errors;
+	st->rx_crc_errors = st32->rx_crc_errors;
+	st->rx_frame_errors = st32->rx_frame_errors;
+	st->rx_fifo_errors = st32->rx_fifo_errors;
+	st->rx_missed_errors = st32->rx_missed_errors;
+	st->tx_aborted_errors = st32->tx_aborted_errors;
+	st->tx_carrier_errors = st32->tx_carrier_errors;
+	st->tx_fifo_errors = st32->tx_fifo_errors;
+	st->tx_heartbeat_errors = st32->tx_heartbeat_errors;
+	st->tx_window_errors = st32->tx_window_errors;
+	st->rx_compressed = st32->rx_compressed;
+	st->tx_compressed = st32->tx_compressed;
+}
+
+/* Handle one RTM_NEWLINK message of the link dump.  Returns 0 if memory could not be */
+/* allocated, 1 otherwise. */
+static int parse_netlink_link(xenstat_node * node, struct priv_data *priv,
+			      struct nlmsghdr *nlh, const char *devBridge,
+			      const char *devNoBridge)
+{
+	struct ifinfomsg *ifi = NLMSG_DATA(nlh);
+	struct rtattr *rta, *stats = NULL, *stats64 = NULL;
+	struct rtnl_link_stats64 st;
+	unsigned long long counters[NETDEV_NUM_COUNTERS];
+	const char *iface = NULL;
+	int attrlen = IFLA_PAYLOAD(nlh);
+
+	for (rta = IFLA_RTA(ifi); RTA_OK(rta, attrlen);
+	     rta = RTA_NEXT(rta, attrlen)) {
+		switch (rta->rta_type) {
+		case IFLA_IFNAME:
+			iface = RTA_DATA(rta);
+			break;
+		case IFLA_STATS:
+			stats = rta;
+			break;
+		case IFLA_STATS64:
+			stats64 = rta;
+			break;
+		}
+	}
+
+	/* Only vifs and the bridge are of interest */
+	if (iface == NULL || (strstr(iface, "vif") == NULL &&
+			      (devBridge[0] == '\0' ||
+			       strstr(iface, devBridge) == NULL)))
+		return 1;
+
+	/* The attribute payload is only 4-byte aligned.  Kernels older than
+	 * these headers send a shorter struct, whose missing tail stays zero. */
+	memset(&st, 0, sizeof(st));
+	if (stats64 != NULL)
+		memcpy(&st, RTA_DATA(stats64),
+		       RTA_PAYLOAD(stats64) < sizeof(st) ?
+		       RTA_PAYLOAD(stats64) : sizeof(st));
+	else if (stats != NULL &&
+		 RTA_PAYLOAD(stats) >= sizeof(struct rtnl_link_stats)) {
+		struct rtnl_link_stats st32;
+		memcpy(&st32, RTA_DATA(stats), sizeof(st32));
+		netlink_stats32_to_stats64(&st32, &st);
+	}
+	else
+		return 1;
+
+	netlink_stats_to_counters(&st, counters);
+	return add_network(node, priv, iface, counters, devBridge,
+			   devNoBridge);
+}
+
+/* Collect information about networks from a single rtnetlink RTM_GETLINK dump.  Returns */
+/* 1 on success, 0 on allocation failure and -1 if netlink is not usable. */
+static int collect_networks_netlink(xenstat_node * node, struct priv_data *priv,
+				    const char *devBridge, const char *devNoBridge)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct ifinfomsg ifi;
+	} req;
+	struct sockaddr_nl addr;
+	struct nlmsghdr *nlh;
+	ssize_t len;
+
+	if (priv->netlink == -1) {
+		priv->netlink = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+		if (priv->netlink == -1)
+			return -1;
+		fcntl(priv->netlink, F_SETFD, FD_CLOEXEC);
+	}
+	if (priv->netlink_buf == NULL) {
+		priv->netlink_buf = malloc(NETLINK_BUF_SIZE);
+		if (priv->netlink_buf == NULL)
+			return 0;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+
+	memset(&req, 0, sizeof(req));
+	req.nlh.nlmsg_len = sizeof(req);
+	req.nlh.nlmsg_type = RTM_GETLINK;
+	req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.nlh.nlmsg_seq = ++priv->netlink_seq;
+	req.ifi.ifi_family = AF_UNSPEC;
+
+	if (sendto(priv->netlink, &req, sizeof(req), 0,
+		   (struct sockaddr *)&addr, sizeof(addr)) != sizeof(req))
+		return -1;
+
+	for (;;) {
+		len = recv(priv->netlink, priv->netlink_buf, NETLINK_BUF_SIZE,
+			   MSG_TRUNC);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (len == 0 || len > NETLINK_BUF_SIZE)
+			return -1;
+
+		for (nlh = (struct nlmsghdr *)priv->netlink_buf;
+		     NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+			/* Leftovers of an earlier, interrupted dump */
+			if (nlh->nlmsg_seq != priv->netlink_seq)
+				continue;
+			if (nlh->nlmsg_type == NLMSG_DONE)
+				return 1;
+			if (nlh->nlmsg_type == NLMSG_ERROR)
+				return -1;
+			if (nlh->nlmsg_type != RTM_NEWLINK)
+				continue;
+			if (!parse_netlink_link(node, priv, nlh, devBridge,
+						devNoBridge))
+				return 0;
+		}
+	}
 }
 
 /* Collect information about networks */
 int xenstat_collect_networks(xenstat_node * node)
 {
-	/* Helper variables for parseNetDevLine() function defined above */
-	int i;
-	char line[512] = { 0 }, iface[16] = { 0 }, devBridge[16] = { 0 }, devNoBridge[16] = { 0 };
-	unsigned long long rxBytes, rxPackets, rxErrs, rxDrops, txBytes, txPackets, txErrs, txDrops;
+	char devBridge[16] = { 0 }, devNoBridge[16] = { 0 };
+	int ret;
 
 	struct priv_data *priv = get_priv_data(node->handle);
 
@@ -250,139 +987,751 @@ int xenstat_collect_networks(xenstat_node * node)
 		return 0;
 	}
 
-	/* Open and validate /proc/net/dev if we haven't already */
-	if (priv->procnetdev == NULL) {
-		char header[sizeof(PROCNETDEV_HEADER)];
-		priv->procnetdev = fopen("/proc/net/dev", "r");
-		if (priv->procnetdev == NULL) {
-			perror("Error opening /proc/net/dev");
+	/* We get the bridge devices for use with bonding interface to get bonding interface stats */
+	snprintf(devBridge, 16, "%s", get_bridge(priv));
+	snprintf(devNoBridge, 16, "p%s", devBridge);
+
+	reset_networks(node, priv);
+	ret = -1;
+	if (node->handle->net_source != XENSTAT_NETSRC_PROCFS) {
+		ret = collect_networks_netlink(node, priv, devBridge,
+					       devNoBridge);
+		if (ret < 0 &&
+		    node->handle->net_source == XENSTAT_NETSRC_NETLINK) {
+			perror("Error dumping links over netlink");
 			return 0;
 		}
+		if (ret < 0) {
+			/* Fall back to /proc/net/dev from now on */
+			node->handle->net_source = XENSTAT_NETSRC_PROCFS;
+			reset_networks(node, priv);
+		}
+	}
+	if (ret < 0)
+		ret = collect_networks_procfs(node, priv, devBridge,
+					      devNoBridge);
+	if (ret == 0)
+		return 0;
 
-		/* Validate the format of /proc/net/dev */
-		if (fread(header, sizeof(PROCNETDEV_HEADER) - 1, 1,
-			  priv->procnetdev) != 1) {
-			perror("Error reading /proc/net/dev header");
-			return 0;
+	return distribute_networks(node, priv);
+}
+
+/* Free network information in handle */
+void xenstat_uninit_networks(xenstat_handle * handle)
+{
+	struct priv_data *priv = get_priv_data(handle);
+	if (priv != NULL && priv->procnetdev != -1)
+		close(priv->procnetdev);
+	if (priv != NULL && priv->netlink != -1)
+		close(priv->netlink);
+	if (priv != NULL && priv->link_monitor != -1)
+		close(priv->link_monitor);
+	if (priv != NULL) {
+		free(priv->procnetdev_buf);
+		free(priv->netlink_buf);
+		free(priv->bridges);
+		free(priv->pending_nets);
+	}
+}
+
+/* Backend directory names look like vbd-<domid>-<dev> */
+static int parse_vbd_name(const char *name, xenstat_vbd *vbd,
+			  unsigned int *domid)
+{
+	char type[4];
+
+	if (strlen(name) >= VBD_NAME_LEN)
+		return 0;
+	if (sscanf(name, "%3s-%u-%u", type, domid, &vbd->dev) != 3)
+		return 0;
+
+	if (strcmp(type, "vbd") == 0)
+		vbd->back_type = 1;
+	else if (strcmp(type, "tap") == 0)
+		vbd->back_type = 2;
+	else
+		return 0;
+
+	return 1;
+}
+
+static int compare_vbd_dev(const void *a, const void *b)
+{
+	return strcmp(((const struct vbd_dev *)a)->name,
+		      ((const struct vbd_dev *)b)->name);
+}
+
+/* Close the statistics files of dev, they are reopened on the next read */
+static void vbd_close(struct priv_data *priv, struct vbd_dev *dev)
+{
+	int i;
+
+	for (i = 0; i < VBD_NUM_STATS; i++) {
+		if (dev->fd[i] == -1)
+			continue;
+		close(dev->fd[i]);
+		dev->fd[i] = -1;
+		priv->num_vbd_fds--;
+	}
+	if (dev->bd_fd != -1) {
+		close(dev->bd_fd);
+		dev->bd_fd = -1;
+		priv->num_vbd_fds--;
+	}
+	dev->missing = 0;
+	dev->bd_missing = 0;
+}
+
+/* Open statistics file stat of dev, keeping it open for the next samples if the fd */
+/* budget allows; *transient is set otherwise.  Returns -1 on error. */
+static int vbd_open_stat(struct priv_data *priv, struct vbd_dev *dev, int stat,
+			 int *transient)
+{
+	char path[128];
+	int fd = dev->fd[stat];
+
+	*transient = 0;
+	if (fd != -1)
+		return fd;
+	if (dev->missing & (1 << stat))
+		return -1;
+
+	snprintf(path, sizeof(path), "%s/%s/statistics/%s",
+		 SYSFS_VBD_PATH, dev->name, vbd_stat_names[stat]);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			dev->missing |= 1 << stat;
+		return -1;
+	}
+
+	if (priv->num_vbd_fds < priv->max_vbd_fds) {
+		dev->fd[stat] = fd;
+		priv->num_vbd_fds++;
+	} else
+		*transient = 1;
+
+	return fd;
+}
+
+/* Parse the num_read bytes of a statistics file in buf into val */
+static int parse_stat(char *buf, ssize_t num_read, unsigned long long *val)
+{
+	if (num_read <= 0)
+		return 0;
+	buf[num_read] = '\0';
+
+	return sscanf(buf, "%llu", val) == 1;
+}
+
+/* Read statistics file stat of dev into val.  Returns 0 if it could not be read. */
+static int vbd_read_stat(struct priv_data *priv, struct vbd_dev *dev, int stat,
+			 unsigned long long *val)
+{
+	char buf[STAT_BUF_LEN];
+	ssize_t num_read;
+	int fd, transient;
+
+	fd = vbd_open_stat(priv, dev, stat, &transient);
+	if (fd == -1)
+		return 0;
+
+	num_read = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (transient)
+		close(fd);
+
+	return parse_stat(buf, num_read, val);
+}
+
+/* Open the stat file of the block device backing dev, as set by the hotplug */
+/* script in physical_device.  Returns -1 if it is not known (yet). */
+static int vbd_open_backing(struct priv_data *priv, struct vbd_dev *dev,
+			    int *transient)
+{
+	char path[128];
+	unsigned int major, minor;
+	ssize_t num_read;
+	int fd;
+
+	*transient = 0;
+	if (dev->bd_fd != -1)
+		return dev->bd_fd;
+	if (dev->bd_missing)
+		return -1;
+
+	snprintf(path, sizeof(path), "%s/%s/physical_device",
+		 SYSFS_VBD_PATH, dev->name);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			dev->bd_missing = 1;
+		return -1;
+	}
+	num_read = read(fd, path, sizeof(path) - 1);
+	close(fd);
+	if (num_read <= 0)
+		return -1;
+	path[num_read] = '\0';
+	if (sscanf(path, "%x:%x", &major, &minor) != 2 ||
+	    (major == 0 && minor == 0))
+		return -1;
+
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/stat",
+		 major, minor);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+
+	if (priv->num_vbd_fds < priv->max_vbd_fds) {
+		dev->bd_fd = fd;
+		priv->num_vbd_fds++;
+	} else
+		*transient = 1;
+
+	return fd;
+}
+
+/* Parse the num_read bytes of the stat file of a backing block device in buf */
+/* into vbd, zero if they could not be read */
+static void parse_backing(char *buf, ssize_t num_read, xenstat_vbd *vbd)
+{
+	unsigned long long rd_ios, rd_ticks, wr_ios, wr_ticks;
+	unsigned long long inflight, io_ticks, queue_ticks;
+
+	vbd->bd_ios = 0;
+	vbd->bd_ticks = 0;
+	vbd->io_ticks = 0;
+	vbd->queue_ticks = 0;
+	vbd->inflight = 0;
+
+	if (num_read <= 0)
+		return;
+	buf[num_read] = '\0';
+
+	/* Fields 1, 4, 5, 8, 9, 10 and 11 of Documentation/block/stat.txt */
+	if (sscanf(buf, "%llu %*u %*u %llu %llu %*u %*u %llu %llu %llu %llu",
+		   &rd_ios, &rd_ticks, &wr_ios, &wr_ticks, &inflight,
+		   &io_ticks, &queue_ticks) != 7)
+		return;
+
+	vbd->bd_ios = rd_ios + wr_ios;
+	vbd->bd_ticks = rd_ticks + wr_ticks;
+	vbd->io_ticks = io_ticks;
+	vbd->queue_ticks = queue_ticks;
+	vbd->inflight = inflight;
+}
+
+/* Close the kept stat file of the backing device of dev after a failed read, */
+/* so that the device is looked up again next time */
+static void vbd_drop_backing(struct priv_data *priv, struct vbd_dev *dev)
+{
+	if (dev->bd_fd == -1)
+		return;
+	close(dev->bd_fd);
+	dev->bd_fd = -1;
+	priv->num_vbd_fds--;
+}
+
+/* Read the statistics of the block device backing dev into vbd, zero if they are */
+/* not available */
+static void vbd_read_backing(struct priv_data *priv, struct vbd_dev *dev,
+			     xenstat_vbd *vbd)
+{
+	char buf[BD_STAT_BUF_LEN];
+	ssize_t num_read = -1;
+	int fd, transient;
+
+	fd = vbd_open_backing(priv, dev, &transient);
+	if (fd != -1) {
+		num_read = pread(fd, buf, sizeof(buf) - 1, 0);
+		if (transient)
+			close(fd);
+		else if (num_read <= 0)
+			vbd_drop_backing(priv, dev);
+	}
+	parse_backing(buf, num_read, vbd);
+}
+
+/* Read all the statistics of dev.  Returns 0 if one of the mandatory ones is */
+/* missing. */
+static int vbd_read(struct priv_data *priv, struct vbd_dev *dev,
+		    xenstat_vbd *vbd)
+{
+	/* Flush and discard counters are missing on older blkbacks */
+	if (!vbd_read_stat(priv, dev, VBD_STAT_F_REQ, &vbd->f_reqs))
+		vbd->f_reqs = 0;
+	if (!vbd_read_stat(priv, dev, VBD_STAT_DS_REQ, &vbd->ds_reqs))
+		vbd->ds_reqs = 0;
+
+	return vbd_read_stat(priv, dev, VBD_STAT_OO_REQ, &vbd->oo_reqs) &&
+	       vbd_read_stat(priv, dev, VBD_STAT_RD_REQ, &vbd->rd_reqs) &&
+	       vbd_read_stat(priv, dev, VBD_STAT_WR_REQ, &vbd->wr_reqs) &&
+	       vbd_read_stat(priv, dev, VBD_STAT_RD_SECT, &vbd->rd_sects) &&
+	       vbd_read_stat(priv, dev, VBD_STAT_WR_SECT, &vbd->wr_sects);
+}
+
+#ifdef HAVE_IO_URING
+static void ring_close(struct io_ring *ring)
+{
+	if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	if (ring->fd != -1)
+		close(ring->fd);
+	free(ring);
+}
+
+/* Set up an io_uring instance.  Returns NULL if the kernel does not support it. */
+static struct io_ring *ring_open(void)
+{
+	struct io_uring_params params;
+	struct io_ring *ring;
+
+	ring = calloc(1, sizeof(struct io_ring));
+	if (ring == NULL)
+		return NULL;
+
+	memset(&params, 0, sizeof(params));
+	ring->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+	if (ring->fd == -1)
+		goto err;
+
+	ring->sq_ring_size = params.sq_off.array +
+		params.sq_entries * sizeof(unsigned int);
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd,
+			     IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		goto err;
+
+	ring->cq_ring_size = params.cq_off.cqes +
+		params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd,
+			     IORING_OFF_CQ_RING);
+	if (ring->cq_ring == MAP_FAILED)
+		goto err;
+
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd,
+			  IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto err;
+
+	ring->sq_tail = (unsigned int *)((char *)ring->sq_ring +
+					 params.sq_off.tail);
+	ring->sq_mask = (unsigned int *)((char *)ring->sq_ring +
+					 params.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)((char *)ring->sq_ring +
+					  params.sq_off.array);
+	ring->cq_head = (unsigned int *)((char *)ring->cq_ring +
+					 params.cq_off.head);
+	ring->cq_tail = (unsigned int *)((char *)ring->cq_ring +
+					 params.cq_off.tail);
+	ring->cq_mask = (unsigned int *)((char *)ring->cq_ring +
+					 params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring +
+					     params.cq_off.cqes);
+
+	return ring;
+
+err:
+	ring_close(ring);
+	return NULL;
+}
+
+/* Move the completions posted so far into reads[], returning how many there were */
+static unsigned int ring_reap(struct io_ring *ring, struct stat_read *reads)
+{
+	unsigned int head, tail, n = 0;
+
+	head = *ring->cq_head;
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++, n++) {
+		struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+		reads[cqe->user_data].res = cqe->res;
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+	return n;
+}
+
+/* Submit the reads of reads[0..n) in batches of RING_ENTRIES and wait for all of */
+/* them.  Returns 0 if the ring cannot be used, after waiting for the reads already */
+/* submitted where possible; the caller must then close the ring before reading */
+/* into the same buffers. */
+static int ring_read(struct io_ring *ring, struct stat_read *reads,
+		     unsigned int n)
+{
+	unsigned int base, i, done, submitted, batch, tail;
+	long ret;
+
+	for (base = 0; base < n; base += batch) {
+		batch = n - base < RING_ENTRIES ? n - base : RING_ENTRIES;
+
+		tail = *ring->sq_tail;
+		for (i = 0; i < batch; i++) {
+			unsigned int idx = (tail + i) & *ring->sq_mask;
+			struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = IORING_OP_READ;
+			sqe->fd = reads[base + i].fd;
+			sqe->addr = (unsigned long)reads[base + i].buf;
+			sqe->len = reads[base + i].size - 1;
+			sqe->user_data = base + i;
+			ring->sq_array[idx] = idx;
+		}
+		__atomic_store_n(ring->sq_tail, tail + batch, __ATOMIC_RELEASE);
+
+		for (done = 0, submitted = 0; done < batch; ) {
+			ret = syscall(__NR_io_uring_enter, ring->fd,
+				      batch - submitted, batch - done,
+				      IORING_ENTER_GETEVENTS, NULL, 0);
+			if (ret < 0 && errno != EINTR) {
+				/* Wait for the reads in flight */
+				while (done < submitted &&
+				       (syscall(__NR_io_uring_enter, ring->fd,
+						0, submitted - done,
+						IORING_ENTER_GETEVENTS,
+						NULL, 0) >= 0 ||
+					errno == EINTR))
+					done += ring_reap(ring, reads);
+				return 0;
+			}
+			if (ret > 0)
+				submitted += ret;
+			done += ring_reap(ring, reads);
 		}
-		header[sizeof(PROCNETDEV_HEADER) - 1] = '\0';
-		if (strcmp(header, PROCNETDEV_HEADER) != 0) {
-			fprintf(stderr,
-				"Unexpected /proc/net/dev format\n");
+
+		/* Kernels before 5.6 do not know IORING_OP_READ */
+		if (reads[base].res == -EINVAL)
 			return 0;
+	}
+
+	return 1;
+}
+#endif
+
+/* Read the n statistics files of reads[], as one io_uring batch if enabled */
+static void read_stats(xenstat_handle * handle, struct priv_data *priv,
+		       struct stat_read *reads, unsigned int n)
+{
+	unsigned int i;
+
+#ifdef HAVE_IO_URING
+	if (handle->batch_reads && !priv->ring_failed) {
+		if (priv->ring == NULL)
+			priv->ring = ring_open();
+		if (priv->ring != NULL && ring_read(priv->ring, reads, n))
+			return;
+		/* Closing it cancels any read still queued */
+		if (priv->ring != NULL) {
+			ring_close(priv->ring);
+			priv->ring = NULL;
 		}
+		priv->ring_failed = 1;
 	}
+#endif
 
-	/* Fill in networks */
-	/* FIXME: optimize this */
-	fseek(priv->procnetdev, sizeof(PROCNETDEV_HEADER) - 1,
-	      SEEK_SET);
+	for (i = 0; i < n; i++) {
+		reads[i].res = pread(reads[i].fd, reads[i].buf,
+				     reads[i].size - 1, 0);
+		if (reads[i].res < 0)
+			reads[i].res = -errno;
+	}
+}
 
-	/* We get the bridge devices for use with bonding interface to get bonding interface stats */
-	snprintf(devBridge, 16, "%s", getBridge("vir"));
-	snprintf(devNoBridge, 16, "p%s", devBridge);
+/* Look up backend device name in the first num sorted entries of the list */
+static struct vbd_dev *vbd_find(struct priv_data *priv, const char *name,
+				unsigned int num)
+{
+	struct vbd_dev key;
+
+	strcpy(key.name, name);
+	return bsearch(&key, priv->vbd_devs, num, sizeof(struct vbd_dev),
+		       compare_vbd_dev);
+}
+
+/* Append backend device name to the list, unsorted.  Returns NULL if memory could */
+/* not be allocated. */
+static struct vbd_dev *vbd_append(struct priv_data *priv, const char *name,
+				  xenstat_vbd *vbd, unsigned int domid)
+{
+	struct vbd_dev *dev;
+	int i;
+
+	if (priv->num_vbd_devs == priv->max_vbd_devs) {
+		unsigned int max = priv->max_vbd_devs ?
+			2 * priv->max_vbd_devs : 64;
+
+		dev = realloc(priv->vbd_devs, max * sizeof(*dev));
+		if (dev == NULL)
+			return NULL;
+		priv->vbd_devs = dev;
+		priv->max_vbd_devs = max;
+	}
+
+	dev = &priv->vbd_devs[priv->num_vbd_devs++];
+	strcpy(dev->name, name);
+	dev->domid = domid;
+	dev->back_type = vbd->back_type;
+	dev->dev = vbd->dev;
+	for (i = 0; i < VBD_NUM_STATS; i++)
+		dev->fd[i] = -1;
+	dev->missing = 0;
+	dev->bd_fd = -1;
+	dev->bd_missing = 0;
+	dev->bd_res = -1;
+	dev->seen = 1;
+
+	return dev;
+}
+
+/* Rebuild the list of backend devices from the sysfs directory, keeping the open */
+/* files of the devices that are still there.  Returns 0 if memory could not be */
+/* allocated, 1 otherwise. */
+static int scan_vbds(struct priv_data *priv)
+{
+	struct dirent *dp;
+	struct vbd_dev *dev;
+	unsigned int i, j, num_sorted = priv->num_vbd_devs;
+	int added = 0;
 
-	while (fgets(line, 512, priv->procnetdev)) {
-		xenstat_domain *domain;
-		xenstat_network net;
+	rewinddir(priv->sysfsvbd);
+
+	for(dp = readdir(priv->sysfsvbd); dp != NULL ;
+	    dp = readdir(priv->sysfsvbd)) {
+		xenstat_vbd vbd;
 		unsigned int domid;
 
-		parseNetDevLine(line, iface, &rxBytes, &rxPackets, &rxErrs, &rxDrops, NULL, NULL, NULL,
-				NULL, &txBytes, &txPackets, &txErrs, &txDrops, NULL, NULL, NULL, NULL);
-
-		/* If the device parsed is network bridge and both tx & rx packets are zero, we are most */
-		/* likely using bonding so we alter the configuration for dom0 to have bridge stats */
-		if ((strstr(iface, devBridge) != NULL) &&
-		    (strstr(iface, devNoBridge) == NULL) &&
-		    ((domain = xenstat_node_domain(node, 0)) != NULL)) {
-			for (i = 0; i < domain->num_networks; i++) {
-				if ((domain->networks[i].id != 0) ||
-				    (domain->networks[i].tbytes != 0) ||
-				    (domain->networks[i].rbytes != 0))
+		if (!parse_vbd_name(dp->d_name, &vbd, &domid))
+			continue;
+
+		dev = vbd_find(priv, dp->d_name, num_sorted);
+		if (dev != NULL) {
+			dev->seen = 1;
+			continue;
+		}
+
+		if (vbd_append(priv, dp->d_name, &vbd, domid) == NULL)
+			return 0;
+		added = 1;
+	}
+
+	/* Drop the devices that went away */
+	for (i = j = 0; i < priv->num_vbd_devs; i++) {
+		dev = &priv->vbd_devs[i];
+		if (!dev->seen) {
+			vbd_close(priv, dev);
+			continue;
+		}
+		dev->seen = 0;
+		if (i != j)
+			priv->vbd_devs[j] = *dev;
+		j++;
+	}
+	priv->num_vbd_devs = j;
+
+	if (added)
+		qsort(priv->vbd_devs, priv->num_vbd_devs,
+		      sizeof(struct vbd_dev), compare_vbd_dev);
+
+	return 1;
+}
+
+/* Apply one kernel uevent to the list of backend devices.  Returns 0 if memory */
+/* could not be allocated, 1 otherwise. */
+static int vbd_uevent(struct priv_data *priv, char *msg, size_t len)
+{
+	const char *action = NULL, *devpath = NULL, *subsystem = NULL;
+	const char *name;
+	struct vbd_dev *dev;
+	xenstat_vbd vbd;
+	unsigned int domid;
+	char *p, *end = msg + len;
+
+	/* "action@devpath" followed by KEY=value strings */
+	for (p = msg + strnlen(msg, len) + 1; p < end; p += strlen(p) + 1) {
+		if (memchr(p, '\0', end - p) == NULL)
+			break;
+		if (strncmp(p, "ACTION=", 7) == 0)
+			action = p + 7;
+		else if (strncmp(p, "DEVPATH=", 8) == 0)
+			devpath = p + 8;
+		else if (strncmp(p, "SUBSYSTEM=", 10) == 0)
+			subsystem = p + 10;
+	}
+
+	if (action == NULL || devpath == NULL || subsystem == NULL ||
+	    strcmp(subsystem, "xen-backend") != 0)
+		return 1;
+
+	name = strrchr(devpath, '/');
+	name = name ? name + 1 : devpath;
+	if (!parse_vbd_name(name, &vbd, &domid))
+		return 1;
+
+	dev = vbd_find(priv, name, priv->num_vbd_devs);
+	if (strcmp(action, "add") == 0) {
+		if (dev != NULL)
+			return 1;
+		dev = vbd_append(priv, name, &vbd, domid);
+		if (dev == NULL)
+			return 0;
+		dev->seen = 0;
+		qsort(priv->vbd_devs, priv->num_vbd_devs,
+		      sizeof(struct vbd_dev), compare_vbd_dev);
+	} else if (strcmp(action, "remove") == 0 && dev != NULL) {
+		vbd_close(priv, dev);
+		memmove(dev, dev + 1, (priv->vbd_devs + priv->num_vbd_devs -
+				       (dev + 1)) * sizeof(struct vbd_dev));
+		priv->num_vbd_devs--;
+	}
+
+	return 1;
+}
+
+/* Open the socket receiving kernel uevents, non-blocking */
+static int open_uevent_monitor(struct priv_data *priv)
+{
+	struct sockaddr_nl addr;
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_KOBJECT_UEVENT);
+	if (fd == -1)
+		return 0;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = 1;		/* Kernel events */
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+	    fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+		close(fd);
+		return 0;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	priv->uevent = fd;
+	return 1;
+}
+
+/* Bring the list of backend devices up to date.  The directory is scanned once, */
+/* then kept up to date from uevents, so a tick only has to drain the (usually */
+/* empty) socket.  Returns 0 if memory could not be allocated, 1 otherwise. */
+static int update_vbds(struct priv_data *priv)
+{
+	struct sockaddr_nl addr;
+	socklen_t addrlen;
+	ssize_t len;
+	int rescan = !priv->vbds_valid;
+
+	/* Subscribe before the initial scan so no change can be missed */
+	if (priv->uevent == -1 && !priv->uevent_failed) {
+		if (!open_uevent_monitor(priv))
+			priv->uevent_failed = 1;
+		rescan = 1;
+	}
+
+	/* Without uevents the only option is to rescan every time */
+	if (priv->uevent == -1)
+		rescan = 1;
+	else if (priv->netlink_buf != NULL ||
+		 (priv->netlink_buf = malloc(NETLINK_BUF_SIZE)) != NULL) {
+		for (;;) {
+			addrlen = sizeof(addr);
+			len = recvfrom(priv->uevent, priv->netlink_buf,
+				       NETLINK_BUF_SIZE - 1, MSG_TRUNC,
+				       (struct sockaddr *)&addr, &addrlen);
+			if (len < 0) {
+				if (errno == EINTR)
 					continue;
-				domain->networks[i].tbytes = txBytes;
-				domain->networks[i].tpackets = txPackets;
-				domain->networks[i].terrs = txErrs;
-				domain->networks[i].tdrop = txDrops;
-				domain->networks[i].rbytes = rxBytes;
-				domain->networks[i].rpackets = rxPackets;
-				domain->networks[i].rerrs = rxErrs;
-				domain->networks[i].rdrop = rxDrops;
+				/* ENOBUFS: events were dropped */
+				if (errno != EAGAIN && errno != EWOULDBLOCK)
+					rescan = 1;
+				break;
+			}
+			if (len >= NETLINK_BUF_SIZE) {
+				rescan = 1;
+				continue;
 			}
+			/* Only trust the kernel */
+			if (addr.nl_pid != 0)
+				continue;
+			priv->netlink_buf[len] = '\0';
+			if (!vbd_uevent(priv, priv->netlink_buf, len))
+				rescan = 1;
 		}
-		else /* Otherwise we need to preserve old behaviour */
-		if (strstr(iface, "vif") != NULL) {
-			sscanf(iface, "vif%u.%u", &domid, &net.id);
-
-			net.tbytes = txBytes;
-			net.tpackets = txPackets;
-			net.terrs = txErrs;
-			net.tdrop = txDrops;
-			net.rbytes = rxBytes;
-			net.rpackets = rxPackets;
-			net.rerrs = rxErrs;
-			net.rdrop = rxDrops;
+	}
+	else
+		rescan = 1;
 
-		/* FIXME: this does a search for the domid */
-		  domain = xenstat_node_domain(node, domid);
-		  if (domain == NULL) {
-			fprintf(stderr,
-				"Found interface vif%u.%u but domain %u"
-				" does not exist.\n", domid, net.id,
-				domid);
+	if (rescan)
+		priv->vbds_valid = scan_vbds(priv);
+
+	return priv->vbds_valid;
+}
+
+/* Move the queued VBDs, already counted per domain, into their domains */
+static int distribute_vbds(xenstat_node * node, struct priv_data *priv)
+{
+	struct pending_vbd *pending, *end;
+	xenstat_domain *domain;
+	unsigned int i;
+
+	for (i = 0; i < node->num_domains; i++) {
+		domain = &node->domains[i];
+		if (domain->num_vbds == 0)
 			continue;
-		  }
-		  if (domain->networks == NULL) {
-			domain->num_networks = 1;
-			domain->networks = malloc(sizeof(xenstat_network));
-		  } else {
-			struct xenstat_network *tmp;
-			domain->num_networks++;
-			tmp = realloc(domain->networks,
-				      domain->num_networks *
-				      sizeof(xenstat_network));
-			if (tmp == NULL)
-				free(domain->networks);
-			domain->networks = tmp;
-		  }
-		  if (domain->networks == NULL)
+		domain->vbds = malloc(domain->num_vbds * sizeof(xenstat_vbd));
+		if (domain->vbds == NULL)
 			return 0;
-		  domain->networks[domain->num_networks - 1] = net;
-          }
-        }
+		domain->num_vbds = 0;
+	}
+
+	end = priv->pending_vbds + priv->num_pending_vbds;
+	for (pending = priv->pending_vbds; pending < end; pending++) {
+		domain = pending->domain;
+		domain->vbds[domain->num_vbds++] = pending->vbd;
+	}
 
 	return 1;
 }
 
-/* Free network information in handle */
-void xenstat_uninit_networks(xenstat_handle * handle)
+/* Record the result of statistics file read sr in its device */
+static void stat_result(struct priv_data *priv, struct stat_read *sr)
 {
-	struct priv_data *priv = get_priv_data(handle);
-	if (priv != NULL && priv->procnetdev != NULL)
-		fclose(priv->procnetdev);
+	struct vbd_dev *dev = &priv->vbd_devs[sr->dev];
+
+	if (sr->stat == VBD_STAT_BACKING)
+		dev->bd_res = sr->res;
+	else if (parse_stat(sr->buf, sr->res, &dev->val[sr->stat]))
+		dev->valid |= 1 << sr->stat;
 }
 
-static int read_attributes_vbd(const char *vbd_directory, const char *what, char *ret, int cap)
+/* Size the budget of statistics files kept open from the soft limit on open */
+/* files, leaving half of it to the application.  Read on every collection, so */
+/* that an application raising the limit gets the files kept open. */
+static void vbd_fd_budget(struct priv_data *priv)
 {
-	static char file_name[80];
-	int fd, num_read;
+	struct rlimit rl;
 
-	snprintf(file_name, sizeof(file_name), "%s/%s/%s",
-		SYSFS_VBD_PATH, vbd_directory, what);
-	fd = open(file_name, O_RDONLY, 0);
-	if (fd==-1) return -1;
-	num_read = read(fd, ret, cap - 1);
-	close(fd);
-	if (num_read<=0) return -1;
-	ret[num_read] = '\0';
-	return num_read;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 &&
+	    rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < VBD_MAX_NOFILE)
+		priv->max_vbd_fds = rl.rlim_cur / 2;
+	else
+		priv->max_vbd_fds = VBD_MAX_NOFILE / 2;
 }
 
 /* Collect information about VBDs */
 int xenstat_collect_vbds(xenstat_node * node)
 {
-	struct dirent *dp;
 	struct priv_data *priv = get_priv_data(node->handle);
+	unsigned int i, num_reads;
 
 	if (priv == NULL) {
 		perror("Allocation error");
@@ -396,88 +1745,170 @@ int xenstat_collect_vbds(xenstat_node * node)
 			return 0;
 		}
 	}
+	vbd_fd_budget(priv);
 
-	rewinddir(priv->sysfsvbd);
+	if (!update_vbds(priv))
+		return 0;
 
-	for(dp = readdir(priv->sysfsvbd); dp != NULL ;
-	    dp = readdir(priv->sysfsvbd)) {
-		xenstat_domain *domain;
-		xenstat_vbd vbd;
-		unsigned int domid;
-		int ret;
-		char buf[256];
+	/* The statistics files and the backing device stat of every VBD */
+	if (priv->max_stat_reads < priv->num_vbd_devs * (VBD_NUM_STATS + 1)) {
+		unsigned int max = priv->num_vbd_devs * (VBD_NUM_STATS + 1);
+		struct stat_read *tmp;
+		char *bufs;
 
-		ret = sscanf(dp->d_name, "%3s-%u-%u", buf, &domid, &vbd.dev);
-		if (ret != 3)
-			continue;
+		tmp = realloc(priv->stat_reads, max * sizeof(*tmp));
+		if (tmp == NULL)
+			return 0;
+		priv->stat_reads = tmp;
+		bufs = realloc(priv->bd_bufs,
+			       priv->num_vbd_devs * BD_STAT_BUF_LEN);
+		if (bufs == NULL)
+			return 0;
+		priv->bd_bufs = bufs;
+		priv->max_stat_reads = max;
+	}
 
-		if (strcmp(buf,"vbd") == 0)
-			vbd.back_type = 1;
-		else if (strcmp(buf,"tap") == 0)
-			vbd.back_type = 2;
-		else
-			continue;
+	/* Gather the files to read */
+	num_reads = 0;
+	for (i = 0; i < priv->num_vbd_devs; i++) {
+		struct vbd_dev *dev = &priv->vbd_devs[i];
+		int stat;
 
-		domain = xenstat_node_domain(node, domid);
-		if (domain == NULL) {
-			fprintf(stderr,
-				"Found interface %s-%u-%u but domain %u"
-				" does not exist.\n",
-				buf, domid, vbd.dev, domid);
+		dev->valid = 0;
+		dev->bd_res = -1;
+		dev->domain = xenstat_node_domain(node, dev->domid);
+		if (dev->domain == NULL) {
+			if (node->handle->filter == NULL)
+				fprintf(stderr,
+					"Found interface %s but domain %u"
+					" does not exist.\n",
+					dev->name, dev->domid);
 			continue;
 		}
 
-		if((read_attributes_vbd(dp->d_name, "statistics/oo_req", buf, 256)<=0)
-		   || ((ret = sscanf(buf, "%llu", &vbd.oo_reqs)) != 1))
-		{
-			continue;
-		}
+		for (stat = 0; stat <= VBD_STAT_BACKING; stat++) {
+			struct stat_read *sr = &priv->stat_reads[num_reads];
+			int transient;
 
-		if((read_attributes_vbd(dp->d_name, "statistics/rd_req", buf, 256)<=0)
-		   || ((ret = sscanf(buf, "%llu", &vbd.rd_reqs)) != 1))
-		{
-			continue;
+			if (stat == VBD_STAT_BACKING) {
+				sr->fd = vbd_open_backing(priv, dev, &transient);
+				sr->buf = priv->bd_bufs + i * BD_STAT_BUF_LEN;
+				sr->size = BD_STAT_BUF_LEN;
+			} else {
+				sr->fd = vbd_open_stat(priv, dev, stat,
+						       &transient);
+				sr->buf = sr->val;
+				sr->size = STAT_BUF_LEN;
+			}
+			if (sr->fd == -1)
+				continue;
+			sr->dev = i;
+			sr->stat = stat;
+			/* Past the budget, read the file right away rather */
+			/* than hold it open until the batch */
+			if (transient) {
+				sr->res = pread(sr->fd, sr->buf, sr->size - 1, 0);
+				close(sr->fd);
+				stat_result(priv, sr);
+				continue;
+			}
+			num_reads++;
 		}
+	}
 
-		if((read_attributes_vbd(dp->d_name, "statistics/wr_req", buf, 256)<=0)
-		   || ((ret = sscanf(buf, "%llu", &vbd.wr_reqs)) != 1))
-		{
-			continue;
-		}
+	read_stats(node->handle, priv, priv->stat_reads, num_reads);
 
-		if((read_attributes_vbd(dp->d_name, "statistics/rd_sect", buf, 256)<=0)
-		   || ((ret = sscanf(buf, "%llu", &vbd.rd_sects)) != 1))
-		{
-			continue;
-		}
+	for (i = 0; i < num_reads; i++) {
+		struct stat_read *sr = &priv->stat_reads[i];
+
+		stat_result(priv, sr);
+		if (sr->stat == VBD_STAT_BACKING && sr->res <= 0)
+			vbd_drop_backing(priv, &priv->vbd_devs[sr->dev]);
+	}
 
-		if((read_attributes_vbd(dp->d_name, "statistics/wr_sect", buf, 256)<=0)
-		   || ((ret = sscanf(buf, "%llu", &vbd.wr_sects)) != 1))
-		{
+	priv->num_pending_vbds = 0;
+
+	for (i = 0; i < priv->num_vbd_devs; i++) {
+		struct vbd_dev *dev = &priv->vbd_devs[i];
+		unsigned long long *val = dev->val;
+		xenstat_domain *domain = dev->domain;
+		xenstat_vbd vbd;
+
+		if (domain == NULL)
 			continue;
-		}
 
-		if (domain->vbds == NULL) {
-			domain->num_vbds = 1;
-			domain->vbds = malloc(sizeof(xenstat_vbd));
+		vbd.back_type = dev->back_type;
+		vbd.dev = dev->dev;
+		vbd.name[0] = '\0';
+		vbd.backend[0] = '\0';
+		if ((dev->valid & VBD_REQUIRED_STATS) == VBD_REQUIRED_STATS) {
+			vbd.oo_reqs = val[VBD_STAT_OO_REQ];
+			vbd.rd_reqs = val[VBD_STAT_RD_REQ];
+			vbd.wr_reqs = val[VBD_STAT_WR_REQ];
+			vbd.rd_sects = val[VBD_STAT_RD_SECT];
+			vbd.wr_sects = val[VBD_STAT_WR_SECT];
+			/* Flush and discard counters are missing on */
+			/* older blkbacks */
+			vbd.f_reqs = (dev->valid & (1 << VBD_STAT_F_REQ)) ?
+				val[VBD_STAT_F_REQ] : 0;
+			vbd.ds_reqs = (dev->valid & (1 << VBD_STAT_DS_REQ)) ?
+				val[VBD_STAT_DS_REQ] : 0;
+			parse_backing(priv->bd_bufs + i * BD_STAT_BUF_LEN,
+				      dev->bd_res, &vbd);
 		} else {
-			domain->num_vbds++;
-			domain->vbds = realloc(domain->vbds,
-					       domain->num_vbds *
-					       sizeof(xenstat_vbd));
+			/* The device may have been replaced since the */
+			/* files were opened */
+			vbd_close(priv, dev);
+			if (!vbd_read(priv, dev, &vbd))
+				continue;
+			vbd_read_backing(priv, dev, &vbd);
 		}
-		if (domain->vbds == NULL)
-			return 0;
-		domain->vbds[domain->num_vbds - 1] = vbd;
+
+		if (priv->num_pending_vbds == priv->max_pending_vbds) {
+			unsigned int max = priv->max_pending_vbds ?
+				2 * priv->max_pending_vbds : 64;
+			struct pending_vbd *tmp;
+
+			tmp = realloc(priv->pending_vbds, max * sizeof(*tmp));
+			if (tmp == NULL)
+				return 0;
+			priv->pending_vbds = tmp;
+			priv->max_pending_vbds = max;
+		}
+		priv->pending_vbds[priv->num_pending_vbds].domain = domain;
+		priv->pending_vbds[priv->num_pending_vbds].vbd = vbd;
+		priv->num_pending_vbds++;
+		domain->num_vbds++;
 	}
 
-	return 1;	
+	if (!distribute_vbds(node, priv))
+		return 0;
+
+	/* qdisk backends live in the device models, not in sysfs */
+	return xenstat_qmp_collect_vbds(node, &priv->qmp);
 }
 
 /* Free VBD information in handle */
 void xenstat_uninit_vbds(xenstat_handle * handle)
 {
 	struct priv_data *priv = get_priv_data(handle);
+	unsigned int i;
+
 	if (priv != NULL && priv->sysfsvbd != NULL)
 		closedir(priv->sysfsvbd);
+	if (priv != NULL && priv->uevent != -1)
+		close(priv->uevent);
+	if (priv != NULL) {
+		for (i = 0; i < priv->num_vbd_devs; i++)
+			vbd_close(priv, &priv->vbd_devs[i]);
+		free(priv->vbd_devs);
+		free(priv->stat_reads);
+		free(priv->bd_bufs);
+		free(priv->pending_vbds);
+		xenstat_qmp_uninit(priv->qmp);
+#ifdef HAVE_IO_URING
+		if (priv->ring != NULL)
+			ring_close(priv->ring);
+#endif
+	}
 }
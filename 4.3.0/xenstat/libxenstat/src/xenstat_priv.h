@@ -32,10 +32,30 @@
 #define SHORT_ASC_LEN 5                 /* length of 65535 */
 #define VERSION_SIZE (2 * SHORT_ASC_LEN + 1 + sizeof(xen_extraversion_t) + 1)
 
+/* Backends count transfers in 512-byte sectors whatever the device's
+ * logical block size */
+#define VBD_SECTOR_SIZE 512
+
+/* Sizes of the device names resolved from xenstore */
+#define DEVNAME_SIZE 16
+#define MAC_SIZE 18
+#define BACKEND_PATH_SIZE 64
+
+typedef struct xenstat_numa_node xenstat_numa_node;
+
 struct xenstat_handle {
 	xc_interface *xc_handle;
 	struct xs_handle *xshandle; /* xenstore handle */
 	int page_size;
+	unsigned int net_source;	/* XENSTAT_NETSRC_* */
+	int batch_reads;		/* Use io_uring for VBD statistics */
+	char *qmp_path;			/* QMP sockets, NULL for the default */
+	xenstat_domain_filter filter;	/* Domains to collect, NULL for all */
+	void *filter_arg;
+	struct xenstat_devname *devnames; /* Names of the devices, by key */
+	unsigned int num_devnames;
+	unsigned int max_devnames;
+	unsigned int devnames_gen;	/* Sample that last used an entry */
 	void *priv;
 	char xen_version[VERSION_SIZE]; /* xen version running on this node */
 };
@@ -50,6 +70,16 @@ struct xenstat_node {
 	unsigned int num_domains;
 	xenstat_domain *domains;	/* Array of length num_domains */
 	long freeable_mb;
+	unsigned int num_numa_nodes;
+	xenstat_numa_node *numa_nodes;	/* Array of length num_numa_nodes */
+	unsigned int *numa_distance;	/* num_numa_nodes^2 matrix */
+	unsigned long long idle_ns;	/* Idle time of all physical CPUs */
+};
+
+struct xenstat_numa_node {
+	unsigned long long tot_mem;
+	unsigned long long free_mem;
+	unsigned int num_cpus;
 };
 
 struct xenstat_tmem {
@@ -74,35 +104,73 @@ struct xenstat_domain {
 	unsigned int num_vbds;
 	xenstat_vbd *vbds;
 	xenstat_tmem tmem_stats;
+	unsigned int num_numa_nodes;
+	unsigned long long *numa_mem;	/* Estimates, of length num_numa_nodes */
+	unsigned long long numa_remote_mem;
 };
 
 struct xenstat_vcpu {
 	unsigned int online;
 	unsigned long long ns;
+	unsigned int cpu;
 };
 
 struct xenstat_network {
 	unsigned int id;
+	char name[DEVNAME_SIZE];
+	char mac[MAC_SIZE];
+	char backend[BACKEND_PATH_SIZE];
 	/* Received */
 	unsigned long long rbytes;
 	unsigned long long rpackets;
 	unsigned long long rerrs;
 	unsigned long long rdrop;
+	unsigned long long rfifo;
+	unsigned long long rframe;
+	unsigned long long rcompressed;
+	unsigned long long rmcast;
 	/* Transmitted */
 	unsigned long long tbytes;
 	unsigned long long tpackets;
 	unsigned long long terrs;
 	unsigned long long tdrop;
+	unsigned long long tfifo;
+	unsigned long long tcolls;
+	unsigned long long tcarrier;
+	unsigned long long tcompressed;
 };
 
 struct xenstat_vbd {
 	unsigned int back_type;
 	unsigned int dev;
+	char name[DEVNAME_SIZE];
+	char backend[BACKEND_PATH_SIZE];
 	unsigned long long oo_reqs;
 	unsigned long long rd_reqs;
 	unsigned long long wr_reqs;
+	unsigned long long f_reqs;
+	unsigned long long ds_reqs;
 	unsigned long long rd_sects;
 	unsigned long long wr_sects;
+	/* Backing block device */
+	unsigned long long bd_ios;
+	unsigned long long bd_ticks;
+	unsigned long long io_ticks;
+	unsigned long long queue_ticks;
+	unsigned int inflight;
+};
+
+/* Names of a network or VBD, resolved from xenstore once per device, or on */
+/* each sample until all of them could be read */
+struct xenstat_devname {
+	unsigned int type;		/* 0 for networks, else the VBD type */
+	unsigned int domid;
+	unsigned int devid;
+	unsigned int gen;
+	int complete;			/* No name left to read */
+	char name[DEVNAME_SIZE];
+	char mac[MAC_SIZE];
+	char backend[BACKEND_PATH_SIZE];
 };
 
 extern int xenstat_collect_networks(xenstat_node * node);
@@ -110,4 +178,10 @@ extern void xenstat_uninit_networks(xenstat_handle * handle);
 extern int xenstat_collect_vbds(xenstat_node * node);
 extern void xenstat_uninit_vbds(xenstat_handle * handle);
 
+/* VBDs served by QEMU device models (qdisk), see xenstat_qmp.c */
+typedef struct xenstat_qmp xenstat_qmp;
+
+extern int xenstat_qmp_collect_vbds(xenstat_node * node, xenstat_qmp ** qmp);
+extern void xenstat_qmp_uninit(xenstat_qmp * qmp);
+
 #endif /* XENSTAT_PRIV_H */
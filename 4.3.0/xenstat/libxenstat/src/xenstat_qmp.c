@@ -0,0 +1,617 @@
+/* libxenstat: statistics-collection library for Xen
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/*
+ * Block statistics of disks served by QEMU device models (qdisk), which
+ * do not show up under /sys/bus/xen-backend.  They are queried with
+ * query-blockstats over a QMP socket dedicated to libxenstat, since QEMU
+ * only serves one client per QMP socket and the one of libxl must stay
+ * free.  The device model has to be started with
+ *   -qmp unix:/var/run/xen/qmp-libxenstat-<domid>,server,nowait
+ * eg. through device_model_args_hvm, or with the path set with
+ * xenstat_set_qmp_path().  Only the domains with a device model listed in
+ * xenstore are queried.
+ *
+ * Disks of tapdisk2 (blktap2) are served by blkback on top of a tapdev, so
+ * they are already reported from sysfs.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "xenstat_priv.h"
+
+#define QMP_SOCKET_PATH "/var/run/xen/qmp-libxenstat-%u"
+#define QMP_TIMEOUT_MS 100		/* Wait for all the answers of a sample */
+#define QMP_RETRY_SAMPLES 10		/* Samples between connection attempts */
+#define QMP_BUF_MAX (1024 * 1024)
+
+static const char qmp_capabilities[] =
+	"{\"execute\":\"qmp_capabilities\"}\r\n";
+static const char qmp_query_blockstats[] =
+	"{\"execute\":\"query-blockstats\"}\r\n";
+
+/* Connection to the device model of a domain */
+struct qmp_conn {
+	unsigned int domid;
+	int fd;
+	int negotiated;			/* qmp_capabilities answered */
+	int pending;			/* Answers awaited */
+	unsigned int retry;		/* Samples to wait before reconnecting */
+	int seen;
+	char *buf;			/* Partial line received */
+	size_t len;
+	size_t size;
+};
+
+struct xenstat_qmp {
+	struct qmp_conn *conns;
+	unsigned int num_conns;
+	unsigned int max_conns;
+	struct pollfd *pollfds;
+	unsigned int max_pollfds;
+};
+
+/*
+ * Just enough of a JSON scanner to walk a QMP answer in place.
+ */
+
+static const char *json_ws(const char *p)
+{
+	while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+		p++;
+	return p;
+}
+
+/* Returns the end of the value starting at p, or NULL if it is malformed */
+static const char *json_skip(const char *p)
+{
+	const char *start;
+	char close;
+
+	p = json_ws(p);
+	switch (*p) {
+	case '"':
+		for (p++; *p != '\0' && *p != '"'; p++)
+			if (*p == '\\' && p[1] != '\0')
+				p++;
+		return *p == '"' ? p + 1 : NULL;
+	case '{':
+	case '[':
+		close = *p == '{' ? '}' : ']';
+		p = json_ws(p + 1);
+		if (*p == close)
+			return p + 1;
+		for (;;) {
+			if (close == '}') {
+				p = json_skip(p);
+				if (p == NULL || *(p = json_ws(p)) != ':')
+					return NULL;
+				p++;
+			}
+			p = json_skip(p);
+			if (p == NULL)
+				return NULL;
+			p = json_ws(p);
+			if (*p == close)
+				return p + 1;
+			if (*p != ',')
+				return NULL;
+			p++;
+		}
+	default:
+		start = p;
+		while (*p != '\0' && strchr(",:{}[] \t\r\n", *p) == NULL)
+			p++;
+		return p == start ? NULL : p;
+	}
+}
+
+/* Returns the value of member key of the object starting at p, or NULL */
+static const char *json_member(const char *p, const char *key)
+{
+	size_t key_len = strlen(key);
+	const char *name, *end;
+
+	p = json_ws(p);
+	if (*p != '{')
+		return NULL;
+	p = json_ws(p + 1);
+	while (*p == '"') {
+		name = p + 1;
+		end = json_skip(p);
+		if (end == NULL)
+			return NULL;
+		p = json_ws(end);
+		if (*p != ':')
+			return NULL;
+		p = json_ws(p + 1);
+		if (end - 1 - name == key_len && strncmp(name, key, key_len) == 0)
+			return p;
+		p = json_skip(p);
+		if (p == NULL)
+			return NULL;
+		p = json_ws(p);
+		if (*p != ',')
+			return NULL;
+		p = json_ws(p + 1);
+	}
+
+	return NULL;
+}
+
+static unsigned long long json_number(const char *obj, const char *key)
+{
+	const char *value = json_member(obj, key);
+
+	return value ? strtoull(value, NULL, 10) : 0;
+}
+
+/* Copy the string starting at p to buf.  Returns 0 if it is not a string or too */
+/* long. */
+static int json_string(const char *p, char *buf, size_t size)
+{
+	const char *end;
+	size_t len;
+
+	p = json_ws(p);
+	if (*p != '"' || (end = json_skip(p)) == NULL)
+		return 0;
+	len = end - p - 2;
+	if (len >= size || memchr(p + 1, '\\', len) != NULL)
+		return 0;
+	memcpy(buf, p + 1, len);
+	buf[len] = '\0';
+	return 1;
+}
+
+/* Index of a disk named by letters, a=0 ... z=25, aa=26 ... */
+static int disk_index(const char *p)
+{
+	int index = 0;
+
+	if (*p < 'a' || *p > 'z')
+		return -1;
+	while (*p >= 'a' && *p <= 'z')
+		index = index * 26 + (*p++ - 'a' + 1);
+	return index - 1;
+}
+
+static int ide_vdev(int index)
+{
+	if (index < 0 || index > 3)
+		return -1;
+	return ((index < 2 ? 3 : 22) << 8) | ((index & 1) << 6);
+}
+
+/* Xen virtual device number of a QEMU block device, or -1 if it is not a disk */
+static int qmp_vdev(const char *name)
+{
+	unsigned int bus, unit;
+	char *end;
+	int index;
+
+	if (sscanf(name, "ide%u-hd%u", &bus, &unit) == 2 ||
+	    sscanf(name, "ide%u-cd%u", &bus, &unit) == 2)
+		return ide_vdev(2 * bus + unit);
+
+	if (strncmp(name, "xvd", 3) == 0) {
+		index = disk_index(name + 3);
+		if (index < 0)
+			return -1;
+		if (index < 16)
+			return (202 << 8) | (index << 4);
+		return (1 << 28) | (index << 8);
+	}
+	if (strncmp(name, "hd", 2) == 0)
+		return ide_vdev(disk_index(name + 2));
+	if (strncmp(name, "sd", 2) == 0) {
+		index = disk_index(name + 2);
+		if (index < 0 || index > 15)
+			return -1;
+		return (8 << 8) | (index << 4);
+	}
+
+	index = strtol(name, &end, 10);
+	if (end == name || *end != '\0' || index < 0)
+		return -1;
+	return index;
+}
+
+/* Fill vbd from an element of the query-blockstats answer.  Returns 0 if it does */
+/* not describe a disk of the domain. */
+static int qmp_parse_vbd(xenstat_domain *domain, const char *elem,
+			 xenstat_vbd *vbd)
+{
+	const char *value, *stats;
+	char name[64];
+	unsigned int i;
+	int vdev;
+
+	value = json_member(elem, "device");
+	if (value == NULL || !json_string(value, name, sizeof(name)))
+		return 0;
+	vdev = qmp_vdev(name);
+	stats = json_member(elem, "stats");
+	if (vdev < 0 || stats == NULL)
+		return 0;
+
+	/* A disk already reported by a kernel backend */
+	for (i = 0; i < domain->num_vbds; i++)
+		if (domain->vbds[i].dev == vdev)
+			return 0;
+
+	vbd->back_type = 3;
+	vbd->dev = vdev;
+	vbd->name[0] = '\0';
+	vbd->backend[0] = '\0';
+	vbd->oo_reqs = 0;
+	vbd->rd_reqs = json_number(stats, "rd_operations");
+	vbd->wr_reqs = json_number(stats, "wr_operations");
+	vbd->f_reqs = json_number(stats, "flush_operations");
+	vbd->ds_reqs = json_number(stats, "unmap_operations");
+	vbd->rd_sects = json_number(stats, "rd_bytes") / VBD_SECTOR_SIZE;
+	vbd->wr_sects = json_number(stats, "wr_bytes") / VBD_SECTOR_SIZE;
+	vbd->bd_ios = 0;
+	vbd->bd_ticks = 0;
+	vbd->io_ticks = 0;
+	vbd->queue_ticks = 0;
+	vbd->inflight = 0;
+
+	return 1;
+}
+
+/* Add the disks of a query-blockstats answer to the domain of conn, growing its */
+/* array once.  Returns 0 if memory could not be allocated, 1 otherwise. */
+static int qmp_blockstats(xenstat_node * node, struct qmp_conn *conn,
+			  const char *list)
+{
+	xenstat_domain *domain;
+	xenstat_vbd vbd, *vbds;
+	const char *elem, *p;
+	unsigned int count, pass;
+
+	domain = xenstat_node_domain(node, conn->domid);
+	list = json_ws(list);
+	if (domain == NULL || *list != '[')
+		return 1;
+
+	/* Count the disks, then store them */
+	for (pass = 0, count = 0; pass < 2; pass++) {
+		for (elem = json_ws(list + 1); *elem == '{'; elem = json_ws(p + 1)) {
+			p = json_skip(elem);
+			if (p == NULL)
+				return 1;
+			if (qmp_parse_vbd(domain, elem, &vbd)) {
+				if (pass == 0)
+					count++;
+				else
+					domain->vbds[domain->num_vbds++] = vbd;
+			}
+			p = json_ws(p);
+			if (*p != ',')
+				break;
+		}
+		if (count == 0)
+			return 1;
+		if (pass == 0) {
+			vbds = realloc(domain->vbds, (domain->num_vbds + count) *
+				       sizeof(xenstat_vbd));
+			if (vbds == NULL)
+				return 0;
+			domain->vbds = vbds;
+		}
+	}
+
+	return 1;
+}
+
+static void qmp_close(struct qmp_conn *conn)
+{
+	if (conn->fd != -1)
+		close(conn->fd);
+	conn->fd = -1;
+	conn->pending = 0;
+	conn->len = 0;
+}
+
+static int qmp_send(struct qmp_conn *conn, const char *cmd, size_t len)
+{
+	if (send(conn->fd, cmd, len, MSG_NOSIGNAL) != (ssize_t)len) {
+		qmp_close(conn);
+		return 0;
+	}
+	conn->pending++;
+	return 1;
+}
+
+/* Whether xenstore lists a device model for domid in dom0.  PV domains without */
+/* qdisks have none, and the device model of a stub domain has no socket here. */
+static int qmp_has_device_model(xenstat_handle * handle, unsigned int domid)
+{
+	char path[64];
+	unsigned int len;
+	char *state;
+
+	snprintf(path, sizeof(path), "/local/domain/0/device-model/%u/state",
+		 domid);
+	state = xs_read(handle->xshandle, XBT_NULL, path, &len);
+	if (state == NULL)
+		return 0;
+	free(state);
+	return 1;
+}
+
+/* Connect to the device model of conn's domain at path, a QMP socket path with %u */
+/* for the domid, and negotiate capabilities without waiting for the answer */
+static int qmp_connect(struct qmp_conn *conn, const char *path)
+{
+	struct sockaddr_un addr;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (snprintf(addr.sun_path, sizeof(addr.sun_path), path,
+		     conn->domid) >= sizeof(addr.sun_path))
+		return 0;
+
+	/* Non-blocking from the start: a Unix socket connects or fails at */
+	/* once, and with a full backlog it fails with EAGAIN instead of waiting */
+	conn->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			  0);
+	if (conn->fd == -1)
+		return 0;
+	if (connect(conn->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		qmp_close(conn);
+		return 0;
+	}
+
+	conn->negotiated = 0;
+	conn->pending = 0;
+	conn->len = 0;
+	return qmp_send(conn, qmp_capabilities, sizeof(qmp_capabilities) - 1);
+}
+
+/* Handle one line received on conn: the greeting, an event or an answer */
+static int qmp_line(xenstat_node * node, struct qmp_conn *conn,
+		    const char *line)
+{
+	const char *value;
+
+	if (conn->pending == 0)
+		return 1;
+	if ((value = json_member(line, "return")) != NULL) {
+		conn->pending--;
+		if (!conn->negotiated) {
+			conn->negotiated = 1;
+			return 1;
+		}
+		return qmp_blockstats(node, conn, value);
+	}
+	if (json_member(line, "error") != NULL) {
+		conn->pending--;
+		conn->negotiated = 1;
+	}
+
+	return 1;
+}
+
+/* Read what is available on conn and handle the complete lines.  Returns 0 if */
+/* memory could not be allocated, 1 otherwise. */
+static int qmp_read(xenstat_node * node, struct qmp_conn *conn)
+{
+	char *line, *eol;
+	ssize_t num_read;
+
+	for (;;) {
+		if (conn->size - conn->len < 4096) {
+			size_t size = conn->size ? 2 * conn->size : 16384;
+			char *buf;
+
+			if (size > QMP_BUF_MAX) {
+				qmp_close(conn);
+				return 1;
+			}
+			buf = realloc(conn->buf, size);
+			if (buf == NULL)
+				return 0;
+			conn->buf = buf;
+			conn->size = size;
+		}
+
+		num_read = read(conn->fd, conn->buf + conn->len,
+				conn->size - conn->len - 1);
+		if (num_read < 0 && errno == EINTR)
+			continue;
+		if (num_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (num_read <= 0) {
+			qmp_close(conn);
+			return 1;
+		}
+		conn->len += num_read;
+		conn->buf[conn->len] = '\0';
+
+		for (line = conn->buf;
+		     (eol = strchr(line, '\n')) != NULL; line = eol + 1) {
+			*eol = '\0';
+			if (!qmp_line(node, conn, line))
+				return 0;
+		}
+		conn->len -= line - conn->buf;
+		memmove(conn->buf, line, conn->len + 1);
+	}
+
+	return 1;
+}
+
+static long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* Send query-blockstats to the device models of all the domains of node and wait */
+/* for their answers together.  Returns 0 if memory could not be allocated, 1 */
+/* otherwise. */
+static int qmp_query(xenstat_node * node, xenstat_qmp * qmp)
+{
+	const char *path = node->handle->qmp_path ?
+		node->handle->qmp_path : QMP_SOCKET_PATH;
+	struct qmp_conn *conn;
+	unsigned int i, j, n;
+	long long deadline;
+
+	for (i = 0; i < qmp->num_conns; i++)
+		qmp->conns[i].seen = 0;
+
+	/* An empty path leaves every connection unseen, so all are closed */
+	for (i = 0; path[0] != '\0' && i < node->num_domains; i++) {
+		unsigned int domid = node->domains[i].id;
+
+		if (domid == 0)
+			continue;
+		for (j = 0; j < qmp->num_conns; j++)
+			if (qmp->conns[j].domid == domid)
+				break;
+		if (j == qmp->num_conns) {
+			if (qmp->num_conns == qmp->max_conns) {
+				unsigned int max = qmp->max_conns ?
+					2 * qmp->max_conns : 16;
+
+				conn = realloc(qmp->conns, max * sizeof(*conn));
+				if (conn == NULL)
+					return 0;
+				qmp->conns = conn;
+				qmp->max_conns = max;
+			}
+			conn = &qmp->conns[qmp->num_conns++];
+			memset(conn, 0, sizeof(*conn));
+			conn->domid = domid;
+			conn->fd = -1;
+		}
+		conn = &qmp->conns[j];
+		conn->seen = 1;
+
+		if (conn->fd == -1) {
+			if (conn->retry > 0) {
+				conn->retry--;
+				continue;
+			}
+			if (!qmp_has_device_model(node->handle, domid) ||
+			    !qmp_connect(conn, path)) {
+				conn->retry = QMP_RETRY_SAMPLES;
+				continue;
+			}
+		}
+		qmp_send(conn, qmp_query_blockstats,
+			 sizeof(qmp_query_blockstats) - 1);
+	}
+
+	/* Forget the domains that went away */
+	for (i = j = 0; i < qmp->num_conns; i++) {
+		if (!qmp->conns[i].seen) {
+			qmp_close(&qmp->conns[i]);
+			free(qmp->conns[i].buf);
+			continue;
+		}
+		if (i != j)
+			qmp->conns[j] = qmp->conns[i];
+		j++;
+	}
+	qmp->num_conns = j;
+
+	if (qmp->max_pollfds < qmp->num_conns) {
+		struct pollfd *pollfds;
+
+		pollfds = realloc(qmp->pollfds,
+				  qmp->num_conns * sizeof(*pollfds));
+		if (pollfds == NULL)
+			return 0;
+		qmp->pollfds = pollfds;
+		qmp->max_pollfds = qmp->num_conns;
+	}
+
+	deadline = now_ms() + QMP_TIMEOUT_MS;
+	for (;;) {
+		long long timeout = deadline - now_ms();
+
+		for (i = n = 0; i < qmp->num_conns; i++) {
+			if (qmp->conns[i].pending == 0)
+				continue;
+			qmp->pollfds[n].fd = qmp->conns[i].fd;
+			qmp->pollfds[n].events = POLLIN;
+			qmp->pollfds[n].revents = 0;
+			n++;
+		}
+		if (n == 0 || timeout <= 0)
+			break;
+		if (poll(qmp->pollfds, n, timeout) < 0 && errno != EINTR)
+			break;
+
+		for (i = n = 0; i < qmp->num_conns; i++) {
+			conn = &qmp->conns[i];
+			if (conn->pending == 0)
+				continue;
+			if (qmp->pollfds[n++].revents && !qmp_read(node, conn))
+				return 0;
+		}
+	}
+
+	/* A late answer would be taken for the next one.  A device model that
+	 * doesn't answer in time is left alone for a while, so that it doesn't
+	 * hold up every sample by QMP_TIMEOUT_MS. */
+	for (i = 0; i < qmp->num_conns; i++)
+		if (qmp->conns[i].pending != 0) {
+			qmp_close(&qmp->conns[i]);
+			qmp->conns[i].retry = QMP_RETRY_SAMPLES;
+		}
+
+	return 1;
+}
+
+/* Collect the VBDs served by device models */
+int xenstat_qmp_collect_vbds(xenstat_node * node, xenstat_qmp ** qmp)
+{
+	if (*qmp == NULL) {
+		*qmp = calloc(1, sizeof(xenstat_qmp));
+		if (*qmp == NULL)
+			return 0;
+	}
+
+	return qmp_query(node, *qmp);
+}
+
+/* Close the connections to device models */
+void xenstat_qmp_uninit(xenstat_qmp * qmp)
+{
+	unsigned int i;
+
+	if (qmp == NULL)
+		return;
+	for (i = 0; i < qmp->num_conns; i++) {
+		qmp_close(&qmp->conns[i]);
+		free(qmp->conns[i].buf);
+	}
+	free(qmp->conns);
+	free(qmp->pollfds);
+	free(qmp);
+}
@@ -0,0 +1,271 @@
+/* libxenstat: statistics-collection library for Xen
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/* Test of the qdisk statistics collection against fake QMP servers.  Built
+ * and run with "make test", it includes xenstat_qmp.c and stands in for
+ * xenstore and the rest of the library.
+ *
+ * Domain 1 has a device model serving a QMP socket, domain 2 has one in
+ * xenstore but no socket, and domain 3 has a socket but no device model in
+ * xenstore, so it must never be contacted.  The device model of domain 4
+ * never answers, so it must be left alone after the first timeout. */
+
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "../src/xenstat_qmp.c"
+
+#define NUM_SAMPLES 3
+#define NUM_DOMAINS 5
+
+static int failures;
+
+#define CHECK(cond)							\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, "%s:%d: %s failed\n",		\
+				__FILE__, __LINE__, #cond);		\
+			failures++;					\
+		}							\
+	} while (0)
+
+/* xenstore lists a device model for every domain but 3 */
+void *xs_read(struct xs_handle *h, xs_transaction_t t, const char *path,
+	      unsigned int *len)
+{
+	unsigned int domid;
+
+	if (sscanf(path, "/local/domain/0/device-model/%u/state",
+		   &domid) != 1 || domid == 3)
+		return NULL;
+	*len = strlen("running");
+	return strdup("running");
+}
+
+xenstat_domain *xenstat_node_domain(xenstat_node * node, unsigned int domid)
+{
+	unsigned int i;
+
+	for (i = 0; i < node->num_domains; i++)
+		if (node->domains[i].id == domid)
+			return &node->domains[i];
+	return NULL;
+}
+
+static struct qmp_conn *find_conn(xenstat_qmp *qmp, unsigned int domid)
+{
+	unsigned int i;
+
+	for (i = 0; i < qmp->num_conns; i++)
+		if (qmp->conns[i].domid == domid)
+			return &qmp->conns[i];
+	return NULL;
+}
+
+static int listen_on(const char *pattern, unsigned int domid)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), pattern, domid);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1 ||
+	    bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+	    listen(fd, 4) == -1) {
+		perror("listen_on");
+		exit(1);
+	}
+	return fd;
+}
+
+static void reply(int fd, const char *msg)
+{
+	size_t len = strlen(msg);
+
+	if (write(fd, msg, len) != (ssize_t)len)
+		exit(3);
+}
+
+/* Serve one client like QEMU would, with rd_operations growing by 10 on each */
+/* query.  Exits 0 once the client hangs up after NUM_SAMPLES queries. */
+static void serve(int lfd)
+{
+	char buf[4096], answer[1024];
+	size_t len = 0;
+	ssize_t num_read;
+	char *line, *eol;
+	int fd, queries = 0;
+
+	fd = accept(lfd, NULL, NULL);
+	if (fd == -1)
+		exit(2);
+	reply(fd, "{\"QMP\": {\"version\": {\"qemu\": {\"micro\": 0, "
+		  "\"minor\": 3, \"major\": 1}, \"package\": \"\"}, "
+		  "\"capabilities\": []}}\r\n");
+
+	while ((num_read = read(fd, buf + len, sizeof(buf) - len - 1)) > 0) {
+		len += num_read;
+		buf[len] = '\0';
+		for (line = buf; (eol = strchr(line, '\n')) != NULL;
+		     line = eol + 1) {
+			*eol = '\0';
+			if (strstr(line, "\"qmp_capabilities\"") != NULL) {
+				reply(fd, "{\"return\": {}}\r\n");
+				continue;
+			}
+			if (strstr(line, "\"query-blockstats\"") == NULL)
+				exit(2);
+			queries++;
+			/* Events may come before any answer */
+			reply(fd, "{\"timestamp\": {\"seconds\": 1, "
+				  "\"microseconds\": 2}, \"event\": \"RESUME\"}\r\n");
+			snprintf(answer, sizeof(answer),
+				 "{\"return\": ["
+				 "{\"device\": \"xvda\", \"stats\": "
+				 "{\"rd_operations\": %d, \"wr_operations\": 20, "
+				 "\"flush_operations\": 3, \"unmap_operations\": 4, "
+				 "\"rd_bytes\": 5120, \"wr_bytes\": 10240}}, "
+				 "{\"device\": \"ide0-hd1\", \"stats\": "
+				 "{\"rd_operations\": 1, \"wr_operations\": 2, "
+				 "\"rd_bytes\": 1024, \"wr_bytes\": 2048}}, "
+				 "{\"device\": \"xvdb\", \"stats\": "
+				 "{\"rd_operations\": 99}}, "
+				 "{\"device\": \"floppy0\", \"stats\": {}}]}\r\n",
+				 10 * queries);
+			reply(fd, answer);
+		}
+		len -= line - buf;
+		memmove(buf, line, len);
+	}
+
+	exit(queries == NUM_SAMPLES ? 0 : 2);
+}
+
+static pid_t start_server(const char *pattern, unsigned int domid)
+{
+	int fd = listen_on(pattern, domid);
+	pid_t pid = fork();
+
+	if (pid == -1) {
+		perror("fork");
+		exit(1);
+	}
+	if (pid == 0)
+		serve(fd);
+	close(fd);
+	return pid;
+}
+
+int main(void)
+{
+	char dir[] = "/tmp/qmp_testXXXXXX";
+	char pattern[64], path[64];
+	xenstat_domain domains[NUM_DOMAINS];
+	xenstat_handle handle;
+	xenstat_node node;
+	xenstat_qmp *qmp = NULL;
+	struct qmp_conn *conn;
+	xenstat_vbd kernel_vbd;
+	pid_t server1, server3;
+	unsigned int i, sample;
+	int status, hung;
+
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+	snprintf(pattern, sizeof(pattern), "%s/qmp-%%u", dir);
+	server1 = start_server(pattern, 1);
+	server3 = start_server(pattern, 3);
+	/* Connections to domain 4 are queued but never accepted */
+	hung = listen_on(pattern, 4);
+
+	memset(&handle, 0, sizeof(handle));
+	handle.qmp_path = pattern;
+	memset(&node, 0, sizeof(node));
+	node.handle = &handle;
+	node.domains = domains;
+	node.num_domains = NUM_DOMAINS;
+	memset(domains, 0, sizeof(domains));
+	for (i = 0; i < NUM_DOMAINS; i++)
+		domains[i].id = i;
+
+	/* xvdb of domain 1 is served by blkback and reported from sysfs */
+	memset(&kernel_vbd, 0, sizeof(kernel_vbd));
+	kernel_vbd.back_type = 1;
+	kernel_vbd.dev = (202 << 8) | (1 << 4);
+
+	for (sample = 1; sample <= NUM_SAMPLES; sample++) {
+		for (i = 0; i < NUM_DOMAINS; i++) {
+			free(domains[i].vbds);
+			domains[i].vbds = NULL;
+			domains[i].num_vbds = 0;
+		}
+		domains[1].vbds = malloc(sizeof(xenstat_vbd));
+		domains[1].vbds[0] = kernel_vbd;
+		domains[1].num_vbds = 1;
+
+		CHECK(xenstat_qmp_collect_vbds(&node, &qmp) == 1);
+
+		CHECK(domains[0].num_vbds == 0);
+		CHECK(domains[2].num_vbds == 0);
+		CHECK(domains[3].num_vbds == 0);
+		CHECK(domains[4].num_vbds == 0);
+		conn = find_conn(qmp, 4);
+		CHECK(conn != NULL && conn->fd == -1 && conn->retry > 0);
+		CHECK(domains[1].num_vbds == 3);
+		if (domains[1].num_vbds != 3)
+			continue;
+		CHECK(domains[1].vbds[0].back_type == 1);
+		CHECK(domains[1].vbds[1].back_type == 3);
+		CHECK(domains[1].vbds[1].dev == 202 << 8);
+		CHECK(domains[1].vbds[1].rd_reqs == 10 * sample);
+		CHECK(domains[1].vbds[1].wr_reqs == 20);
+		CHECK(domains[1].vbds[1].f_reqs == 3);
+		CHECK(domains[1].vbds[1].ds_reqs == 4);
+		CHECK(domains[1].vbds[1].rd_sects == 10);
+		CHECK(domains[1].vbds[1].wr_sects == 20);
+		CHECK(domains[1].vbds[2].back_type == 3);
+		CHECK(domains[1].vbds[2].dev == ((3 << 8) | (1 << 6)));
+		CHECK(domains[1].vbds[2].rd_reqs == 1);
+		CHECK(domains[1].vbds[2].rd_sects == 2);
+	}
+
+	/* Domain 1 goes away, its connection must be closed */
+	node.num_domains = 1;
+	CHECK(xenstat_qmp_collect_vbds(&node, &qmp) == 1);
+	CHECK(waitpid(server1, &status, 0) == server1);
+	CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	/* The server of domain 3 is still waiting for a client */
+	CHECK(waitpid(server3, &status, WNOHANG) == 0);
+	kill(server3, SIGTERM);
+	waitpid(server3, &status, 0);
+
+	xenstat_qmp_uninit(qmp);
+	close(hung);
+	for (i = 0; i < NUM_DOMAINS; i++)
+		free(domains[i].vbds);
+	for (i = 1; i <= 4; i++) {
+		snprintf(path, sizeof(path), pattern, i);
+		unlink(path);
+	}
+	rmdir(dir);
+
+	printf("qmp_test: %s\n", failures ? "FAILED" : "passed");
+	return failures != 0;
+}
@@ -0,0 +1,149 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; under version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+/* Round trip test of the binary output (-t binary) through xenstat-decode.
+ * Built and run with "make test", it includes xenstat.c to write the samples
+ * of made up nodes, and checks the CSV that xenstat-decode makes of them.
+ *
+ * Domain 0 is in every sample.  Domain 3 appears in the second sample,
+ * disappears in the third and comes back under another name in the fourth.
+ * The memory of domain 5 shrinks, so its delta wraps around.  The output is
+ * also decoded twice over, as from concatenated runs, to check that the
+ * second schema starts over. */
+
+#define main xenstat_main
+#include "../xenstat.c"
+#undef main
+
+#include "xenstat_priv.h"
+
+#define NUM_SAMPLES 4
+
+static const char expected[] =
+	"time,id,name,state,cpu_ns,mem,max_mem,vcpus\n"
+	"1.000000,0,Domain-0,32,1000,4096,8192,2\n"
+	"1.000000,5,guest5,4,500,2048,2048,1\n"
+	"2.500000,0,Domain-0,32,2000,4096,8192,2\n"
+	"2.500000,3,\"web,1\",32,10,512,1024,1\n"
+	"2.500000,5,guest5,4,700,1024,2048,1\n"
+	"3.000000,0,Domain-0,32,3000,4096,8192,2\n"
+	"3.000000,5,guest5,32,900,1024,2048,1\n"
+	"4.000001,0,Domain-0,32,4000,4096,8192,2\n"
+	"4.000001,3,web2,4,0,256,1024,1\n"
+	"4.000001,5,guest5,32,1100,1024,2048,1\n";
+
+static void set_domain(xenstat_domain *domain, unsigned int id, char *name,
+		       unsigned int state, unsigned long long cpu_ns,
+		       unsigned long long mem, unsigned long long max_mem,
+		       unsigned int vcpus)
+{
+	memset(domain, 0, sizeof(*domain));
+	domain->id = id;
+	domain->name = name;
+	domain->state = state;
+	domain->cpu_ns = cpu_ns;
+	domain->cur_mem = mem;
+	domain->max_mem = max_mem;
+	domain->num_vcpus = vcpus;
+}
+
+/* Fills in the node of a sample, returning its time */
+static struct timeval make_sample(xenstat_node *node, unsigned int sample)
+{
+	static xenstat_domain domains[3];
+	static char dom0[] = "Domain-0", web1[] = "web,1", web2[] = "web2",
+		guest5[] = "guest5";
+	struct timeval tv = { sample, 0 };
+	unsigned int n = 0;
+
+	set_domain(&domains[n++], 0, dom0, XEN_DOMINF_running,
+		   1000 * sample, 4096, 8192, 2);
+	if (sample == 2)
+		set_domain(&domains[n++], 3, web1, XEN_DOMINF_running,
+			   10, 512, 1024, 1);
+	if (sample == 4)
+		set_domain(&domains[n++], 3, web2, XEN_DOMINF_blocked,
+			   0, 256, 1024, 1);
+	set_domain(&domains[n++], 5, guest5,
+		   sample < 3 ? XEN_DOMINF_blocked : XEN_DOMINF_running,
+		   300 + 200 * sample, sample == 1 ? 2048 : 1024, 2048, 1);
+
+	memset(node, 0, sizeof(*node));
+	node->domains = domains;
+	node->num_domains = n;
+
+	if (sample == 2)
+		tv.tv_usec = 500000;
+	else if (sample == 4)
+		tv.tv_usec = 1;
+	return tv;
+}
+
+static int failures;
+
+/* Runs xenstat-decode on the output of cmd, expecting copies of expected */
+static void check_decode(const char *cmd, unsigned int copies)
+{
+	char decoded[4096], want[4096];
+	size_t len;
+	FILE *fp;
+	int status;
+
+	want[0] = '\0';
+	while (copies-- > 0)
+		strcat(want, expected);
+
+	fp = popen(cmd, "r");
+	if (fp == NULL) {
+		perror("popen");
+		exit(1);
+	}
+	len = fread(decoded, 1, sizeof(decoded) - 1, fp);
+	decoded[len] = '\0';
+	status = pclose(fp);
+
+	if (status != 0 || strcmp(decoded, want) != 0) {
+		fprintf(stderr, "%s:\n%sExpected:\n%s", cmd, decoded, want);
+		failures++;
+	}
+}
+
+int main(void)
+{
+	char path[] = "/tmp/bin_testXXXXXX";
+	char cmd[64];
+	xenstat_node node;
+	unsigned int sample;
+	int fd;
+
+	fd = mkstemp(path);
+	if (fd == -1) {
+		perror("mkstemp");
+		return 1;
+	}
+	out.fd = fd;
+	for (sample = 1; sample <= NUM_SAMPLES; sample++) {
+		curtime = make_sample(&node, sample);
+		cur_node = &node;
+		bin_sample();
+		output_flush(&out);
+	}
+	close(fd);
+
+	snprintf(cmd, sizeof(cmd), "./xenstat-decode %s", path);
+	check_decode(cmd, 1);
+	snprintf(cmd, sizeof(cmd), "cat %s %s | ./xenstat-decode", path, path);
+	check_decode(cmd, 2);
+	unlink(path);
+
+	printf("bin_test: %s\n", failures ? "FAILED" : "passed");
+	return failures != 0;
+}
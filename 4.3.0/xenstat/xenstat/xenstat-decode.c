@@ -0,0 +1,361 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; under version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+/* Converts the binary output of xenstat (-t binary) to CSV or NDJSON */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <yajl/yajl_gen.h>
+
+#include "xenstat_bin.h"
+
+/* Domains of a sample, with their absolute values */
+struct sample {
+	unsigned int *ids;
+	char **names;
+	unsigned long long *values;	/* num_columns per domain */
+	unsigned int num_domains;
+	unsigned int size;
+};
+
+static char **columns;
+static unsigned int num_columns;
+static struct sample samples[2];
+static unsigned int cur;
+static int json;
+static int header_done;
+static yajl_gen yghandle;
+
+static void fail(const char *fmt, ...) __attribute__((noreturn));
+
+static void fail(const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+	exit(1);
+}
+
+/* A frame being read, checked against its length as it goes */
+struct frame {
+	unsigned char *buf;
+	size_t len;
+	size_t pos;
+};
+
+static unsigned long long get_uint(struct frame *f, int bytes)
+{
+	unsigned long long value;
+
+	if (f->len - f->pos < bytes)
+		fail("Truncated frame\n");
+	value = xsb_get(f->buf + f->pos, bytes);
+	f->pos += bytes;
+	return value;
+}
+
+static char *get_string(struct frame *f)
+{
+	size_t len = get_uint(f, 1);
+	char *str;
+
+	if (f->len - f->pos < len)
+		fail("Truncated frame\n");
+	str = malloc(len + 1);
+	if (str == NULL)
+		fail("Failed to allocate memory\n");
+	memcpy(str, f->buf + f->pos, len);
+	str[len] = '\0';
+	f->pos += len;
+	return str;
+}
+
+/* Reads the next frame, returning its type, or 0 at the end of the stream */
+static int read_frame(FILE *fp, struct frame *f)
+{
+	static size_t size;
+	unsigned char len[4];
+	size_t n = fread(len, 1, sizeof(len), fp);
+
+	if (n == 0 && feof(fp))
+		return 0;
+	if (n != sizeof(len))
+		fail("Truncated frame\n");
+	f->len = xsb_get(len, 4);
+	if (f->len == 0 || f->len > XSB_MAX_FRAME)
+		fail("Bad frame length %zu\n", f->len);
+	if (f->len > size) {
+		f->buf = realloc(f->buf, f->len);
+		if (f->buf == NULL)
+			fail("Failed to allocate memory\n");
+		size = f->len;
+	}
+	if (fread(f->buf, 1, f->len, fp) != f->len)
+		fail("Truncated frame\n");
+	f->pos = 1;
+	return f->buf[0];
+}
+
+/* Reads a schema frame.  A stream may hold several, e.g. when the output of
+ * runs is concatenated, and the samples after one are against it alone. */
+static void read_schema(struct frame *f)
+{
+	unsigned int i, j, version;
+
+	for (i = 0; i < num_columns; i++)
+		free(columns[i]);
+	free(columns);
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < samples[i].num_domains; j++)
+			free(samples[i].names[j]);
+		free(samples[i].ids);
+		free(samples[i].names);
+		free(samples[i].values);
+		memset(&samples[i], 0, sizeof(samples[i]));
+	}
+	cur = 0;
+	header_done = 0;
+
+	if (get_uint(f, 4) != XSB_MAGIC)
+		fail("Not xenstat binary output\n");
+	version = get_uint(f, 2);
+	if (version != XSB_VERSION)
+		fail("Unsupported version %u\n", version);
+	num_columns = get_uint(f, 2);
+	columns = calloc(num_columns, sizeof(*columns));
+	if (columns == NULL && num_columns > 0)
+		fail("Failed to allocate memory\n");
+	for (i = 0; i < num_columns; i++)
+		columns[i] = get_string(f);
+}
+
+/* Writes a CSV value, quoted as in RFC 4180 when it needs to be */
+static void csv_string(const char *value)
+{
+	size_t len = strlen(value);
+
+	if (len == 0 || (strcspn(value, ",\"\r\n") == len &&
+			 value[0] != ' ' && value[len-1] != ' ')) {
+		fputs(value, stdout);
+		return;
+	}
+	putchar('"');
+	for (; *value != '\0'; value++) {
+		if (*value == '"')
+			putchar('"');
+		putchar(*value);
+	}
+	putchar('"');
+}
+
+static void print_csv(unsigned long long time, struct sample *s)
+{
+	unsigned int i, j;
+
+	if (!header_done) {
+		fputs("time,id,name", stdout);
+		for (j = 0; j < num_columns; j++) {
+			putchar(',');
+			csv_string(columns[j]);
+		}
+		putchar('\n');
+		header_done = 1;
+	}
+
+	for (i = 0; i < s->num_domains; i++) {
+		printf("%llu.%06llu,%u,", time / 1000000, time % 1000000,
+		       s->ids[i]);
+		csv_string(s->names[i]);
+		for (j = 0; j < num_columns; j++)
+			printf(",%llu", s->values[i * num_columns + j]);
+		putchar('\n');
+	}
+}
+
+static void json_string(const char *value)
+{
+	yajl_gen_string(yghandle, (const unsigned char *)value, strlen(value));
+}
+
+static void json_uint(unsigned long long value)
+{
+	char buf[24];
+
+	yajl_gen_number(yghandle, buf, snprintf(buf, sizeof(buf), "%llu", value));
+}
+
+/* One line per sample, as {"time":...,"domains":[{"id":...,"name":...}]} */
+static void print_json(unsigned long long time, struct sample *s)
+{
+	const unsigned char *buf;
+	unsigned int i, j;
+	size_t len;
+	char str[32];
+
+	yajl_gen_map_open(yghandle);
+	json_string("time");
+	yajl_gen_number(yghandle, str, snprintf(str, sizeof(str), "%llu.%06llu",
+						time / 1000000, time % 1000000));
+	json_string("domains");
+	yajl_gen_array_open(yghandle);
+	for (i = 0; i < s->num_domains; i++) {
+		yajl_gen_map_open(yghandle);
+		json_string("id");
+		json_uint(s->ids[i]);
+		json_string("name");
+		json_string(s->names[i]);
+		for (j = 0; j < num_columns; j++) {
+			json_string(columns[j]);
+			json_uint(s->values[i * num_columns + j]);
+		}
+		yajl_gen_map_close(yghandle);
+	}
+	yajl_gen_array_close(yghandle);
+	yajl_gen_map_close(yghandle);
+
+	yajl_gen_get_buf(yghandle, &buf, &len);
+	fwrite(buf, 1, len, stdout);
+	putchar('\n');
+	yajl_gen_clear(yghandle);
+	yajl_gen_reset(yghandle, NULL);
+}
+
+/* Finds a domain in a sample, looking from index from on as domains are
+ * usually listed by id, and returns num_domains if it isn't there */
+static unsigned int find_domain(struct sample *s, unsigned int id,
+				unsigned int from)
+{
+	unsigned int i;
+
+	for (i = from; i < s->num_domains; i++)
+		if (s->ids[i] == id)
+			return i;
+	for (i = 0; i < from && i < s->num_domains; i++)
+		if (s->ids[i] == id)
+			return i;
+	return s->num_domains;
+}
+
+/* Reads a sample, undoing the deltas against the previous one */
+static void read_sample(struct frame *f)
+{
+	struct sample *s = &samples[cur], *prev = &samples[!cur];
+	unsigned long long time, *values, *old;
+	unsigned int i, j, p, num_domains;
+
+	time = get_uint(f, 8);
+	num_domains = get_uint(f, 4);
+	/* Each domain takes at least its id, flags and values */
+	if (num_domains > (f->len - f->pos) / (5 + 8 * (size_t)num_columns))
+		fail("Truncated frame\n");
+
+	for (i = 0; i < s->num_domains; i++)
+		free(s->names[i]);
+	if (num_domains > s->size) {
+		s->ids = realloc(s->ids, num_domains * sizeof(*s->ids));
+		s->names = realloc(s->names, num_domains * sizeof(*s->names));
+		s->values = realloc(s->values, num_domains * num_columns
+				    * sizeof(*s->values));
+		if (s->ids == NULL || s->names == NULL ||
+		    (s->values == NULL && num_columns > 0))
+			fail("Failed to allocate memory\n");
+		s->size = num_domains;
+	}
+
+	for (i = 0, p = 0; i < num_domains; i++) {
+		s->ids[i] = get_uint(f, 4);
+		values = s->values + i * num_columns;
+		if (get_uint(f, 1) & XSB_DOMAIN_NEW) {
+			s->names[i] = get_string(f);
+			old = NULL;
+		} else {
+			p = find_domain(prev, s->ids[i], p);
+			if (p == prev->num_domains)
+				fail("Delta for domain %u, missing from the "
+				     "previous sample\n", s->ids[i]);
+			s->names[i] = strdup(prev->names[p]);
+			if (s->names[i] == NULL)
+				fail("Failed to allocate memory\n");
+			old = prev->values + p * num_columns;
+		}
+		for (j = 0; j < num_columns; j++)
+			values[j] = get_uint(f, 8) + (old != NULL ? old[j] : 0);
+	}
+	s->num_domains = num_domains;
+	cur = !cur;
+
+	if (json)
+		print_json(time, s);
+	else
+		print_csv(time, s);
+}
+
+static void usage(const char *program)
+{
+	printf("Usage: %s [-t csv|json] [FILE]\n"
+"Converts the binary output of xenstat -t binary, read from FILE or standard\n"
+"input, to CSV or to JSON with one line per sample.\n",
+	       program);
+}
+
+int main(int argc, char **argv)
+{
+	struct frame frame = { NULL, 0, 0 };
+	FILE *fp = stdin;
+	int opt, type;
+
+	while ((opt = getopt(argc, argv, "ht:")) != -1) {
+		switch (opt) {
+			case 't':
+				if (strcmp(optarg, "json") == 0)
+					json = 1;
+				else if (strcmp(optarg, "csv") != 0)
+					fail("Unknown type `%s'\n", optarg);
+				break;
+			case 'h':
+				usage(argv[0]);
+				exit(0);
+			default:
+				usage(argv[0]);
+				exit(1);
+		}
+	}
+	if (optind < argc) {
+		fp = fopen(argv[optind], "rb");
+		if (fp == NULL)
+			fail("Failed to open %s: %s\n", argv[optind],
+			     strerror(errno));
+	}
+	if (json) {
+		yghandle = yajl_gen_alloc(NULL);
+		if (yghandle == NULL)
+			fail("Failed to allocate memory\n");
+	}
+
+	if (read_frame(fp, &frame) != XSB_FRAME_SCHEMA)
+		fail("Not xenstat binary output\n");
+	read_schema(&frame);
+	while ((type = read_frame(fp, &frame)) != 0) {
+		/* Frames of types added later are skipped */
+		if (type == XSB_FRAME_SCHEMA)
+			read_schema(&frame);
+		else if (type == XSB_FRAME_SAMPLE)
+			read_sample(&frame);
+	}
+	return 0;
+}
@@ -21,10 +21,14 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
@@ -40,6 +44,7 @@
 #define TRUE 1
 
 #include <xenstat.h>
+#include "xenstat_bin.h"
 
 #define XENTOP_VERSION "1.0"
 #define IDENTIFIER_MAXOPTS 3
@@ -75,6 +80,9 @@
 #include <yajl/yajl_parse.h>
 #include <yajl/yajl_gen.h>
 
+// Label of a counter column, which is a rate per second in rate mode
+#define RATE_LABEL(label) (show_rate ? label "/s" : label)
+
 // Generate status check for each call
 #define GEN_OR_FAIL(func)											  \
   {																	  \
@@ -83,6 +91,22 @@
 		print("error creating json");					  			  \
   }
 
+/* Values of a domain derived once per sample, so that sorting and printing
+ * the domain table don't recompute them */
+typedef struct domain_row {
+	xenstat_domain *domain;
+	xenstat_domain *old_domain;	/* Same domain in prev_node, or NULL */
+	double cpu_pct;
+	double remote_pct;
+	unsigned long long net_tx;
+	unsigned long long net_rx;
+	unsigned long long vbd_oo;
+	unsigned long long vbd_rd;
+	unsigned long long vbd_wr;
+	unsigned long long vbd_rsect;
+	unsigned long long vbd_wsect;
+} domain_row;
+
 /*
  * Function prototypes
  */
@@ -93,96 +117,112 @@ static void cleanup(void);
 static void fail(const char *);
 static void print(const char *, ...) __attribute__((format(printf,1,2)));
 static void set_interval(char *value);
+static void set_sort_field(char *value);
+static void set_top(char *value);
+static void set_columns(char *value);
+static void add_domain_filter(char *value);
+static int filter_domain(xenstat_domain *domain, void *arg);
 static int compare(unsigned long long, unsigned long long);
-static int compare_domains(xenstat_domain **, xenstat_domain **);
-static unsigned long long tot_net_bytes( xenstat_domain *, int);
-static unsigned long long tot_vbd_reqs( xenstat_domain *, int);
+static int compare_pct(double, double);
+static unsigned long long per_second(unsigned long long, unsigned long long);
+static const char *field_header(unsigned int);
+static int compare_domains(domain_row *, domain_row *);
+static xenstat_domain *find_old_domain(xenstat_domain *, unsigned int *);
+static domain_row *get_rows(unsigned int *);
+static void select_rows(domain_row *, unsigned int, unsigned int);
 
 /* Field functions */
-static int compare_state(xenstat_domain *domain1, xenstat_domain *domain2);
-static void print_state(xenstat_domain *domain);
-static void get_state(xenstat_domain *domain, char *buf, int *len);
-
-static int compare_cpu(xenstat_domain *domain1, xenstat_domain *domain2);
-static void print_cpu(xenstat_domain *domain);
-static void get_cpu(xenstat_domain *domain, char *buf, int *len);
-
-static int compare_cpu_pct(xenstat_domain *domain1, xenstat_domain *domain2);
-static void print_cpu_pct(xenstat_domain *domain);
-static void get_cpu_pct(xenstat_domain *domain, char *buf, int *len);
-
-static int compare_mem(xenstat_domain *domain1, xenstat_domain *domain2);
-static void print_mem(xenstat_domain *domain);
-static void get_mem(xenstat_domain *domain, char *buf, int *len);
-static void print_mem_pct(xenstat_domain *domain);
-static void get_mem_pct(xenstat_domain *domain, char *buf, int *len);
-
-static int compare_maxmem(xenstat_domain *domain1, xenstat_domain *domain2);
-static void print_maxmem(xenstat_domain *domain);
-static void get_maxmem(xenstat_domain *domain, char *buf, int *len);
-static void print_max_pct(xenstat_domain *domain);
-static void get_max_pct(xenstat_domain *domain, char *buf, int *len);
-
-static int compare_vcpus(xenstat_domain *domain1, xenstat_domain *domain2);
-static void print_vcpus(xenstat_domain *domain);
-static void get_vcpus(xenstat_domain *domain, char *buf, int *len);
-
-static int compare_nets(xenstat_domain *domain1, xenstat_domain *domain2);
-static void print_nets(xenstat_domain *domain);
-static void get_nets(xenstat_domain *domain, char *buf, int *len);
-
-static int compare_net_tx(xenstat_domain *domain1, xenstat_domain *domain2);
-static void print_net_tx(xenstat_domain *domain);
-static void get_net_tx(xenstat_domain *domain, char *buf, int *len);
-
-static int compare_net_rx(xenstat_domain *domain1, xenstat_domain *domain2);
-static void print_net_rx(xenstat_domain *domain);
-static void get_net_rx(xenstat_domain *domain, char *buf, int *len);
-
-static int compare_ssid(xenstat_domain *domain1, xenstat_domain *domain2);
-static void print_ssid(xenstat_domain *domain);
-static void get_ssid(xenstat_domain *domain, char *buf, int *len);
-
-static int compare_name(xenstat_domain *domain1, xenstat_domain *domain2);
-static void print_ident(xenstat_domain *domain);
-static void print_name(xenstat_domain *domain);
-static void print_fullname(xenstat_domain *domain);
-static void print_domainid(xenstat_domain *domain);
-static void get_ident(xenstat_domain *domain, char *buf, int *len);
-
-static int compare_vbds(xenstat_domain *domain1, xenstat_domain *domain2);
-static void print_vbds(xenstat_domain *domain);
-static void get_vbds(xenstat_domain *domain, char *buf, int *len);
-
-static int compare_vbd_oo(xenstat_domain *domain1, xenstat_domain *domain2);
-static void print_vbd_oo(xenstat_domain *domain);
-static void get_vbd_oo(xenstat_domain *domain, char *buf, int *len);
-
-static int compare_vbd_rd(xenstat_domain *domain1, xenstat_domain *domain2);
-static void print_vbd_rd(xenstat_domain *domain);
-static void get_vbd_rd(xenstat_domain *domain, char *buf, int *len);
-
-static int compare_vbd_wr(xenstat_domain *domain1, xenstat_domain *domain2);
-static void print_vbd_wr(xenstat_domain *domain);
-static void get_vbd_wr(xenstat_domain *domain, char *buf, int *len);
-
-static int compare_vbd_rsect(xenstat_domain *domain1, xenstat_domain *domain2);
-static void print_vbd_rsect(xenstat_domain *domain);
-static void get_vbd_rsect(xenstat_domain *domain, char *buf, int *len);
-
-static int compare_vbd_wsect(xenstat_domain *domain1, xenstat_domain *domain2);
-static void print_vbd_wsect(xenstat_domain *domain);
-static void get_vbd_wsect(xenstat_domain *domain, char *buf, int *len);
+static int compare_state(domain_row *row1, domain_row *row2);
+static void print_state(domain_row *row);
+static void get_state(domain_row *row, char *buf, int *len);
+
+static int compare_cpu(domain_row *row1, domain_row *row2);
+static void print_cpu(domain_row *row);
+static void get_cpu(domain_row *row, char *buf, int *len);
+
+static int compare_cpu_pct(domain_row *row1, domain_row *row2);
+static void print_cpu_pct(domain_row *row);
+static void get_cpu_pct(domain_row *row, char *buf, int *len);
+
+static int compare_mem(domain_row *row1, domain_row *row2);
+static void print_mem(domain_row *row);
+static void get_mem(domain_row *row, char *buf, int *len);
+static void print_mem_pct(domain_row *row);
+static void get_mem_pct(domain_row *row, char *buf, int *len);
+
+static int compare_maxmem(domain_row *row1, domain_row *row2);
+static void print_maxmem(domain_row *row);
+static void get_maxmem(domain_row *row, char *buf, int *len);
+static void print_max_pct(domain_row *row);
+static void get_max_pct(domain_row *row, char *buf, int *len);
+
+static int compare_remote_pct(domain_row *row1, domain_row *row2);
+static void print_remote_pct(domain_row *row);
+static void get_remote_pct(domain_row *row, char *buf, int *len);
+
+static int compare_vcpus(domain_row *row1, domain_row *row2);
+static void print_vcpus(domain_row *row);
+static void get_vcpus(domain_row *row, char *buf, int *len);
+
+static int compare_nets(domain_row *row1, domain_row *row2);
+static void print_nets(domain_row *row);
+static void get_nets(domain_row *row, char *buf, int *len);
+
+static int compare_net_tx(domain_row *row1, domain_row *row2);
+static void print_net_tx(domain_row *row);
+static void get_net_tx(domain_row *row, char *buf, int *len);
+
+static int compare_net_rx(domain_row *row1, domain_row *row2);
+static void print_net_rx(domain_row *row);
+static void get_net_rx(domain_row *row, char *buf, int *len);
+
+static int compare_ssid(domain_row *row1, domain_row *row2);
+static void print_ssid(domain_row *row);
+static void get_ssid(domain_row *row, char *buf, int *len);
+
+static int compare_name(domain_row *row1, domain_row *row2);
+static void print_ident(domain_row *row);
+static void print_name(domain_row *row);
+static void print_fullname(domain_row *row);
+static void print_domainid(domain_row *row);
+static void get_ident(domain_row *row, char *buf, int *len);
+
+static int compare_vbds(domain_row *row1, domain_row *row2);
+static void print_vbds(domain_row *row);
+static void get_vbds(domain_row *row, char *buf, int *len);
+
+static int compare_vbd_oo(domain_row *row1, domain_row *row2);
+static void print_vbd_oo(domain_row *row);
+static void get_vbd_oo(domain_row *row, char *buf, int *len);
+
+static int compare_vbd_rd(domain_row *row1, domain_row *row2);
+static void print_vbd_rd(domain_row *row);
+static void get_vbd_rd(domain_row *row, char *buf, int *len);
+
+static int compare_vbd_wr(domain_row *row1, domain_row *row2);
+static void print_vbd_wr(domain_row *row);
+static void get_vbd_wr(domain_row *row, char *buf, int *len);
+
+static int compare_vbd_rsect(domain_row *row1, domain_row *row2);
+static void print_vbd_rsect(domain_row *row);
+static void get_vbd_rsect(domain_row *row, char *buf, int *len);
+
+static int compare_vbd_wsect(domain_row *row1, domain_row *row2);
+static void print_vbd_wsect(domain_row *row);
+static void get_vbd_wsect(domain_row *row, char *buf, int *len);
 
 
 /* Section printing functions */
 static void do_summary(void);
 static void do_header(void);
-static void do_domain(xenstat_domain *);
+static void do_domain(domain_row *);
 static void do_vcpu(xenstat_domain *);
-static void do_network(xenstat_domain *);
-static void do_vbd(xenstat_domain *);
+static void do_network(domain_row *);
+static void do_vbd(domain_row *);
+static void do_numa(xenstat_domain *);
+static void do_others(domain_row *, unsigned int);
 static void top(void);
+static void host_top(void);
 
 /* Field types */
 typedef enum field_id {
@@ -195,6 +235,7 @@ typedef enum field_id {
 	FIELD_MEM_PCT,
 	FIELD_MAXMEM,
 	FIELD_MAX_PCT,
+	FIELD_REMOTE_PCT,
 	FIELD_VCPUS,
 	FIELD_NETS,
 	FIELD_NET_TX,
@@ -211,39 +252,44 @@ typedef enum field_id {
 typedef struct field {
 	field_id num;
 	const char *header;
+	const char *rate_header;	/* Header of counters in rate mode */
 	unsigned int default_width;
-	int (*compare)(xenstat_domain *domain1, xenstat_domain *domain2);
-	void (*print)(xenstat_domain *domain);
-	void (*get)(xenstat_domain *domain, char *buf, int *len);
+	const char *key;		/* Key of the value in JSON and CSV output */
+	unsigned int flags;		/* XENSTAT_* collectors the value needs */
+	int (*compare)(domain_row *row1, domain_row *row2);
+	void (*print)(domain_row *row);
+	void (*get)(domain_row *row, char *buf, int *len);
 } field;
 
 field fields[] = {
-	{ FIELD_NAME,      "NAME",      10, compare_name,      print_ident,		get_ident		},
-	{ FIELD_STATE,     "STATE",      6, compare_state,     print_state,		get_state		},
-	{ FIELD_CPU,       "CPU(sec)",  10, compare_cpu,       print_cpu,		get_cpu			},
-	{ FIELD_CPU_PCT,   "CPU(%)",     6, compare_cpu_pct,   print_cpu_pct,	get_cpu_pct		},
-	{ FIELD_MEM,       "MEM(k)",    10, compare_mem,       print_mem,		get_mem			},
-	{ FIELD_MEM_PCT,   "MEM(%)",     6, compare_mem,       print_mem_pct,	get_mem_pct		},
-	{ FIELD_MAXMEM,    "MAXMEM(k)", 10, compare_maxmem,    print_maxmem,	get_maxmem		},
-	{ FIELD_MAX_PCT,   "MAXMEM(%)",  9, compare_maxmem,    print_max_pct,	get_max_pct		},
-	{ FIELD_VCPUS,     "VCPUS",      5, compare_vcpus,     print_vcpus,		get_vcpus		},
-	{ FIELD_NETS,      "NETS",       4, compare_nets,      print_nets,		get_nets		},
-	{ FIELD_NET_TX,    "NETTX(k)",   8, compare_net_tx,    print_net_tx,	get_net_tx		},
-	{ FIELD_NET_RX,    "NETRX(k)",   8, compare_net_rx,    print_net_rx,	get_net_rx		},
-	{ FIELD_VBDS,      "VBDS",       4, compare_vbds,      print_vbds,		get_vbds		},
-	{ FIELD_VBD_OO,    "VBD_OO",     8, compare_vbd_oo,    print_vbd_oo,	get_vbd_oo		},
-	{ FIELD_VBD_RD,    "VBD_RD",     8, compare_vbd_rd,    print_vbd_rd,	get_vbd_rd		},
-	{ FIELD_VBD_WR,    "VBD_WR",     8, compare_vbd_wr,    print_vbd_wr,	get_vbd_wr		},
-	{ FIELD_VBD_RSECT, "VBD_RSECT", 10, compare_vbd_rsect, print_vbd_rsect,	get_vbd_rsect	},
-	{ FIELD_VBD_WSECT, "VBD_WSECT", 10, compare_vbd_wsect, print_vbd_wsect,	get_vbd_wsect	},
-	{ FIELD_SSID,      "SSID",       4, compare_ssid,      print_ssid,		get_ssid		}
+	{ FIELD_NAME,      "NAME",      NULL,        10, NULL,        0,               compare_name,      print_ident,		get_ident		},
+	{ FIELD_STATE,     "STATE",     NULL,         6, "state",     0,               compare_state,     print_state,		get_state		},
+	{ FIELD_CPU,       "CPU(sec)",  NULL,        10, "cpu_s",     0,               compare_cpu,       print_cpu,		get_cpu			},
+	{ FIELD_CPU_PCT,   "CPU(%)",    NULL,         6, "cpu_pct",   0,               compare_cpu_pct,   print_cpu_pct,	get_cpu_pct		},
+	{ FIELD_MEM,       "MEM(k)",    NULL,        10, "mem_k",     0,               compare_mem,       print_mem,		get_mem			},
+	{ FIELD_MEM_PCT,   "MEM(%)",    NULL,         6, "mem_pct",   0,               compare_mem,       print_mem_pct,	get_mem_pct		},
+	{ FIELD_MAXMEM,    "MAXMEM(k)", NULL,        10, "maxmem_k",  0,               compare_maxmem,    print_maxmem,	get_maxmem		},
+	{ FIELD_MAX_PCT,   "MAXMEM(%)", NULL,         9, "maxmem_pct",0,               compare_maxmem,    print_max_pct,	get_max_pct		},
+	{ FIELD_REMOTE_PCT,"RMEMEST(%)",NULL,        10, "rmem_est_pct", XENSTAT_NUMA|XENSTAT_VCPU, compare_remote_pct, print_remote_pct,	get_remote_pct	},
+	{ FIELD_VCPUS,     "VCPUS",     NULL,         5, "vcpus",     0,               compare_vcpus,     print_vcpus,		get_vcpus		},
+	{ FIELD_NETS,      "NETS",      NULL,         4, "nets",      XENSTAT_NETWORK, compare_nets,      print_nets,		get_nets		},
+	{ FIELD_NET_TX,    "NETTX(k)",  "NETTX/s",    8, "nettx_k",   XENSTAT_NETWORK, compare_net_tx,    print_net_tx,	get_net_tx		},
+	{ FIELD_NET_RX,    "NETRX(k)",  "NETRX/s",    8, "netrx_k",   XENSTAT_NETWORK, compare_net_rx,    print_net_rx,	get_net_rx		},
+	{ FIELD_VBDS,      "VBDS",      NULL,         4, "vbds",      XENSTAT_VBD,     compare_vbds,      print_vbds,		get_vbds		},
+	{ FIELD_VBD_OO,    "VBD_OO",    "VBD_OO/s",   8, "vbd_oo",    XENSTAT_VBD,     compare_vbd_oo,    print_vbd_oo,	get_vbd_oo		},
+	{ FIELD_VBD_RD,    "VBD_RD",    "VBD_RD/s",   8, "vbd_rd",    XENSTAT_VBD,     compare_vbd_rd,    print_vbd_rd,	get_vbd_rd		},
+	{ FIELD_VBD_WR,    "VBD_WR",    "VBD_WR/s",   8, "vbd_wr",    XENSTAT_VBD,     compare_vbd_wr,    print_vbd_wr,	get_vbd_wr		},
+	{ FIELD_VBD_RSECT, "VBD_RSECT", "VBDRSECT/s",10, "vbd_rsect", XENSTAT_VBD,     compare_vbd_rsect, print_vbd_rsect,	get_vbd_rsect	},
+	{ FIELD_VBD_WSECT, "VBD_WSECT", "VBDWSECT/s",10, "vbd_wsect", XENSTAT_VBD,     compare_vbd_wsect, print_vbd_wsect,	get_vbd_wsect	},
+	{ FIELD_SSID,      "SSID",      NULL,         4, "ssid",      0,               compare_ssid,      print_ssid,		get_ssid		}
 };
 
-// Although seeing that the longest header is 10, i will still keep ^2
-#define MAX_HEADER_LEN 16
-
 const unsigned int NUM_FIELDS = sizeof(fields)/sizeof(field);
 
+/* Fields output, as indexes into fields[], in the order given by -o */
+unsigned int columns[sizeof(fields)/sizeof(field)];
+unsigned int num_columns = 0;
+
 /*
  * Identifier
  */
@@ -271,6 +317,8 @@ enum {
 	TYPE_ORG_OPT,
 	TYPE_CSV_OPT,
 	TYPE_JSON_OPT,
+	TYPE_NDJSON_OPT,
+	TYPE_BINARY_OPT,
 	TYPE_END,
 };
 
@@ -279,27 +327,59 @@ const char *type_opts[] = {
 	[TYPE_ORG_OPT]		= "org",
 	[TYPE_CSV_OPT]		= "csv",
 	[TYPE_JSON_OPT]		= "json",
+	[TYPE_NDJSON_OPT]	= "ndjson",
+	[TYPE_BINARY_OPT]	= "binary",
 	[TYPE_END]			= NULL
 };
 
+/*
+ * Source of network statistics, indexed by XENSTAT_NETSRC_*
+ */
+const char *net_source_opts[] = {
+	[XENSTAT_NETSRC_AUTO]		= "auto",
+	[XENSTAT_NETSRC_PROCFS]		= "procfs",
+	[XENSTAT_NETSRC_NETLINK]	= "netlink",
+	NULL
+};
+
 /* Globals */
-struct timeval curtime, oldtime;
+struct timeval curtime;			/* Wall clock time, for the output */
+struct timespec curmono, oldmono;	/* Monotonic times, for the rates */
 xenstat_handle *xhandle = NULL;
 xenstat_node *prev_node = NULL;
 xenstat_node *cur_node = NULL;
+domain_row *rows = NULL;
+unsigned int max_rows = 0;
 field_id sort_field = FIELD_DOMID;
 unsigned int first_domain_index = 0;
-unsigned int interval = 1;
+unsigned int top_n = 0;			/* Rows shown, 0 for all */
+unsigned int interval_ms = 1000;	/* Between the starts of intervals */
+int align = 0;				/* Start intervals on wall clock multiples */
+unsigned long overruns = 0;		/* Intervals missed by a late tick */
 unsigned int loop = 1;
 unsigned int iterationCount = 0;
 int show_vcpus = 0;
 int show_networks = 0;
 int show_vbds = 0;
 int show_tmem = 0;
+int show_numa = 0;
+int show_rate = 0;
+int show_host = 0;
 int repeat_header = 0;
 int show_full_name = 0;
 int identifier = 1;
 int ftype = 1;
+int net_source = XENSTAT_NETSRC_AUTO;
+unsigned int collect_flags = XENSTAT_ALL;	/* Collectors run each interval */
+
+/* Domains to collect, see filter_domain() */
+struct domain_filter {
+	char **names;			/* Globs matched against the name */
+	unsigned int num_names;
+	unsigned int *ids;
+	unsigned int num_ids;
+	const char *states;		/* STATE letters to keep, NULL for all */
+} domain_filter;
 #define PROMPT_VAL_LEN 80
 char *prompt = NULL;
 char prompt_val[PROMPT_VAL_LEN];
@@ -309,6 +389,40 @@ void (*prompt_complete_func)(char *);
 // YAJL JSON
 yajl_gen yghandle;
 
+/* Output of an interval, built in memory and handed to the fd with a single
+ * write() */
+struct output {
+	int fd;
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+struct output out = { .fd = STDOUT_FILENO };
+
+/* A CSV output: the header is written before the first row only */
+struct csv_stream {
+	struct output *out;
+	int header_done;
+	unsigned int col;		/* Values written to the current row */
+};
+
+struct csv_stream csv_domains = { .out = &out };
+struct csv_stream csv_vifs;		/* Per-vif rows, if a file was given */
+struct csv_stream csv_vbds;		/* Per-vbd rows, if a file was given */
+
+/* Values of the domains in a binary sample, kept for the deltas of the next */
+struct bin_sample {
+	unsigned int *ids;
+	unsigned long long *values;	/* bin_num_columns per domain */
+	unsigned int num_domains;
+	unsigned int size;
+};
+
+struct bin_sample bin_samples[2];
+unsigned int bin_cur = 0;		/* Sample being written */
+unsigned int bin_num_columns = 0;
+
 
 /*
  * Function definitions
@@ -323,11 +437,29 @@ static void usage(const char *program)
 "Displays ongoing information about xen vm resources \n\n"
 "-h, --help                 display this help and exit\n"
 "-V, --version              output version information and exit\n"
-"-i, --interval=SECONDS     seconds between updates (default 1)\n"
+"-i, --interval=SECONDS     seconds between updates, e.g. 0.25 or 250ms\n"
+"                           (default 1)\n"
+"-a, --align                start intervals on multiples of the interval in\n"
+"                           wall clock time\n"
 "-r, --repeat-header        repeat table header before each domain\n"
 "-c, --iteration-count      count of iterations before exiting\n"
 "-f, --identifier           output the full domain name (not truncated) or domain id\n"
-"-t, --type                 type of output, options are csv/json\n"
+"-t, --type                 type of output, options are csv/json/ndjson/binary\n"
+"-N, --net-source           read network statistics from auto/procfs/netlink\n"
+"-s, --sort=FIELD           sort domains by the column with header FIELD\n"
+"-T, --top=N                only output the first N domains, and a line\n"
+"                           totalling the others\n"
+"-R, --rate                 output counters as rates per second over the last\n"
+"                           interval\n"
+"-H, --host                 output one line of host totals per interval\n"
+"-o, --output=FIELD,...     output only the given fields, by header or JSON\n"
+"                           key, and the sections vcpu/net/vbd/tmem/numa\n"
+"-d, --domain=ID|GLOB,...   only collect the domains with the given ids or\n"
+"                           names matching the given globs\n"
+"-S, --state=LETTERS        only collect the domains in the given states, as\n"
+"                           shown in the STATE column (e.g. rb)\n"
+"    --vif-csv=FILE         with csv output, also write one row per vif to FILE\n"
+"    --vbd-csv=FILE         with csv output, also write one row per vbd to FILE\n"
 	       "\n" XENSTAT_BUGSTO,
 	       program);
 	return;
@@ -341,6 +473,75 @@ static void version(void)
 	       "\n" XENTOP_DISCLAIMER);
 }
 
+/* Makes room for n more bytes of output, returning where they go */
+static char *output_reserve(struct output *o, size_t n)
+{
+	size_t size = o->size ? o->size : 4096;
+	char *buf;
+
+	if (o->len + n <= o->size)
+		return o->buf + o->len;
+	while (size < o->len + n)
+		size *= 2;
+	buf = realloc(o->buf, size);
+	if (buf == NULL)
+		fail("Failed to allocate memory\n");
+	o->buf = buf;
+	o->size = size;
+	return o->buf + o->len;
+}
+
+static void output_write(struct output *o, const char *str, size_t n)
+{
+	memcpy(output_reserve(o, n), str, n);
+	o->len += n;
+}
+
+static void output_char(struct output *o, char c)
+{
+	*output_reserve(o, 1) = c;
+	o->len++;
+}
+
+/* Hands the output built so far to the fd, in one write() unless the fd
+ * takes less.  Reports a failed write and drops what is left, returning 0. */
+static int output_drain(struct output *o)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < o->len) {
+		n = write(o->fd, o->buf + done, o->len - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			o->len = 0;
+			fprintf(stderr, "Failed to write output: %s\n",
+				n < 0 ? strerror(errno) : "no progress");
+			return 0;
+		}
+		done += n;
+	}
+	o->len = 0;
+	return 1;
+}
+
+/* An interval that can't be written is fatal rather than silently dropped */
+static void output_flush(struct output *o)
+{
+	if (!output_drain(o))
+		exit(1);
+}
+
+/* Also runs from cleanup() at exit, so a failed write is only reported */
+static void output_close(struct output *o)
+{
+	output_drain(o);
+	close(o->fd);
+	free(o->buf);
+	free(o);
+}
+
 /* Clean up any open resources */
 static void cleanup(void)
 {
@@ -350,12 +551,29 @@ static void cleanup(void)
 	if(cur_node != NULL)
 		xenstat_free_node(cur_node);
 	
+	free(rows);
+	
 	if(xhandle != NULL)
 		xenstat_uninit(xhandle);
 	
 	if (yghandle != NULL)
 		// Free the json object
 		yajl_gen_free(yghandle);
+
+	free(out.buf);
+	free(bin_samples[0].ids);
+	free(bin_samples[0].values);
+	free(bin_samples[1].ids);
+	free(bin_samples[1].values);
+	if (csv_vifs.out != NULL)
+		output_close(csv_vifs.out);
+	if (csv_vbds.out != NULL)
+		output_close(csv_vbds.out);
+
+	while (domain_filter.num_names > 0)
+		free(domain_filter.names[--domain_filter.num_names]);
+	free(domain_filter.names);
+	free(domain_filter.ids);
 }
 
 /* Display the given message and gracefully exit */
@@ -365,27 +583,207 @@ static void fail(const char *str)
 	exit(1);
 }
 
-/* printf-style print function which calls printw, but only if the cursor is
- * not on the last line. */
+/* Formats an integer, returning its length; buf holds at least 20 digits */
+static int fmt_uint(char *buf, unsigned long long value)
+{
+	char digits[20];
+	int i = 0, len;
+
+	do {
+		digits[i++] = '0' + value % 10;
+		value /= 10;
+	} while (value != 0);
+	for (len = 0; i > 0; len++)
+		buf[len] = digits[--i];
+	return len;
+}
+
+/* Formats value with prec decimals, rounded, without going through printf
+ * for the usual magnitudes */
+static int fmt_fixed(char *buf, size_t size, double value, int prec)
+{
+	static const unsigned long long scales[] = {
+		1, 10, 100, 1000, 10000, 100000, 1000000
+	};
+	unsigned long long scale, x, frac;
+	int len = 0, i;
+
+	if (!(value > -1e12 && value < 1e12) || prec < 0 || prec > 6 || size < 32)
+		return snprintf(buf, size, "%.*f", prec, value);
+
+	scale = scales[prec];
+	x = (unsigned long long)((value < 0 ? -value : value) * scale + 0.5);
+	if (value < 0 && x != 0)
+		buf[len++] = '-';
+	len += fmt_uint(buf + len, x / scale);
+	if (prec > 0) {
+		buf[len++] = '.';
+		frac = x % scale;
+		for (i = prec - 1; i >= 0; i--) {
+			buf[len + i] = '0' + frac % 10;
+			frac /= 10;
+		}
+		len += prec;
+	}
+	return len;
+}
+
+/* printf-style print function, appending to the output of the interval */
 static void print(const char *fmt, ...)
 {
 	va_list args;
+	size_t avail = out.size - out.len;
+	int n;
 
 	va_start(args, fmt);
-	vprintf(fmt, args);
+	n = vsnprintf(out.buf ? out.buf + out.len : NULL, avail, fmt, args);
 	va_end(args);
+	if (n < 0)
+		return;
+	if ((size_t)n >= avail) {
+		va_start(args, fmt);
+		vsnprintf(output_reserve(&out, n + 1), n + 1, fmt, args);
+		va_end(args);
+	}
+	out.len += n;
+}
+
+/* Prints a table field right aligned in width columns, as print("%*s") */
+static void print_field(int width, const char *buf, int len)
+{
+	char *dst;
+	int pad = width > len ? width - len : 0;
+
+	dst = output_reserve(&out, pad + len);
+	memset(dst, ' ', pad);
+	memcpy(dst + pad, buf, len);
+	out.len += pad + len;
+}
+
+/* print("%*llu") of the table's numeric fields, without vsnprintf */
+static void print_uint(int width, unsigned long long value)
+{
+	char buf[20];
+
+	print_field(width, buf, fmt_uint(buf, value));
+}
+
+/* print("%*.*f") of the table's numeric fields, without vsnprintf */
+static void print_fixed(int width, int prec, double value)
+{
+	char buf[64];
+	int len = fmt_fixed(buf, sizeof(buf), value, prec);
 
+	if (len >= (int)sizeof(buf))
+		len = sizeof(buf) - 1;
+	print_field(width, buf, len);
 }
 
-/* Handle setting the interval from the user-supplied value in prompt_val */
+/* Sets the interval from seconds, down to the millisecond, or from
+ * milliseconds given with an ms suffix */
 static void set_interval(char *value)
 {
-	int new_interval;
-	new_interval = atoi(value);
-	if(new_interval > 0)
-		interval = new_interval;
-	else
+	char *end;
+	double ms = strtod(value, &end);
+
+	if (strcmp(end, "ms") != 0) {
+		if (*end != '\0' && strcmp(end, "s") != 0)
+			end = value;
+		ms *= 1000;
+	}
+	if (end == value || !(ms >= 1 && ms <= UINT_MAX)) {
+		fprintf(stderr, "Invalid interval `%s'\n", value);
+		exit(1);
+	}
+	interval_ms = ms + 0.5;
+}
+
+/* Handle setting the sort field from the user-supplied column header */
+/* Finds a field by its header, rate header or JSON key, returning its index
+ * in fields[] or -1 */
+static int find_field(const char *value)
+{
+	unsigned int i;
+
+	for (i = 0; i < NUM_FIELDS; i++) {
+		if (strcasecmp(value, fields[i].header) == 0 ||
+		    (fields[i].rate_header != NULL &&
+		     strcasecmp(value, fields[i].rate_header) == 0) ||
+		    (fields[i].key != NULL && strcasecmp(value, fields[i].key) == 0))
+			return i;
+	}
+	return -1;
+}
+
+static void set_sort_field(char *value)
+{
+	int i = find_field(value);
+
+	if (i < 0) {
+		fprintf(stderr, "Unknown sort field `%s'\n", value);
+		exit(1);
+	}
+	sort_field = i;
+}
+
+/* Sets the number of domains shown from the user-supplied count */
+static void set_top(char *value)
+{
+	unsigned long n;
+	char *end;
+
+	errno = 0;
+	n = strtoul(value, &end, 10);
+	if (value[0] < '0' || value[0] > '9' || *end != '\0' || errno != 0 ||
+	    n > UINT_MAX) {
+		fprintf(stderr, "Invalid number of domains `%s'\n", value);
 		exit(1);
+	}
+	top_n = n;
+}
+
+/* Sets the fields and sections to output from a comma separated list */
+static void set_columns(char *value)
+{
+	char *name;
+	int i;
+
+	for (name = strtok(value, ","); name != NULL; name = strtok(NULL, ",")) {
+		if (strcasecmp(name, "vcpu") == 0)
+			show_vcpus = 1;
+		else if (strcasecmp(name, "net") == 0)
+			show_networks = 1;
+		else if (strcasecmp(name, "vbd") == 0)
+			show_vbds = 1;
+		else if (strcasecmp(name, "tmem") == 0)
+			show_tmem = 1;
+		else if (strcasecmp(name, "numa") == 0)
+			show_numa = 1;
+		else if ((i = find_field(name)) >= 0 && num_columns < NUM_FIELDS)
+			columns[num_columns++] = i;
+		else {
+			fprintf(stderr, "Unknown output field `%s'\n", name);
+			exit(1);
+		}
+	}
+}
+
+/* Computes the collectors that the selected fields and sections need */
+static unsigned int needed_flags(void)
+{
+	unsigned int i, flags = fields[sort_field].flags;
+
+	for (i = 0; i < num_columns; i++)
+		flags |= fields[columns[i]].flags;
+	if (show_vcpus)
+		flags |= XENSTAT_VCPU;
+	if (show_networks || csv_vifs.out != NULL)
+		flags |= XENSTAT_NETWORK | XENSTAT_DEVNAMES;
+	if (show_vbds || csv_vbds.out != NULL)
+		flags |= XENSTAT_VBD | XENSTAT_DEVNAMES;
+	if (show_numa)
+		flags |= XENSTAT_NUMA | XENSTAT_VCPU;
+	return flags;
 }
 
 /* Compares two integers, returning -1,0,1 for <,=,> */
@@ -398,31 +796,70 @@ static int compare(unsigned long long i1, unsigned long long i2)
 	return 0;
 }
 
+/* Compares two percentages, returning -1,0,1 for <,=,> */
+static int compare_pct(double p1, double p2)
+{
+	if(p1 < p2)
+		return -1;
+	if(p1 > p2)
+		return 1;
+	return 0;
+}
+
+/* Seconds elapsed since the previous sample, from the monotonic clock so
+ * that a step of the wall clock doesn't skew the rates */
+static double elapsed_secs(void)
+{
+	return (curmono.tv_sec - oldmono.tv_sec)
+	       + (curmono.tv_nsec - oldmono.tv_nsec) / 1000000000.0;
+}
+
+/* Converts the growth of a counter since the previous sample into a rate per
+ * second */
+static unsigned long long per_second(unsigned long long cur,
+				     unsigned long long old)
+{
+	double secs = elapsed_secs();
+
+	/* Counters restart from zero when a device is plugged again */
+	if (cur < old || secs <= 0)
+		return 0;
+	return (cur - old) / secs + 0.5;
+}
+
+/* Returns the header of a field, which differs in rate mode for counters */
+static const char *field_header(unsigned int i)
+{
+	if (show_rate && fields[i].rate_header != NULL)
+		return fields[i].rate_header;
+	return fields[i].header;
+}
+
 /* Comparison function for use with qsort.  Compares two domains using the
  * current sort field. */
-static int compare_domains(xenstat_domain **domain1, xenstat_domain **domain2)
+static int compare_domains(domain_row *row1, domain_row *row2)
 {
-	return fields[sort_field].compare(*domain1, *domain2);
+	return fields[sort_field].compare(row1, row2);
 }
 
 /* Field functions */
 
 /* Compare domain names, returning -1,0,1 for <,=,> */
-int compare_name(xenstat_domain *domain1, xenstat_domain *domain2)
+int compare_name(domain_row *row1, domain_row *row2)
 {
-	return strcasecmp(xenstat_domain_name(domain1), xenstat_domain_name(domain2));
+	return strcasecmp(xenstat_domain_name(row1->domain), xenstat_domain_name(row2->domain));
 }
 
-void print_ident(xenstat_domain *domain) {
+void print_ident(domain_row *row) {
 	switch(identifier) {
 		case 1:
-			print_name(domain);
+			print_name(row);
 			break;
 		case 2:
-			print_fullname(domain);
+			print_fullname(row);
 			break;
 		case 3:
-			print_domainid(domain);
+			print_domainid(row);
 			break;
 		default:
 			print("identifier resulted with invalid number: %d\n", identifier);
@@ -432,33 +869,33 @@ void print_ident(xenstat_domain *domain) {
 }
 
 /* Prints domain name */
-void print_name(xenstat_domain *domain)
+void print_name(domain_row *row)
 {
-	print("%-13.10s", xenstat_domain_name(domain));
+	print("%-13.10s", xenstat_domain_name(row->domain));
 }
 
-void print_fullname(xenstat_domain *domain) {
-	print("%-13s", xenstat_domain_name(domain));
+void print_fullname(domain_row *row) {
+	print("%-13s", xenstat_domain_name(row->domain));
 }
 
-void print_domainid(xenstat_domain *domain) {
-	print("%-13d", xenstat_domain_id(domain));
+void print_domainid(domain_row *row) {
+	print("%-13d", xenstat_domain_id(row->domain));
 }
 
-void get_ident(xenstat_domain *domain, char *buf, int *len) {
+void get_ident(domain_row *row, char *buf, int *len) {
 	char *name;
 	int id;
 	
 	switch(identifier) {
 		case 1:
 		case 2:
-			name = xenstat_domain_name(domain);
+			name = xenstat_domain_name(row->domain);
 			*len = strlen(name);
 			strcpy(buf, name);
 			
 			break;
 		case 3:
-			id = xenstat_domain_id(domain);
+			id = xenstat_domain_id(row->domain);
 			*len = snprintf(buf, *len, "%d", id);
 			
 			break;
@@ -482,13 +919,73 @@ struct {
 };
 const unsigned int NUM_STATES = sizeof(state_funcs)/sizeof(*state_funcs);
 
+/* Adds a comma separated list of domain ids and name globs to the filter */
+static void add_domain_filter(char *value)
+{
+	struct domain_filter *filter = &domain_filter;
+	char *entry, **names;
+	unsigned int *ids;
+
+	for (entry = strtok(value, ","); entry != NULL; entry = strtok(NULL, ",")) {
+		if (strspn(entry, "0123456789") == strlen(entry)) {
+			ids = realloc(filter->ids,
+				      (filter->num_ids + 1) * sizeof(*ids));
+			if (ids == NULL)
+				fail("Failed to allocate memory\n");
+			filter->ids = ids;
+			filter->ids[filter->num_ids++] = strtoul(entry, NULL, 10);
+		} else {
+			names = realloc(filter->names,
+					(filter->num_names + 1) * sizeof(*names));
+			if (names == NULL)
+				fail("Failed to allocate memory\n");
+			filter->names = names;
+			filter->names[filter->num_names] = strdup(entry);
+			if (filter->names[filter->num_names++] == NULL)
+				fail("Failed to allocate memory\n");
+		}
+	}
+}
+
+/* Called by libxenstat for each domain the hypervisor lists: the domain is
+ * kept if it matches one of the ids or names given, and is in one of the
+ * states given */
+static int filter_domain(xenstat_domain *domain, void *arg)
+{
+	struct domain_filter *filter = arg;
+	unsigned int i;
+
+	if (filter->num_ids > 0 || filter->num_names > 0) {
+		for (i = 0; i < filter->num_ids; i++)
+			if (filter->ids[i] == xenstat_domain_id(domain))
+				break;
+		if (i == filter->num_ids) {
+			for (i = 0; i < filter->num_names; i++)
+				if (fnmatch(filter->names[i],
+					    xenstat_domain_name(domain), 0) == 0)
+					break;
+			if (i == filter->num_names)
+				return 0;
+		}
+	}
+
+	if (filter->states != NULL) {
+		for (i = 0; i < NUM_STATES; i++)
+			if (state_funcs[i].get(domain) &&
+			    strchr(filter->states, state_funcs[i].ch) != NULL)
+				return 1;
+		return 0;
+	}
+	return 1;
+}
+
 /* Compare states of two domains, returning -1,0,1 for <,=,> */
-static int compare_state(xenstat_domain *domain1, xenstat_domain *domain2)
+static int compare_state(domain_row *row1, domain_row *row2)
 {
 	unsigned int i, d1s, d2s;
 	for(i = 0; i < NUM_STATES; i++) {
-		d1s = state_funcs[i].get(domain1);
-		d2s = state_funcs[i].get(domain2);
+		d1s = state_funcs[i].get(row1->domain);
+		d2s = state_funcs[i].get(row2->domain);
 		if(d1s && !d2s)
 			return -1;
 		if(d2s && !d1s)
@@ -498,62 +995,59 @@ static int compare_state(xenstat_domain *domain1, xenstat_domain *domain2)
 }
 
 /* Prints domain state in abbreviated letter format */
-static void print_state(xenstat_domain *domain)
+static void print_state(domain_row *row)
 {
 	unsigned int i;
 	char ch = '-';
 	
 	for(i = 0; i < NUM_STATES; i++)
-		if (state_funcs[i].get(domain)) ch = state_funcs[i].ch;
+		if (state_funcs[i].get(row->domain)) ch = state_funcs[i].ch;
 	
-	print("%c", ch);
+	output_char(&out, ch);
 }
 
-static void get_state(xenstat_domain *domain, char *buf, int *len)
+static void get_state(domain_row *row, char *buf, int *len)
 {
 	unsigned int i;
 	char ch = '-';
 	
 	for(i = 0; i < NUM_STATES; i++)
-		if (state_funcs[i].get(domain)) ch = state_funcs[i].ch;
+		if (state_funcs[i].get(row->domain)) ch = state_funcs[i].ch;
 	
 	*len = snprintf(buf, *len, "%c", ch);
 }
 
 /* Compares cpu usage of two domains, returning -1,0,1 for <,=,> */
-static int compare_cpu(xenstat_domain *domain1, xenstat_domain *domain2)
+static int compare_cpu(domain_row *row1, domain_row *row2)
 {
-	return -compare(xenstat_domain_cpu_ns(domain1),
-			xenstat_domain_cpu_ns(domain2));
+	return -compare(xenstat_domain_cpu_ns(row1->domain),
+			xenstat_domain_cpu_ns(row2->domain));
 }
 
 /* Prints domain cpu usage in seconds */
-static void print_cpu(xenstat_domain *domain)
+static void print_cpu(domain_row *row)
 {
-	print("%10llu", xenstat_domain_cpu_ns(domain)/1000000000);
+	print_uint(10, xenstat_domain_cpu_ns(row->domain)/1000000000);
 }
 
-static void get_cpu(xenstat_domain *domain, char *buf, int *len) {
-	*len = snprintf(buf, *len, "%llu", xenstat_domain_cpu_ns(domain)/1000000000);
+static void get_cpu(domain_row *row, char *buf, int *len) {
+	*len = snprintf(buf, *len, "%llu", xenstat_domain_cpu_ns(row->domain)/1000000000);
 }
 
-/* Computes the CPU percentage used for a specified domain */
-static double calc_cpu_pct(xenstat_domain *domain)
+/* Computes the CPU percentage used for a specified domain, given the same
+ * domain in the previous sample */
+static double calc_cpu_pct(xenstat_domain *domain, xenstat_domain *old_domain)
 {
-	xenstat_domain *old_domain;
 	double us_elapsed;
 
 	/* Can't calculate CPU percentage without a previous sample. */
-	if(prev_node == NULL)
-		return 0.0;
-
-	old_domain = xenstat_node_domain(prev_node, xenstat_domain_id(domain));
 	if(old_domain == NULL)
 		return 0.0;
 
 	/* Calculate the time elapsed in microseconds */
-	us_elapsed = ((curtime.tv_sec-oldtime.tv_sec)*1000000.0
-		      +(curtime.tv_usec - oldtime.tv_usec));
+	us_elapsed = elapsed_secs() * 1000000.0;
+	if (us_elapsed <= 0)
+		return 0.0;
 
 	/* In the following, nanoseconds must be multiplied by 1000.0 to
 	 * convert to microseconds, then divided by 100.0 to get a percentage,
@@ -562,70 +1056,70 @@ static double calc_cpu_pct(xenstat_domain *domain)
 		 -xenstat_domain_cpu_ns(old_domain))/10.0)/us_elapsed;
 }
 
-static int compare_cpu_pct(xenstat_domain *domain1, xenstat_domain *domain2)
+static int compare_cpu_pct(domain_row *row1, domain_row *row2)
 {
-	return -compare(calc_cpu_pct(domain1), calc_cpu_pct(domain2));
+	return -compare_pct(row1->cpu_pct, row2->cpu_pct);
 }
 
 /* Prints cpu percentage statistic */
-static void print_cpu_pct(xenstat_domain *domain)
+static void print_cpu_pct(domain_row *row)
 {
-	print("%6.1f", calc_cpu_pct(domain));
+	print_fixed(6, 1, row->cpu_pct);
 }
 
-static void get_cpu_pct(xenstat_domain *domain, char *buf, int *len) {
-	*len = snprintf(buf, *len, "%.1f", calc_cpu_pct(domain));
+static void get_cpu_pct(domain_row *row, char *buf, int *len) {
+	*len = snprintf(buf, *len, "%.1f", row->cpu_pct);
 }
 
 /* Compares current memory of two domains, returning -1,0,1 for <,=,> */
-static int compare_mem(xenstat_domain *domain1, xenstat_domain *domain2)
+static int compare_mem(domain_row *row1, domain_row *row2)
 {
-	return -compare(xenstat_domain_cur_mem(domain1),
-	                xenstat_domain_cur_mem(domain2));
+	return -compare(xenstat_domain_cur_mem(row1->domain),
+	                xenstat_domain_cur_mem(row2->domain));
 }
 
 /* Prints current memory statistic */
-static void print_mem(xenstat_domain *domain)
+static void print_mem(domain_row *row)
 {
-	print("%10llu", xenstat_domain_cur_mem(domain)/1024);
+	print_uint(10, xenstat_domain_cur_mem(row->domain)/1024);
 }
 
-static void get_mem(xenstat_domain *domain, char *buf, int *len) {
-	*len = snprintf(buf, *len, "%llu", xenstat_domain_cur_mem(domain)/1024);
+static void get_mem(domain_row *row, char *buf, int *len) {
+	*len = snprintf(buf, *len, "%llu", xenstat_domain_cur_mem(row->domain)/1024);
 }
 
 /* Prints memory percentage statistic, ratio of current domain memory to total
  * node memory */
-static void print_mem_pct(xenstat_domain *domain)
+static void print_mem_pct(domain_row *row)
 {
-	print("%6.1f", (double)xenstat_domain_cur_mem(domain) /
-	               (double)xenstat_node_tot_mem(cur_node) * 100);
+	print_fixed(6, 1, (double)xenstat_domain_cur_mem(row->domain) /
+		       (double)xenstat_node_tot_mem(cur_node) * 100);
 }
 
-static void get_mem_pct(xenstat_domain *domain, char *buf, int *len) {
-	*len = snprintf(buf, *len, "%.1f", (double)xenstat_domain_cur_mem(domain) /
+static void get_mem_pct(domain_row *row, char *buf, int *len) {
+	*len = snprintf(buf, *len, "%.1f", (double)xenstat_domain_cur_mem(row->domain) /
 	               (double)xenstat_node_tot_mem(cur_node) * 100);
 }
 
 /* Compares maximum memory of two domains, returning -1,0,1 for <,=,> */
-static int compare_maxmem(xenstat_domain *domain1, xenstat_domain *domain2)
+static int compare_maxmem(domain_row *row1, domain_row *row2)
 {
-	return -compare(xenstat_domain_max_mem(domain1),
-	                xenstat_domain_max_mem(domain2));
+	return -compare(xenstat_domain_max_mem(row1->domain),
+	                xenstat_domain_max_mem(row2->domain));
 }
 
 /* Prints maximum domain memory statistic in KB */
-static void print_maxmem(xenstat_domain *domain)
+static void print_maxmem(domain_row *row)
 {
-	unsigned long long max_mem = xenstat_domain_max_mem(domain);
+	unsigned long long max_mem = xenstat_domain_max_mem(row->domain);
 	if(max_mem == ((unsigned long long)-1))
 		print("%10s", "no limit");
 	else
-		print("%10llu", max_mem/1024);
+		print_uint(10, max_mem/1024);
 }
 
-static void get_maxmem(xenstat_domain *domain, char *buf, int *len) {
-	unsigned long long max_mem = xenstat_domain_max_mem(domain);
+static void get_maxmem(domain_row *row, char *buf, int *len) {
+	unsigned long long max_mem = xenstat_domain_max_mem(row->domain);
 	if(max_mem == ((unsigned long long)-1))
 		*len = snprintf(buf, *len, "%s", "no limit");
 	else
@@ -634,288 +1128,278 @@ static void get_maxmem(xenstat_domain *domain, char *buf, int *len) {
 
 /* Prints memory percentage statistic, ratio of current domain memory to total
  * node memory */
-static void print_max_pct(xenstat_domain *domain)
+static void print_max_pct(domain_row *row)
 {
-	if (xenstat_domain_max_mem(domain) == (unsigned long long)-1)
+	if (xenstat_domain_max_mem(row->domain) == (unsigned long long)-1)
 		print("%9s", "n/a");
 	else
-		print("%9.1f", (double)xenstat_domain_max_mem(domain) /
-		               (double)xenstat_node_tot_mem(cur_node) * 100);
+		print_fixed(9, 1, (double)xenstat_domain_max_mem(row->domain) /
+			       (double)xenstat_node_tot_mem(cur_node) * 100);
 }
 
-static void get_max_pct(xenstat_domain *domain, char *buf, int *len) {
-	if (xenstat_domain_max_mem(domain) == (unsigned long long)-1)
+static void get_max_pct(domain_row *row, char *buf, int *len) {
+	if (xenstat_domain_max_mem(row->domain) == (unsigned long long)-1)
 		*len = snprintf(buf, *len, "%s", "n/a");
 	else
-		*len = snprintf(buf, *len, "%.1f", (double)xenstat_domain_max_mem(domain) /
+		*len = snprintf(buf, *len, "%.1f", (double)xenstat_domain_max_mem(row->domain) /
 		               (double)xenstat_node_tot_mem(cur_node) * 100);
 }
 
+/* Computes the estimated percentage of a domain's memory placed on NUMA
+ * nodes none of its VCPUs are running on */
+static double calc_remote_pct(xenstat_domain *domain)
+{
+	unsigned long long cur_mem = xenstat_domain_cur_mem(domain);
+
+	if (cur_mem == 0)
+		return 0.0;
+	return (double)xenstat_domain_numa_remote_mem_est(domain) /
+	       (double)cur_mem * 100;
+}
+
+/* Compares remote memory percentage of two domains, returning -1,0,1 for
+ * <,=,> */
+static int compare_remote_pct(domain_row *row1, domain_row *row2)
+{
+	return -compare_pct(row1->remote_pct, row2->remote_pct);
+}
+
+/* Prints remote memory percentage statistic */
+static void print_remote_pct(domain_row *row)
+{
+	print_fixed(10, 1, row->remote_pct);
+}
+
+static void get_remote_pct(domain_row *row, char *buf, int *len)
+{
+	*len = snprintf(buf, *len, "%.1f", row->remote_pct);
+}
+
 /* Compares number of virtual CPUs of two domains, returning -1,0,1 for
  * <,=,> */
-static int compare_vcpus(xenstat_domain *domain1, xenstat_domain *domain2)
+static int compare_vcpus(domain_row *row1, domain_row *row2)
 {
-	return -compare(xenstat_domain_num_vcpus(domain1),
-	                xenstat_domain_num_vcpus(domain2));
+	return -compare(xenstat_domain_num_vcpus(row1->domain),
+	                xenstat_domain_num_vcpus(row2->domain));
 }
 
 /* Prints number of virtual CPUs statistic */
-static void print_vcpus(xenstat_domain *domain)
+static void print_vcpus(domain_row *row)
 {
-	print("%5u", xenstat_domain_num_vcpus(domain));
+	print_uint(5, xenstat_domain_num_vcpus(row->domain));
 }
 
-static void get_vcpus(xenstat_domain *domain, char *buf, int *len) {
-	*len = snprintf(buf, *len, "%u", xenstat_domain_num_vcpus(domain));
+static void get_vcpus(domain_row *row, char *buf, int *len) {
+	*len = snprintf(buf, *len, "%u", xenstat_domain_num_vcpus(row->domain));
 }
 
 /* Compares number of virtual networks of two domains, returning -1,0,1 for
  * <,=,> */
-static int compare_nets(xenstat_domain *domain1, xenstat_domain *domain2)
+static int compare_nets(domain_row *row1, domain_row *row2)
 {
-	return -compare(xenstat_domain_num_networks(domain1),
-	                xenstat_domain_num_networks(domain2));
+	return -compare(xenstat_domain_num_networks(row1->domain),
+	                xenstat_domain_num_networks(row2->domain));
 }
 
 /* Prints number of virtual networks statistic */
-static void print_nets(xenstat_domain *domain)
+static void print_nets(domain_row *row)
 {
-	print("%4u", xenstat_domain_num_networks(domain));
+	print_uint(4, xenstat_domain_num_networks(row->domain));
 }
 
-static void get_nets(xenstat_domain *domain, char *buf, int *len) {
-	*len = snprintf(buf, *len, "%u", xenstat_domain_num_networks(domain));
+static void get_nets(domain_row *row, char *buf, int *len) {
+	*len = snprintf(buf, *len, "%u", xenstat_domain_num_networks(row->domain));
 }
 
 /* Compares number of total network tx bytes of two domains, returning -1,0,1
  * for <,=,> */
-static int compare_net_tx(xenstat_domain *domain1, xenstat_domain *domain2)
+static int compare_net_tx(domain_row *row1, domain_row *row2)
 {
-	return -compare(tot_net_bytes(domain1, FALSE),
-	                tot_net_bytes(domain2, FALSE));
+	return -compare(row1->net_tx, row2->net_tx);
 }
 
 /* Prints number of total network tx bytes statistic */
-static void print_net_tx(xenstat_domain *domain)
+static void print_net_tx(domain_row *row)
 {
-	print("%8llu", tot_net_bytes(domain, FALSE)/1024);
+	print_uint(8, row->net_tx/1024);
 }
 
-static void get_net_tx(xenstat_domain *domain, char *buf, int *len) {
-	*len = snprintf(buf, *len, "%llu", tot_net_bytes(domain, FALSE)/1024);
+static void get_net_tx(domain_row *row, char *buf, int *len) {
+	*len = snprintf(buf, *len, "%llu", row->net_tx/1024);
 }
 
 /* Compares number of total network rx bytes of two domains, returning -1,0,1
  * for <,=,> */
-static int compare_net_rx(xenstat_domain *domain1, xenstat_domain *domain2)
+static int compare_net_rx(domain_row *row1, domain_row *row2)
 {
-	return -compare(tot_net_bytes(domain1, TRUE),
-	                tot_net_bytes(domain2, TRUE));
+	return -compare(row1->net_rx, row2->net_rx);
 }
 
 /* Prints number of total network rx bytes statistic */
-static void print_net_rx(xenstat_domain *domain)
+static void print_net_rx(domain_row *row)
 {
-	print("%8llu", tot_net_bytes(domain, TRUE)/1024);
+	print_uint(8, row->net_rx/1024);
 }
 
-static void get_net_rx(xenstat_domain *domain, char *buf, int *len) {
-	*len = snprintf(buf, *len, "%llu", tot_net_bytes(domain, TRUE)/1024);
+static void get_net_rx(domain_row *row, char *buf, int *len) {
+	*len = snprintf(buf, *len, "%llu", row->net_rx/1024);
 }
 
-/* Gets number of total network bytes statistic, if rx true, then rx bytes
- * otherwise tx bytes
- */
-static unsigned long long tot_net_bytes(xenstat_domain *domain, int rx_flag)
+/* Totals the network rx and tx bytes of the row's domain */
+static void sum_net_bytes(domain_row *row)
 {
-	int i = 0;
 	xenstat_network *network;
-	unsigned num_networks = 0;
-	unsigned long long total = 0;
-
-	/* How many networks? */
-	num_networks = xenstat_domain_num_networks(domain);
-
-	/* Dump information for each network */
-	for (i=0; i < num_networks; i++) {
-		/* Next get the network information */
-		network = xenstat_domain_network(domain,i);
-		if (rx_flag)
-			total += xenstat_network_rbytes(network);
-		else
-			total += xenstat_network_tbytes(network);
+	unsigned int i, num_networks;
+
+	row->net_tx = row->net_rx = 0;
+	num_networks = xenstat_domain_num_networks(row->domain);
+	for (i = 0; i < num_networks; i++) {
+		network = xenstat_domain_network(row->domain, i);
+		row->net_rx += xenstat_network_rbytes(network);
+		row->net_tx += xenstat_network_tbytes(network);
 	}
-
-	return total;
 }
 
 /* Compares number of virtual block devices of two domains,
    returning -1,0,1 for * <,=,> */
-static int compare_vbds(xenstat_domain *domain1, xenstat_domain *domain2)
+static int compare_vbds(domain_row *row1, domain_row *row2)
 {
-	return -compare(xenstat_domain_num_vbds(domain1),
-	                xenstat_domain_num_vbds(domain2));
+	return -compare(xenstat_domain_num_vbds(row1->domain),
+	                xenstat_domain_num_vbds(row2->domain));
 }
 
 /* Prints number of virtual block devices statistic */
-static void print_vbds(xenstat_domain *domain)
+static void print_vbds(domain_row *row)
 {
-	print("%4u", xenstat_domain_num_vbds(domain));
+	print_uint(4, xenstat_domain_num_vbds(row->domain));
 }
 
-static void get_vbds(xenstat_domain *domain, char *buf, int *len) {
-	*len = snprintf(buf, *len, "%u", xenstat_domain_num_vbds(domain));
+static void get_vbds(domain_row *row, char *buf, int *len) {
+	*len = snprintf(buf, *len, "%u", xenstat_domain_num_vbds(row->domain));
 }
 
 /* Compares number of total VBD OO requests of two domains,
    returning -1,0,1 * for <,=,> */
-static int compare_vbd_oo(xenstat_domain *domain1, xenstat_domain *domain2)
+static int compare_vbd_oo(domain_row *row1, domain_row *row2)
 {
-  return -compare(tot_vbd_reqs(domain1, FIELD_VBD_OO),
-		  tot_vbd_reqs(domain2, FIELD_VBD_OO));
+  return -compare(row1->vbd_oo, row2->vbd_oo);
 }
 
 /* Prints number of total VBD OO requests statistic */
-static void print_vbd_oo(xenstat_domain *domain)
+static void print_vbd_oo(domain_row *row)
 {
-	print("%8llu", tot_vbd_reqs(domain, FIELD_VBD_OO));
+	print_uint(8, row->vbd_oo);
 }
 
-static void get_vbd_oo(xenstat_domain *domain, char *buf, int *len) {
-	*len = snprintf(buf, *len, "%llu", tot_vbd_reqs(domain, FIELD_VBD_OO));
+static void get_vbd_oo(domain_row *row, char *buf, int *len) {
+	*len = snprintf(buf, *len, "%llu", row->vbd_oo);
 }
 
 /* Compares number of total VBD READ requests of two domains,
    returning -1,0,1 * for <,=,> */
-static int compare_vbd_rd(xenstat_domain *domain1, xenstat_domain *domain2)
+static int compare_vbd_rd(domain_row *row1, domain_row *row2)
 {
-	return -compare(tot_vbd_reqs(domain1, FIELD_VBD_RD),
-			tot_vbd_reqs(domain2, FIELD_VBD_RD));
+	return -compare(row1->vbd_rd, row2->vbd_rd);
 }
 
 /* Prints number of total VBD READ requests statistic */
-static void print_vbd_rd(xenstat_domain *domain)
+static void print_vbd_rd(domain_row *row)
 {
-	print("%8llu", tot_vbd_reqs(domain, FIELD_VBD_RD));
+	print_uint(8, row->vbd_rd);
 }
 
-static void get_vbd_rd(xenstat_domain *domain, char *buf, int *len) {
-	*len = snprintf(buf, *len, "%llu", tot_vbd_reqs(domain, FIELD_VBD_RD));
+static void get_vbd_rd(domain_row *row, char *buf, int *len) {
+	*len = snprintf(buf, *len, "%llu", row->vbd_rd);
 }
 
 /* Compares number of total VBD WRITE requests of two domains,
    returning -1,0,1 * for <,=,> */
-static int compare_vbd_wr(xenstat_domain *domain1, xenstat_domain *domain2)
+static int compare_vbd_wr(domain_row *row1, domain_row *row2)
 {
-	return -compare(tot_vbd_reqs(domain1, FIELD_VBD_WR),
-			tot_vbd_reqs(domain2, FIELD_VBD_WR));
+	return -compare(row1->vbd_wr, row2->vbd_wr);
 }
 
 /* Prints number of total VBD WRITE requests statistic */
-static void print_vbd_wr(xenstat_domain *domain)
+static void print_vbd_wr(domain_row *row)
 {
-	print("%8llu", tot_vbd_reqs(domain, FIELD_VBD_WR));
+	print_uint(8, row->vbd_wr);
 }
 
-static void get_vbd_wr(xenstat_domain *domain, char *buf, int *len) {
-	*len = snprintf(buf, *len, "%llu", tot_vbd_reqs(domain, FIELD_VBD_WR));
+static void get_vbd_wr(domain_row *row, char *buf, int *len) {
+	*len = snprintf(buf, *len, "%llu", row->vbd_wr);
 }
 
 /* Compares number of total VBD READ sectors of two domains,
    returning -1,0,1 * for <,=,> */
-static int compare_vbd_rsect(xenstat_domain *domain1, xenstat_domain *domain2)
+static int compare_vbd_rsect(domain_row *row1, domain_row *row2)
 {
-	return -compare(tot_vbd_reqs(domain1, FIELD_VBD_RSECT),
-			tot_vbd_reqs(domain2, FIELD_VBD_RSECT));
+	return -compare(row1->vbd_rsect, row2->vbd_rsect);
 }
 
 /* Prints number of total VBD READ sectors statistic */
-static void print_vbd_rsect(xenstat_domain *domain)
+static void print_vbd_rsect(domain_row *row)
 {
-	print("%10llu", tot_vbd_reqs(domain, FIELD_VBD_RSECT));
+	print_uint(10, row->vbd_rsect);
 }
 
-static void get_vbd_rsect(xenstat_domain *domain, char *buf, int *len) {
-	*len = snprintf(buf, *len, "%llu", tot_vbd_reqs(domain, FIELD_VBD_RSECT));
+static void get_vbd_rsect(domain_row *row, char *buf, int *len) {
+	*len = snprintf(buf, *len, "%llu", row->vbd_rsect);
 }
 
 /* Compares number of total VBD WRITE sectors of two domains,
    returning -1,0,1 * for <,=,> */
-static int compare_vbd_wsect(xenstat_domain *domain1, xenstat_domain *domain2)
+static int compare_vbd_wsect(domain_row *row1, domain_row *row2)
 {
-	return -compare(tot_vbd_reqs(domain1, FIELD_VBD_WSECT),
-			tot_vbd_reqs(domain2, FIELD_VBD_WSECT));
+	return -compare(row1->vbd_wsect, row2->vbd_wsect);
 }
 
 /* Prints number of total VBD WRITE sectors statistic */
-static void print_vbd_wsect(xenstat_domain *domain)
+static void print_vbd_wsect(domain_row *row)
 {
-	print("%10llu", tot_vbd_reqs(domain, FIELD_VBD_WSECT));
+	print_uint(10, row->vbd_wsect);
 }
 
-static void get_vbd_wsect(xenstat_domain *domain, char *buf, int *len) {
-	*len = snprintf(buf, *len, "%llu", tot_vbd_reqs(domain, FIELD_VBD_WSECT));
+static void get_vbd_wsect(domain_row *row, char *buf, int *len) {
+	*len = snprintf(buf, *len, "%llu", row->vbd_wsect);
 }
 
 
-/* Gets number of total VBD requests statistic, 
- *   if flag is FIELD_VBD_OO, then OO requests,
- *   if flag is FIELD_VBD_RD, then READ requests,
- *   if flag is FIELD_VBD_WR, then WRITE requests,
- *   if flag is FIELD_VBD_RSECT, then READ sectors,
- *   if flag is FIELD_VBD_WSECT, then WRITE sectors.
- */
-static unsigned long long tot_vbd_reqs(xenstat_domain *domain, int flag)
+/* Totals the VBD OO, READ and WRITE requests and READ and WRITE sectors of
+ * the row's domain */
+static void sum_vbd_reqs(domain_row *row)
 {
-	int i = 0;
 	xenstat_vbd *vbd;
-	unsigned num_vbds = 0;
-	unsigned long long total = 0;
-	
-	num_vbds = xenstat_domain_num_vbds(domain);
-	
-	for ( i=0 ; i < num_vbds ; i++) {
-		vbd = xenstat_domain_vbd(domain,i);
-		switch(flag) {
-		case FIELD_VBD_OO:
-			total += xenstat_vbd_oo_reqs(vbd);
-			break;
-		case FIELD_VBD_RD:
-			total += xenstat_vbd_rd_reqs(vbd);
-			break;
-		case FIELD_VBD_WR:
-			total += xenstat_vbd_wr_reqs(vbd);
-			break;
-		case FIELD_VBD_RSECT:
-			total += xenstat_vbd_rd_sects(vbd);
-			break;
-		case FIELD_VBD_WSECT:
-			total += xenstat_vbd_wr_sects(vbd);
-			break;
-		default:
-			break;
-		}
+	unsigned int i, num_vbds;
+
+	row->vbd_oo = row->vbd_rd = row->vbd_wr = 0;
+	row->vbd_rsect = row->vbd_wsect = 0;
+	num_vbds = xenstat_domain_num_vbds(row->domain);
+	for (i = 0; i < num_vbds; i++) {
+		vbd = xenstat_domain_vbd(row->domain, i);
+		row->vbd_oo += xenstat_vbd_oo_reqs(vbd);
+		row->vbd_rd += xenstat_vbd_rd_reqs(vbd);
+		row->vbd_wr += xenstat_vbd_wr_reqs(vbd);
+		row->vbd_rsect += xenstat_vbd_rd_sects(vbd);
+		row->vbd_wsect += xenstat_vbd_wr_sects(vbd);
 	}
-	
-	return total;
 }
 
 /* Compares security id (ssid) of two domains, returning -1,0,1 for <,=,> */
-static int compare_ssid(xenstat_domain *domain1, xenstat_domain *domain2)
+static int compare_ssid(domain_row *row1, domain_row *row2)
 {
-	return compare(xenstat_domain_ssid(domain1),
-		       xenstat_domain_ssid(domain2));
+	return compare(xenstat_domain_ssid(row1->domain),
+		       xenstat_domain_ssid(row2->domain));
 }
 
 /* Prints ssid statistic */
-static void print_ssid(xenstat_domain *domain)
+static void print_ssid(domain_row *row)
 {
-	print("%4u", xenstat_domain_ssid(domain));
+	print_uint(4, xenstat_domain_ssid(row->domain));
 }
 
-static void get_ssid(xenstat_domain *domain, char *buf, int *len)
+static void get_ssid(domain_row *row, char *buf, int *len)
 {
-	*len = snprintf(buf, *len, "%u", xenstat_domain_ssid(domain));
+	*len = snprintf(buf, *len, "%u", xenstat_domain_ssid(row->domain));
 }
 
 /* Section printing functions */
@@ -953,6 +1437,8 @@ void do_summary(void)
 	print("Date: %s, Domains: %u, %u running, %u blocked, %u paused, "
 	      "%u crashed, %u dying, %u shutdown ",
 	      time_str, num_domains, run, block, pause, crash, dying, shutdown);
+	if (overruns > 0)
+		print("Missed: %lu intervals ", overruns);
 
 	used = xenstat_node_tot_mem(cur_node)-xenstat_node_free_mem(cur_node);
 	freeable_mb = xenstat_node_freeable_mb(cur_node);
@@ -969,67 +1455,83 @@ void do_summary(void)
 	print("CPUs: %u @ %lluMHz\n",
 	      xenstat_node_num_cpus(cur_node),
 	      xenstat_node_cpu_hz(cur_node)/1000000);
+
+	/* Dump NUMA node memory and cpu information */
+	if (show_numa && xenstat_node_num_numa_nodes(cur_node) > 1) {
+		for (i = 0; i < xenstat_node_num_numa_nodes(cur_node); i++)
+			print("%sNode%u: %lluk total, %lluk free, %u CPUs",
+			      i ? "; " : "NUMA: ", i,
+			      xenstat_node_numa_tot_mem(cur_node, i)/1024,
+			      xenstat_node_numa_free_mem(cur_node, i)/1024,
+			      xenstat_node_numa_num_cpus(cur_node, i));
+		print("\n");
+	}
 }
 
-void do_json_summary(void) {
-	
-#define TIME_STR_LEN 20
-	const char *TIME_STR_FORMAT = "%D %H:%M:%S";
-	char time_str[TIME_STR_LEN];
-	int time_len = 0;
+/* Keyed JSON values, written into the currently open map */
+static void json_key(const char *key)
+{
+	GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)key, strlen(key)));
+}
 
-#define MAX sizeof(unsigned)*3
-	char buf[MAX] = {0};
-	int len = 0;
-	
+static void json_uint(const char *key, unsigned long long value)
+{
+	char buf[24];
+
+	json_key(key);
+	GEN_OR_FAIL(yajl_gen_number(yghandle, buf, fmt_uint(buf, value)));
+}
+
+/* Fixed point, so that percentages don't come out as 12.300000000000001 */
+static void json_fixed(const char *key, double value, int prec)
+{
+	char buf[32];
+	int len = fmt_fixed(buf, sizeof(buf), value, prec);
+
+	json_key(key);
+	if (len > 0 && len < sizeof(buf) && (isdigit((unsigned char)buf[0]) || buf[0] == '-')) {
+		GEN_OR_FAIL(yajl_gen_number(yghandle, buf, len));
+	} else {
+		GEN_OR_FAIL(yajl_gen_null(yghandle));
+	}
+}
+
+static void json_string(const char *key, const char *value)
+{
+	json_key(key);
+	GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)value, strlen(value)));
+}
+
+/* The generator streams straight into the output of the interval */
+static void json_write(void *ctx, const char *str, size_t len)
+{
+	output_write(&out, str, len);
+}
+
+/* Sets up the one generator used for the whole run */
+static void json_init(void)
+{
+	yghandle = yajl_gen_alloc(NULL);
+	if (yghandle == NULL)
+		fail("Failed to allocate the JSON generator\n");
+	yajl_gen_config(yghandle, yajl_gen_print_callback, json_write, NULL);
+}
+
+/* Ends the value of this interval, and readies the generator for the next */
+void print_json(yajl_gen g) {
+	print("\n");
+	yajl_gen_reset(g, NULL);
+}
+
+void do_json_summary(void)
+{
 	unsigned run = 0, block = 0, pause = 0,
 	         crash = 0, dying = 0, shutdown = 0;
 	unsigned i, num_domains = 0;
-	unsigned long long used = 0;
+	unsigned long long tot_mem, free_mem;
 	long freeable_mb = 0;
 	xenstat_domain *domain;
-	time_t curt;
-
 
-	/*
-	GEN_OR_FAIL(yajl_gen_array_open(yghandle));
-	
-	GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)"date", 4));
-	
-	GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)"domains", 7));
-	
-	GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)"running", 7));
-	
-	GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)"blocked", 7));
-	
-	GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)"paused", 6));
-	
-	GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)"dying", 5));
-	
-	GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)"shutdown", 8));
-	
-	GEN_OR_FAIL(yajl_gen_map_open(yghandle));
-	GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)"mem", 3));
-	GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)"total", 5));
-	GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)"used", 4));
-	GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)"free", 4));
-	GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)"freeable", 8));
-	GEN_OR_FAIL(yajl_gen_map_close(yghandle));
-	
-	
-	GEN_OR_FAIL(yajl_gen_map_open(yghandle));
-	GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)"cpu", 3));
-	GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)"total", 5));
-	GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)"clock", 5));
-	GEN_OR_FAIL(yajl_gen_map_close(yghandle));
-	
-	GEN_OR_FAIL(yajl_gen_array_close(yghandle));
-	*/
-	
-	/* Print program name, current time, and number of domains */
-	curt = curtime.tv_sec;
-	strftime(time_str, TIME_STR_LEN, TIME_STR_FORMAT, localtime(&curt));
-	
 	num_domains = xenstat_node_num_domains(cur_node);
 	
 	/* Tabulate what states domains are in for summary */
@@ -1043,154 +1545,94 @@ void do_json_summary(void) {
 		else if (xenstat_domain_dying(domain)) dying++;
 	}
 	
-	GEN_OR_FAIL(yajl_gen_array_open(yghandle));
-	
-	// Date time
-	time_len = strlen(time_str);
-	GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)time_str, time_len));
-	
-	// Number of domains
-	len = snprintf(buf, MAX, "%u", num_domains);
-	GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)buf, len));
-	
-	// Running
-	len = snprintf(buf, MAX, "%u", run);
-	GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)buf, len));
-	
-	// Blocked
-	len = snprintf(buf, MAX, "%u", block);
-	GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)buf, len));
-	
-	// Paused
-	len = snprintf(buf, MAX, "%u", pause);
-	GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)buf, len));
-	
-	// Crashed
-	len = snprintf(buf, MAX, "%u", crash);
-	GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)buf, len));
-	
-	// Dying
-	len = snprintf(buf, MAX, "%u", dying);
-	GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)buf, len));
-	
-	// Shutdown
-	len = snprintf(buf, MAX, "%u", shutdown);
-	GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)buf, len));
-	
-	used = xenstat_node_tot_mem(cur_node)-xenstat_node_free_mem(cur_node);
+	tot_mem = xenstat_node_tot_mem(cur_node);
+	free_mem = xenstat_node_free_mem(cur_node);
 	freeable_mb = xenstat_node_freeable_mb(cur_node);
 
-	// Dump node memory
-	len = snprintf(buf, MAX, "%lluk", xenstat_node_tot_mem(cur_node)/1024);
-	GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)buf, len));
-	
-	len = snprintf(buf, MAX, "%lluk", used/1024);
-	GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)buf, len));
-	
-	len = snprintf(buf, MAX, "%lluk", xenstat_node_free_mem(cur_node)/1024);
-	GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)buf, len));
-	
-	len = snprintf(buf, MAX, "%ldk", ((freeable_mb <=0)?0:freeable_mb*1024));
-	GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)buf, len));
-	
-	// CPU information
-	len = snprintf(buf, MAX, "%uk", xenstat_node_num_cpus(cur_node));
-	GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)buf, len));
-	
-	len = snprintf(buf, MAX, "%lluMHz", xenstat_node_cpu_hz(cur_node)/1000000);
-	GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)buf, len));
-	
-	GEN_OR_FAIL(yajl_gen_array_close(yghandle));
+	GEN_OR_FAIL(yajl_gen_map_open(yghandle));
+	json_fixed("time", curtime.tv_sec + curtime.tv_usec / 1000000.0, 3);
+	json_uint("overruns", overruns);
+	json_key("rate");
+	GEN_OR_FAIL(yajl_gen_bool(yghandle, show_rate));
+	json_uint("domains", num_domains);
+	json_uint("running", run);
+	json_uint("blocked", block);
+	json_uint("paused", pause);
+	json_uint("crashed", crash);
+	json_uint("dying", dying);
+	json_uint("shutdown", shutdown);
+	json_uint("total_k", tot_mem/1024);
+	json_uint("used_k", (tot_mem - free_mem)/1024);
+	json_uint("free_k", free_mem/1024);
+	json_uint("freeable_k", freeable_mb > 0 ? freeable_mb*1024 : 0);
+	json_uint("cpus", xenstat_node_num_cpus(cur_node));
+	json_uint("cpu_mhz", xenstat_node_cpu_hz(cur_node)/1000000);
+	GEN_OR_FAIL(yajl_gen_map_close(yghandle));
 }
 
 /* Display the top header for the domain table */
 void do_header(void)
 {
-	field_id i;
+	unsigned int c, i;
 	char *isSortOptions[] = {"", "(s)"};
 	char *isSort;
 	char separator;
-	
-	/* Turn on REVERSE highlight attribute for headings */
-	for(i = 0; i < NUM_FIELDS; i++) {
-		isSort = isSortOptions[0];
-		
-		/* The (s) attribute is turned on for the sort column */
-		if (i == sort_field)
-			isSort = isSortOptions[1];
-		
-		switch (ftype) {
-			case TYPE_ORG_OPT:
-				separator = (i<NUM_FIELDS-1)?' ':0;
-				print("%-*s%s%c", fields[i].default_width, fields[i].header, isSort, separator);
-			break;
-			case TYPE_CSV_OPT:
-				separator = (i<NUM_FIELDS-1)?',':0;
-				print("%s%s%c", fields[i].header, isSort, separator);
-			break;
-		}
-	}
-	print("\n");
-}
 
-void do_json_header(void) {
-	field_id i;
-	char *isSortOptions[] = {"", "(s)"};
-	char *isSort;
-	char buf[MAX_HEADER_LEN] = {0};
-	size_t valuelen;
-	
-	// Specify open of array
-	GEN_OR_FAIL(yajl_gen_array_open(yghandle));
-	
 	/* Turn on REVERSE highlight attribute for headings */
-	for(i = 0; i < NUM_FIELDS; i++) {
+	for(c = 0; c < num_columns; c++) {
+		i = columns[c];
 		isSort = isSortOptions[0];
 		
 		/* The (s) attribute is turned on for the sort column */
 		if (i == sort_field)
 			isSort = isSortOptions[1];
 		
-		valuelen = snprintf(buf, MAX_HEADER_LEN, "%s%s", fields[i].header, isSort);
-		
-		GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)buf, valuelen));
+		separator = (c<num_columns-1)?' ':0;
+		print("%-*s%s%c", fields[i].default_width, field_header(i), isSort, separator);
 	}
-	
-	// Specify end of array
-	GEN_OR_FAIL(yajl_gen_array_close(yghandle));
+	print("\n");
 }
 
 /* Prints Domain information */
-void do_domain(xenstat_domain *domain)
+void do_domain(domain_row *row)
 {
-	unsigned int i;
-	for (i = 0; i < NUM_FIELDS; i++) {
-		if (i != 0)
+	unsigned int c;
+	for (c = 0; c < num_columns; c++) {
+		if (c != 0)
 			print(" ");
-		fields[i].print(domain);
+		fields[columns[c]].print(row);
 	}
 	print("\n");
 }
 
-void do_json_domain(xenstat_domain *domain)
+void do_json_domain(domain_row *row)
 {
-#define MAX_LEN 100
-	unsigned int i;
-	char info[MAX_LEN] = {0};
+	unsigned int c, i;
+	char info[32];
 	int len;
-	
-	
-	// Specify open of array
-	GEN_OR_FAIL(yajl_gen_array_open(yghandle));
-	
-	for (i = 0; i < NUM_FIELDS; i++) {
-		len = MAX_LEN;
-		fields[i].get(domain, info, &len);
-		GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)info, len));
+
+	GEN_OR_FAIL(yajl_gen_map_open(yghandle));
+	json_uint("id", xenstat_domain_id(row->domain));
+	json_string("name", xenstat_domain_name(row->domain));
+
+	for (c = 0; c < num_columns; c++) {
+		i = columns[c];
+		if (fields[i].key == NULL)
+			continue;
+		len = sizeof(info);
+		fields[i].get(row, info, &len);
+		json_key(fields[i].key);
+		/* Numeric fields without a value ("no limit", "n/a") are null */
+		if (fields[i].num == FIELD_STATE) {
+			GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)info, len));
+		} else if (isdigit((unsigned char)info[0]) || info[0] == '-') {
+			GEN_OR_FAIL(yajl_gen_number(yghandle, info, len));
+		} else {
+			GEN_OR_FAIL(yajl_gen_null(yghandle));
+		}
 	}
 	
-	// Specify end of array
-	GEN_OR_FAIL(yajl_gen_array_close(yghandle));
+	GEN_OR_FAIL(yajl_gen_map_close(yghandle));
 }
 
 /* Output all vcpu information */
@@ -1224,167 +1666,290 @@ void do_vcpu(xenstat_domain *domain)
 
 void do_json_vcpu(xenstat_domain *domain)
 {
-	int i = 0;
-	unsigned num_vcpus = 0;
+	unsigned int i, num_vcpus;
 	xenstat_vcpu *vcpu;
 	
-// Maximum number of vcpus is limited by the num_vcpus type.
-#define MAX_DIGIT_NUM_VCPUS sizeof(num_vcpus)*3
-#define MAX_DIGIT_NUM_VCPUS_NSEC sizeof(unsigned long long int)*3
-	char index_buf[MAX_DIGIT_NUM_VCPUS] = {0},
-		vcpus_sec_buf[MAX_DIGIT_NUM_VCPUS_NSEC] = {0};
-	int index_len = MAX_DIGIT_NUM_VCPUS,
-		vcpus_nsec_len = MAX_DIGIT_NUM_VCPUS_NSEC;
-	
 	num_vcpus = xenstat_domain_num_vcpus(domain);
 	
-	GEN_OR_FAIL(yajl_gen_map_open(yghandle));
+	GEN_OR_FAIL(yajl_gen_array_open(yghandle));
 	
-	/* for all online vcpus dump out values */
-	for (i=0; i< num_vcpus; i++) {
+	for (i = 0; i < num_vcpus; i++) {
 		vcpu = xenstat_domain_vcpu(domain,i);
 		
-		{
-			index_len = snprintf(index_buf, MAX_DIGIT_NUM_VCPUS, "%d", i);
-			
-			// Set key for domain
-			GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)index_buf, index_len));
-		}
-		
-		if (xenstat_vcpu_online(vcpu) > 0) {
-			vcpus_nsec_len = snprintf(vcpus_sec_buf, MAX_DIGIT_NUM_VCPUS_NSEC, 
-				"%llu",	xenstat_vcpu_ns(vcpu)/1000000000);
-			
-			GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)vcpus_sec_buf, vcpus_nsec_len));
-		}
-		else {
-			
-			GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)"offline", 7));
-		}
+		GEN_OR_FAIL(yajl_gen_map_open(yghandle));
+		json_uint("id", i);
+		json_key("online");
+		GEN_OR_FAIL(yajl_gen_bool(yghandle, xenstat_vcpu_online(vcpu) > 0));
+		json_uint("cpu_s", xenstat_vcpu_ns(vcpu)/1000000000);
+		GEN_OR_FAIL(yajl_gen_map_close(yghandle));
 	}
 	
-	GEN_OR_FAIL(yajl_gen_map_close(yghandle));
+	GEN_OR_FAIL(yajl_gen_array_close(yghandle));
+}
+
+/* Output all network information */
+/* Finds a network in the previous sample of its domain, given its index in
+ * the current one.  Both samples usually list the networks in the same
+ * order, so the same index is tried first. */
+static xenstat_network *old_network(xenstat_domain *old_domain, unsigned int i,
+				    xenstat_network *network)
+{
+	xenstat_network *old;
+	unsigned int j, num_networks;
+
+	if (old_domain == NULL)
+		return NULL;
+
+	num_networks = xenstat_domain_num_networks(old_domain);
+	if (i < num_networks) {
+		old = xenstat_domain_network(old_domain, i);
+		if (xenstat_network_id(old) == xenstat_network_id(network))
+			return old;
+	}
+	for (j = 0; j < num_networks; j++) {
+		old = xenstat_domain_network(old_domain, j);
+		if (xenstat_network_id(old) == xenstat_network_id(network))
+			return old;
+	}
+	return NULL;
+}
+
+/* Returns a counter of a network, or in rate mode its rate per second */
+static unsigned long long net_value(xenstat_network *network,
+				    xenstat_network *old,
+				    unsigned long long (*get)(xenstat_network *))
+{
+	if (!show_rate)
+		return get(network);
+	if (old == NULL)
+		return 0;
+	return per_second(get(network), get(old));
 }
 
 /* Output all network information */
-void do_network(xenstat_domain *domain)
+void do_network(domain_row *row)
 {
+	xenstat_domain *domain = row->domain;
 	int i = 0;
-	xenstat_network *network;
+	xenstat_network *network, *old;
 	unsigned num_networks = 0;
 	
 	/* How many networks? */
 	num_networks = xenstat_domain_num_networks(domain);
 	
 	if (num_networks)
-		print("IF# RX[ %12s %10s %8s %8s ] TX[ %12s %10s %8s %8s ]\n", "bytes", "pkts", "err", "drop"
-				, "bytes", "pkts", "err", "drop");
+		print("IF# %-10s %-17s RX[ %12s %10s %8s %8s %8s %8s %10s ] TX[ %12s %10s %8s %8s %8s %8s %8s ]\n",
+				"name", "MAC", RATE_LABEL("bytes"), RATE_LABEL("pkts"),
+				RATE_LABEL("err"), RATE_LABEL("drop"), RATE_LABEL("fifo"),
+				RATE_LABEL("frame"), RATE_LABEL("mcast"),
+				RATE_LABEL("bytes"), RATE_LABEL("pkts"), RATE_LABEL("err"),
+				RATE_LABEL("drop"), RATE_LABEL("fifo"), RATE_LABEL("colls"),
+				RATE_LABEL("carrier"));
 	
 	/* Dump information for each network */
 	for (i=0; i < num_networks; i++) {
 		/* Next get the network information */
 		network = xenstat_domain_network(domain,i);
+		old = old_network(row->old_domain, i, network);
 		
 		
 		
-		print("%2d      %12llu %10llu %8llu %8llu",
+		print("%2d  %-10s %-17s     %12llu %10llu %8llu %8llu %8llu %8llu %10llu",
 		      i,
-		      xenstat_network_rbytes(network),
-		      xenstat_network_rpackets(network),
-		      xenstat_network_rerrs(network),
-		      xenstat_network_rdrop(network));
-
-		print("       %12llu %10llu %8llu %8llu\n",
-		      xenstat_network_tbytes(network),
-		      xenstat_network_tpackets(network),
-		      xenstat_network_terrs(network),
-		      xenstat_network_tdrop(network));
+		      xenstat_network_name(network),
+		      xenstat_network_mac(network),
+		      net_value(network, old, xenstat_network_rbytes),
+		      net_value(network, old, xenstat_network_rpackets),
+		      net_value(network, old, xenstat_network_rerrs),
+		      net_value(network, old, xenstat_network_rdrop),
+		      net_value(network, old, xenstat_network_rfifo),
+		      net_value(network, old, xenstat_network_rframe),
+		      net_value(network, old, xenstat_network_rmcast));
+
+		print("       %12llu %10llu %8llu %8llu %8llu %8llu %8llu\n",
+		      net_value(network, old, xenstat_network_tbytes),
+		      net_value(network, old, xenstat_network_tpackets),
+		      net_value(network, old, xenstat_network_terrs),
+		      net_value(network, old, xenstat_network_tdrop),
+		      net_value(network, old, xenstat_network_tfifo),
+		      net_value(network, old, xenstat_network_tcolls),
+		      net_value(network, old, xenstat_network_tcarrier));
 	}
 }
 
-void do_json_network(xenstat_domain *domain)
-{
-	int i = 0;
-	xenstat_network *network;
-	unsigned num_networks = 0;
+/* Network counters in JSON and CSV output, by key */
+static const struct {
+	const char *key;
+	unsigned long long (*get)(xenstat_network *);
+} net_counters[] = {
+	{ "rx_bytes",      xenstat_network_rbytes      },
+	{ "rx_packets",    xenstat_network_rpackets    },
+	{ "rx_errs",       xenstat_network_rerrs       },
+	{ "rx_drop",       xenstat_network_rdrop       },
+	{ "rx_fifo",       xenstat_network_rfifo       },
+	{ "rx_frame",      xenstat_network_rframe      },
+	{ "rx_compressed", xenstat_network_rcompressed },
+	{ "rx_mcast",      xenstat_network_rmcast      },
+	{ "tx_bytes",      xenstat_network_tbytes      },
+	{ "tx_packets",    xenstat_network_tpackets    },
+	{ "tx_errs",       xenstat_network_terrs       },
+	{ "tx_drop",       xenstat_network_tdrop       },
+	{ "tx_fifo",       xenstat_network_tfifo       },
+	{ "tx_colls",      xenstat_network_tcolls      },
+	{ "tx_carrier",    xenstat_network_tcarrier    },
+	{ "tx_compressed", xenstat_network_tcompressed },
+};
 
-#define MAX_DIGIT_NUM_NET sizeof(unsigned long long int)*3
-	char net_buf[MAX_DIGIT_NUM_NET] = {0};
-	int net_len = MAX_DIGIT_NUM_NET;
+void do_json_network(domain_row *row)
+{
+	xenstat_domain *domain = row->domain;
+	unsigned int i, j, num_networks;
+	xenstat_network *network, *old;
 	
-	/* How many networks? */
 	num_networks = xenstat_domain_num_networks(domain);
 	
-	/*
-	if (num_networks)
-		print("IF# RX[ %12s %10s %8s %8s ] TX[ %12s %10s %8s %8s ]\n", "bytes", "pkts", "err", "drop"
-				, "bytes", "pkts", "err", "drop");
-	*/
-	
 	GEN_OR_FAIL(yajl_gen_array_open(yghandle));
 	
-	/* Dump information for each network */
-	for (i=0; i < num_networks; i++) {
-		
-		/* Next get the network information */
+	for (i = 0; i < num_networks; i++) {
 		network = xenstat_domain_network(domain,i);
+		old = old_network(row->old_domain, i, network);
 		
-		
-		// Rx
-		net_len = snprintf(net_buf, MAX_DIGIT_NUM_NET, "%llu", xenstat_network_rbytes(network));
-		GEN_OR_FAIL(yajl_gen_number(yghandle, net_buf, net_len));
-		
-		net_len = snprintf(net_buf, MAX_DIGIT_NUM_NET, "%llu", xenstat_network_rpackets(network));
-		GEN_OR_FAIL(yajl_gen_number(yghandle, net_buf, net_len));
-		
-		net_len = snprintf(net_buf, MAX_DIGIT_NUM_NET, "%llu", xenstat_network_rerrs(network));
-		GEN_OR_FAIL(yajl_gen_number(yghandle, net_buf, net_len));
-		
-		net_len = snprintf(net_buf, MAX_DIGIT_NUM_NET, "%llu", xenstat_network_rdrop(network));
-		GEN_OR_FAIL(yajl_gen_number(yghandle, net_buf, net_len));
-		
-		
-		// Tx
-		net_len = snprintf(net_buf, MAX_DIGIT_NUM_NET, "%llu", xenstat_network_tbytes(network));
-		GEN_OR_FAIL(yajl_gen_number(yghandle, net_buf, net_len));
-		
-		net_len = snprintf(net_buf, MAX_DIGIT_NUM_NET, "%llu", xenstat_network_tpackets(network));
-		GEN_OR_FAIL(yajl_gen_number(yghandle, net_buf, net_len));
-		
-		net_len = snprintf(net_buf, MAX_DIGIT_NUM_NET, "%llu", xenstat_network_terrs(network));
-		GEN_OR_FAIL(yajl_gen_number(yghandle, net_buf, net_len));
-		
-		net_len = snprintf(net_buf, MAX_DIGIT_NUM_NET, "%llu", xenstat_network_tdrop(network));
-		GEN_OR_FAIL(yajl_gen_number(yghandle, net_buf, net_len));
+		GEN_OR_FAIL(yajl_gen_map_open(yghandle));
+		json_uint("id", xenstat_network_id(network));
+		json_string("name", xenstat_network_name(network));
+		json_string("mac", xenstat_network_mac(network));
+		for (j = 0; j < sizeof(net_counters)/sizeof(net_counters[0]); j++)
+			json_uint(net_counters[j].key,
+				  net_value(network, old, net_counters[j].get));
+		GEN_OR_FAIL(yajl_gen_map_close(yghandle));
 	}
-
 	
 	GEN_OR_FAIL(yajl_gen_array_close(yghandle));
 }
 
 
+/* Backing device statistics of a vbd over the last interval, iostat -x style */
+struct vbd_load {
+	double util;		/* % of the time the device was busy */
+	double avgqu;		/* Average queue length */
+	double await;		/* Average ms per I/O */
+};
+
+/* Finds a vbd in the previous sample of its domain, given its index in the
+ * current one.  Both samples usually list the vbds in the same order, so the
+ * same index is tried first. */
+static xenstat_vbd *old_vbd(xenstat_domain *old_domain, unsigned int i,
+			    xenstat_vbd *vbd)
+{
+	xenstat_vbd *old;
+	unsigned int j, num_vbds;
+
+	if (old_domain == NULL)
+		return NULL;
+
+	num_vbds = xenstat_domain_num_vbds(old_domain);
+	if (i < num_vbds) {
+		old = xenstat_domain_vbd(old_domain, i);
+		if (xenstat_vbd_type(old) == xenstat_vbd_type(vbd) &&
+		    xenstat_vbd_dev(old) == xenstat_vbd_dev(vbd))
+			return old;
+	}
+	for (j = 0; j < num_vbds; j++) {
+		old = xenstat_domain_vbd(old_domain, j);
+		if (xenstat_vbd_type(old) == xenstat_vbd_type(vbd) &&
+		    xenstat_vbd_dev(old) == xenstat_vbd_dev(vbd))
+			return old;
+	}
+	return NULL;
+}
+
+/* Returns a counter of a vbd, or in rate mode its rate per second */
+static unsigned long long vbd_value(xenstat_vbd *vbd, xenstat_vbd *old,
+				    unsigned long long (*get)(xenstat_vbd *))
+{
+	if (!show_rate)
+		return get(vbd);
+	if (old == NULL)
+		return 0;
+	return per_second(get(vbd), get(old));
+}
+
+/* Computes the backing device load of a vbd since the previous sample, given
+ * the vbd in that sample */
+static void calc_vbd_load(xenstat_vbd *old_vbd, xenstat_vbd *vbd,
+			  struct vbd_load *load)
+{
+	unsigned long long ios;
+	double ms_elapsed;
+
+	load->util = load->avgqu = load->await = 0.0;
+
+	/* Can't calculate the load without a previous sample. */
+	if (old_vbd == NULL)
+		return;
+
+	/* As in per_second(), counters that went backwards (a replaced backing
+	 * device, io_ticks wrapping at 32 bits) give nothing, and so does a
+	 * backing device that wasn't read on the previous sample */
+	if (xenstat_vbd_io_ticks(vbd) < xenstat_vbd_io_ticks(old_vbd) ||
+	    xenstat_vbd_queue_ticks(vbd) < xenstat_vbd_queue_ticks(old_vbd) ||
+	    xenstat_vbd_bd_ios(vbd) < xenstat_vbd_bd_ios(old_vbd) ||
+	    xenstat_vbd_bd_ticks(vbd) < xenstat_vbd_bd_ticks(old_vbd))
+		return;
+	if (xenstat_vbd_io_ticks(old_vbd) == 0 &&
+	    xenstat_vbd_queue_ticks(old_vbd) == 0 &&
+	    xenstat_vbd_bd_ios(old_vbd) == 0 &&
+	    xenstat_vbd_bd_ticks(old_vbd) == 0)
+		return;
+
+	ms_elapsed = elapsed_secs() * 1000.0;
+	if (ms_elapsed <= 0)
+		return;
+
+	load->util = (xenstat_vbd_io_ticks(vbd)
+		      - xenstat_vbd_io_ticks(old_vbd)) * 100.0 / ms_elapsed;
+	load->avgqu = (xenstat_vbd_queue_ticks(vbd)
+		       - xenstat_vbd_queue_ticks(old_vbd)) / ms_elapsed;
+	ios = xenstat_vbd_bd_ios(vbd) - xenstat_vbd_bd_ios(old_vbd);
+	if (ios != 0)
+		load->await = (double)(xenstat_vbd_bd_ticks(vbd)
+				       - xenstat_vbd_bd_ticks(old_vbd)) / ios;
+}
+
 /* Output all VBD information */
-void do_vbd(xenstat_domain *domain)
+void do_vbd(domain_row *row)
 {
+	xenstat_domain *domain = row->domain;
 	int i = 0;
-	xenstat_vbd *vbd;
+	xenstat_vbd *vbd, *old;
 	unsigned num_vbds = 0;
 
 	const char *vbd_type[] = {
 		"Unidentified",				/* number 0 */
 		"BlkBack",					/* number 1 */
 		"BlkTap",					/* number 2 */
+		"QDisk",					/* number 3 */
 	};
 	
 	num_vbds = xenstat_domain_num_vbds(domain);
 	
-	if (num_vbds)
-		print("vbdType device details       OO RD(total) WR(total) RD(sector) WR(sector)\n");
+	if (num_vbds && show_rate)
+		print("vbdType device details     OO/s      RD/s      WR/s       FL/s       DS/s RDSECTOR/s WRSECTOR/s     RDBYTES/s     WRBYTES/s INFL  UTIL%%  AVGQU AWAIT(ms) name\n");
+	else if (num_vbds)
+		print("vbdType device details       OO RD(total) WR(total)  FL(total)  DS(total) RD(sector) WR(sector)     RD(bytes)     WR(bytes) INFL  UTIL%%  AVGQU AWAIT(ms) name\n");
 	
 	for (i=0 ; i< num_vbds; i++) {
 		char details[20];
+		struct vbd_load load;
+		unsigned int type;
 
 		vbd = xenstat_domain_vbd(domain,i);
+		old = old_vbd(row->old_domain, i, vbd);
+		calc_vbd_load(old, vbd, &load);
+
+		type = xenstat_vbd_type(vbd);
+		if (type >= sizeof(vbd_type)/sizeof(vbd_type[0]))
+			type = 0;
 
 #if !defined(__linux__)
 		details[0] = '\0';
@@ -1394,88 +1959,83 @@ void do_vbd(xenstat_domain *domain)
 			 MINOR(xenstat_vbd_dev(vbd)));
 #endif
 		
-		print("%-7s %6d %7s %8llu %9llu %9llu %10llu %10llu\n",
-		      vbd_type[xenstat_vbd_type(vbd)],
+		print("%-7s %6d %7s %8llu %9llu %9llu %10llu %10llu %10llu %10llu %13llu %13llu %4u %6.1f %6.2f %9.2f %s\n",
+		      vbd_type[type],
 		      xenstat_vbd_dev(vbd), details,
-		      xenstat_vbd_oo_reqs(vbd),
-		      xenstat_vbd_rd_reqs(vbd),
-		      xenstat_vbd_wr_reqs(vbd),
-		      xenstat_vbd_rd_sects(vbd),
-		      xenstat_vbd_wr_sects(vbd));
+		      vbd_value(vbd, old, xenstat_vbd_oo_reqs),
+		      vbd_value(vbd, old, xenstat_vbd_rd_reqs),
+		      vbd_value(vbd, old, xenstat_vbd_wr_reqs),
+		      vbd_value(vbd, old, xenstat_vbd_f_reqs),
+		      vbd_value(vbd, old, xenstat_vbd_ds_reqs),
+		      vbd_value(vbd, old, xenstat_vbd_rd_sects),
+		      vbd_value(vbd, old, xenstat_vbd_wr_sects),
+		      vbd_value(vbd, old, xenstat_vbd_rd_bytes),
+		      vbd_value(vbd, old, xenstat_vbd_wr_bytes),
+		      xenstat_vbd_inflight(vbd),
+		      load.util, load.avgqu, load.await,
+		      xenstat_vbd_name(vbd));
 	}
 }
 
-void do_json_vbd(xenstat_domain *domain)
-{
-	int i = 0;
-	xenstat_vbd *vbd;
-	unsigned num_vbds = 0;
+/* VBD counters in JSON and CSV output, by key */
+static const struct {
+	const char *key;
+	unsigned long long (*get)(xenstat_vbd *);
+} vbd_counters[] = {
+	{ "oo_reqs",  xenstat_vbd_oo_reqs  },
+	{ "rd_reqs",  xenstat_vbd_rd_reqs  },
+	{ "wr_reqs",  xenstat_vbd_wr_reqs  },
+	{ "rd_sects", xenstat_vbd_rd_sects },
+	{ "wr_sects", xenstat_vbd_wr_sects },
+	{ "f_reqs",   xenstat_vbd_f_reqs   },
+	{ "ds_reqs",  xenstat_vbd_ds_reqs  },
+	{ "rd_bytes", xenstat_vbd_rd_bytes },
+	{ "wr_bytes", xenstat_vbd_wr_bytes },
+};
 
-#define MAX_DIGIT_NUM_VBD sizeof(unsigned long long int)*3
-	char vbd_buf[MAX_DIGIT_NUM_VBD] = {0};
-	int vbd_len = 0;
-	int vbd_type_index = 0;
+void do_json_vbd(domain_row *row)
+{
+	xenstat_domain *domain = row->domain;
+	unsigned int i, j, num_vbds, type;
+	xenstat_vbd *vbd, *old;
+	struct vbd_load load;
 	
 	const char *vbd_type[] = {
 		"Unidentified",				/* number 0 */
 		"BlkBack",					/* number 1 */
 		"BlkTap",					/* number 2 */
-	};
-	
-	const int vbd_type_size[] = {
-		12, 7, 6
+		"QDisk",					/* number 3 */
 	};
 	
 	num_vbds = xenstat_domain_num_vbds(domain);
 	
-	/*
-	if (num_vbds)
-		print("vbdType device details       OO RD(total) WR(total) RD(sector) WR(sector)\n");
-	*/
-	
-	// Start array
 	GEN_OR_FAIL(yajl_gen_array_open(yghandle));
 	
-	for (i=0 ; i< num_vbds; i++) {
-		char details[20];
-
+	for (i = 0; i < num_vbds; i++) {
 		vbd = xenstat_domain_vbd(domain,i);
-
-#if !defined(__linux__)
-		details[0] = '\0';
-#else
-		snprintf(details, 20, "[%2x:%2x]",
-			 MAJOR(xenstat_vbd_dev(vbd)),
-			 MINOR(xenstat_vbd_dev(vbd)));
-#endif
-		
-		GEN_OR_FAIL(yajl_gen_array_open(yghandle));
-		
-		// VBD Type
-		vbd_type_index = xenstat_vbd_type(vbd);
-		GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)vbd_type[vbd_type_index], vbd_type_size[vbd_type_index]));
-		
-		// Major:Minor
-		vbd_len = strlen(details);
-		GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)details, vbd_len));
-		
-		//
-		vbd_len = snprintf(vbd_buf, MAX_DIGIT_NUM_VBD, "%llu", xenstat_vbd_oo_reqs(vbd));
-		GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)vbd_buf, vbd_len));
-		
-		vbd_len = snprintf(vbd_buf, MAX_DIGIT_NUM_VBD, "%llu", xenstat_vbd_rd_reqs(vbd));
-		GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)vbd_buf, vbd_len));
-		
-		vbd_len = snprintf(vbd_buf, MAX_DIGIT_NUM_VBD, "%llu", xenstat_vbd_wr_reqs(vbd));
-		GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)vbd_buf, vbd_len));
+		old = old_vbd(row->old_domain, i, vbd);
+		calc_vbd_load(old, vbd, &load);
 		
-		vbd_len = snprintf(vbd_buf, MAX_DIGIT_NUM_VBD, "%llu", xenstat_vbd_rd_sects(vbd));
-		GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)vbd_buf, vbd_len));
+		type = xenstat_vbd_type(vbd);
+		if (type >= sizeof(vbd_type)/sizeof(vbd_type[0]))
+			type = 0;
 		
-		vbd_len = snprintf(vbd_buf, MAX_DIGIT_NUM_VBD, "%llu", xenstat_vbd_wr_sects(vbd));
-		GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)vbd_buf, vbd_len));
-		
-		GEN_OR_FAIL(yajl_gen_array_close(yghandle));
+		GEN_OR_FAIL(yajl_gen_map_open(yghandle));
+		json_string("type", vbd_type[type]);
+		json_uint("dev", xenstat_vbd_dev(vbd));
+#if defined(__linux__)
+		json_uint("major", MAJOR(xenstat_vbd_dev(vbd)));
+		json_uint("minor", MINOR(xenstat_vbd_dev(vbd)));
+#endif
+		json_string("name", xenstat_vbd_name(vbd));
+		for (j = 0; j < sizeof(vbd_counters)/sizeof(vbd_counters[0]); j++)
+			json_uint(vbd_counters[j].key,
+				  vbd_value(vbd, old, vbd_counters[j].get));
+		json_uint("inflight", xenstat_vbd_inflight(vbd));
+		json_fixed("util_pct", load.util, 1);
+		json_fixed("avgqu", load.avgqu, 2);
+		json_fixed("await_ms", load.await, 2);
+		GEN_OR_FAIL(yajl_gen_map_close(yghandle));
 	}
 	
 	GEN_OR_FAIL(yajl_gen_array_close(yghandle));
@@ -1498,59 +2058,278 @@ void do_tmem(xenstat_domain *domain)
 
 }
 
-void do_json_tmem(xenstat_domain *domain) {
-	
-	xenstat_tmem *tmem = xenstat_domain_tmem(domain);
-	
-	unsigned long long curr_eph_pages = xenstat_tmem_curr_eph_pages(tmem);
-	unsigned long long succ_eph_gets = xenstat_tmem_succ_eph_gets(tmem);
-	unsigned long long succ_pers_puts = xenstat_tmem_succ_pers_puts(tmem);
-	unsigned long long succ_pers_gets = xenstat_tmem_succ_pers_gets(tmem);
-	
-#define MAX_DIGIT_NUM_TMEM sizeof(unsigned long long)*3
-	char tmem_buf[MAX_DIGIT_NUM_TMEM] = {0};
-	int tmem_len = 0;
-	
-	/*
+/* Output the estimated NUMA placement of the domain's memory */
+void do_numa(xenstat_domain *domain)
+{
+	unsigned int i, num_nodes = xenstat_node_num_numa_nodes(cur_node);
+
+	/* Placement is irrelevant on a single node host */
+	if (num_nodes < 2)
+		return;
+
+	print("NUMA (estimated from node affinity): ");
+	for (i = 0; i < num_nodes; i++)
+		print("%sNode%u ~%lluk", i ? ", " : "", i,
+		      xenstat_domain_numa_mem_est(domain, i)/1024);
+	print(", remote ~%lluk\n",
+	      xenstat_domain_numa_remote_mem_est(domain)/1024);
+}
+
+void do_json_numa(xenstat_domain *domain)
+{
+	unsigned int i, num_nodes = xenstat_node_num_numa_nodes(cur_node);
+
+	GEN_OR_FAIL(yajl_gen_map_open(yghandle));
+	json_key("node_est_k");
 	GEN_OR_FAIL(yajl_gen_array_open(yghandle));
-	
-	GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)"Curr eph pages", 14));
-	
-	GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)"Succ eph gets", 13));
-	
-	GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)"Succ pers puts", 14));
-	
-	GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)"Succ pers gets", 14));
-	
+	for (i = 0; i < num_nodes; i++)
+		GEN_OR_FAIL(yajl_gen_integer(yghandle,
+			xenstat_domain_numa_mem_est(domain, i)/1024));
 	GEN_OR_FAIL(yajl_gen_array_close(yghandle));
-	*/
-	
-	GEN_OR_FAIL(yajl_gen_array_open(yghandle));
-	
-	tmem_len = snprintf(tmem_buf, MAX_DIGIT_NUM_TMEM, "%llu", curr_eph_pages);
-	GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)tmem_buf, tmem_len));
-	
-	tmem_len = snprintf(tmem_buf, MAX_DIGIT_NUM_TMEM, "%llu", succ_eph_gets);
-	GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)tmem_buf, tmem_len));
-	
-	tmem_len = snprintf(tmem_buf, MAX_DIGIT_NUM_TMEM, "%llu", succ_pers_puts);
-	GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)tmem_buf, tmem_len));
-	
-	tmem_len = snprintf(tmem_buf, MAX_DIGIT_NUM_TMEM, "%llu", succ_pers_gets);
-	GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)tmem_buf, tmem_len));
+	json_uint("remote_est_k",
+		  xenstat_domain_numa_remote_mem_est(domain)/1024);
+	GEN_OR_FAIL(yajl_gen_map_close(yghandle));
+}
+
+void do_json_tmem(xenstat_domain *domain)
+{
+	xenstat_tmem *tmem = xenstat_domain_tmem(domain);
 	
-	GEN_OR_FAIL(yajl_gen_array_close(yghandle));
+	GEN_OR_FAIL(yajl_gen_map_open(yghandle));
+	json_uint("curr_eph_pages", xenstat_tmem_curr_eph_pages(tmem));
+	json_uint("succ_eph_gets", xenstat_tmem_succ_eph_gets(tmem));
+	json_uint("succ_pers_puts", xenstat_tmem_succ_pers_puts(tmem));
+	json_uint("succ_pers_gets", xenstat_tmem_succ_pers_gets(tmem));
+	GEN_OR_FAIL(yajl_gen_map_close(yghandle));
+}
+
+/* Fills the counters of a row with rates per second since the previous
+ * sample.  They are computed per device and summed, so a device plugged or
+ * unplugged in between, which is only in one of the samples, is left out
+ * rather than taken for traffic. */
+static void rate_row(domain_row *row)
+{
+	xenstat_network *network, *old_net;
+	xenstat_vbd *vbd, *old;
+	unsigned int i, num;
+
+	row->net_tx = row->net_rx = 0;
+	row->vbd_oo = row->vbd_rd = row->vbd_wr = 0;
+	row->vbd_rsect = row->vbd_wsect = 0;
+	if (row->old_domain == NULL)
+		return;
+
+	num = xenstat_domain_num_networks(row->domain);
+	for (i = 0; i < num; i++) {
+		network = xenstat_domain_network(row->domain, i);
+		old_net = old_network(row->old_domain, i, network);
+		if (old_net == NULL)
+			continue;
+		row->net_tx += per_second(xenstat_network_tbytes(network),
+					  xenstat_network_tbytes(old_net));
+		row->net_rx += per_second(xenstat_network_rbytes(network),
+					  xenstat_network_rbytes(old_net));
+	}
+
+	num = xenstat_domain_num_vbds(row->domain);
+	for (i = 0; i < num; i++) {
+		vbd = xenstat_domain_vbd(row->domain, i);
+		old = old_vbd(row->old_domain, i, vbd);
+		if (old == NULL)
+			continue;
+		row->vbd_oo += per_second(xenstat_vbd_oo_reqs(vbd),
+					  xenstat_vbd_oo_reqs(old));
+		row->vbd_rd += per_second(xenstat_vbd_rd_reqs(vbd),
+					  xenstat_vbd_rd_reqs(old));
+		row->vbd_wr += per_second(xenstat_vbd_wr_reqs(vbd),
+					  xenstat_vbd_wr_reqs(old));
+		row->vbd_rsect += per_second(xenstat_vbd_rd_sects(vbd),
+					     xenstat_vbd_rd_sects(old));
+		row->vbd_wsect += per_second(xenstat_vbd_wr_sects(vbd),
+					     xenstat_vbd_wr_sects(old));
+	}
+}
+
+/* Finds a domain of cur_node in prev_node.  Both samples list the domains by
+ * increasing id, so the previous sample is walked alongside the current one
+ * from *pos rather than searched. */
+static xenstat_domain *find_old_domain(xenstat_domain *domain, unsigned int *pos)
+{
+	xenstat_domain *old_domain;
+	unsigned int num_old;
+
+	if (prev_node == NULL)
+		return NULL;
+
+	num_old = xenstat_node_num_domains(prev_node);
+	while (*pos < num_old) {
+		old_domain = xenstat_node_domain_by_index(prev_node, *pos);
+		if (xenstat_domain_id(old_domain) > xenstat_domain_id(domain))
+			break;
+		(*pos)++;
+		if (xenstat_domain_id(old_domain) == xenstat_domain_id(domain))
+			return old_domain;
+	}
+	return NULL;
+}
+
+/* Fills the row table with the domains of cur_node, computing their derived
+ * values once, and sorts it by the current sort field.  Returns the table and
+ * stores the number of rows in num_rows. */
+static domain_row *get_rows(unsigned int *num_rows)
+{
+	domain_row *row;
+	unsigned int i, j = 0, num_domains;
+
+	/* Count the number of domains for which to report data */
+	num_domains = xenstat_node_num_domains(cur_node);
+	if (num_domains > max_rows) {
+		row = realloc(rows, num_domains * sizeof(domain_row));
+		if (row == NULL)
+			fail("Failed to allocate memory\n");
+		rows = row;
+		max_rows = num_domains;
+	}
+
+	for (i = 0; i < num_domains; i++) {
+		row = &rows[i];
+		row->domain = xenstat_node_domain_by_index(cur_node, i);
+		row->old_domain = find_old_domain(row->domain, &j);
+
+		row->cpu_pct = calc_cpu_pct(row->domain, row->old_domain);
+		row->remote_pct = calc_remote_pct(row->domain);
+		if (show_rate)
+			rate_row(row);
+		else {
+			sum_net_bytes(row);
+			sum_vbd_reqs(row);
+		}
+	}
+
+	/* Sort, or in top-N mode only select and sort the rows shown */
+	if (top_n != 0 && top_n < num_domains)
+		select_rows(rows, num_domains, top_n);
+	else
+		qsort(rows, num_domains, sizeof(domain_row),
+		      (int(*)(const void *, const void *))compare_domains);
+
+	*num_rows = num_domains;
+	return rows;
+}
+
+/* Moves the row at index i of a heap of n rows down until the rows below it
+ * all sort before it */
+static void sift_row(domain_row *heap, unsigned int n, unsigned int i)
+{
+	domain_row tmp;
+	unsigned int child;
+
+	while ((child = 2 * i + 1) < n) {
+		if (child + 1 < n &&
+		    compare_domains(&heap[child + 1], &heap[child]) > 0)
+			child++;
+		if (compare_domains(&heap[child], &heap[i]) <= 0)
+			break;
+		tmp = heap[i];
+		heap[i] = heap[child];
+		heap[child] = tmp;
+		i = child;
+	}
+}
+
+/* Moves the n rows that sort first to the front of the table, in order,
+ * leaving the others unsorted after them.  The front of the table is kept as
+ * a heap with the last of the rows selected so far on top, so this is
+ * O(num_rows log n) rather than a full sort. */
+static void select_rows(domain_row *rows, unsigned int num_rows, unsigned int n)
+{
+	domain_row tmp;
+	unsigned int i;
+
+	for (i = n / 2; i-- > 0; )
+		sift_row(rows, n, i);
+
+	for (i = n; i < num_rows; i++) {
+		if (compare_domains(&rows[i], &rows[0]) >= 0)
+			continue;
+		tmp = rows[0];
+		rows[0] = rows[i];
+		rows[i] = tmp;
+		sift_row(rows, n, 0);
+	}
+
+	qsort(rows, n, sizeof(domain_row),
+	      (int(*)(const void *, const void *))compare_domains);
+}
+
+/* Totals of the domains left out in top-N mode */
+struct others {
+	unsigned int num_domains;
+	double cpu_pct;
+	unsigned long long mem;
+	unsigned long long net_tx;
+	unsigned long long net_rx;
+	unsigned long long vbd_rd;
+	unsigned long long vbd_wr;
+};
+
+static void sum_others(domain_row *rows, unsigned int num_rows,
+		       struct others *others)
+{
+	unsigned int i;
+
+	memset(others, 0, sizeof(*others));
+	others->num_domains = num_rows;
+	for (i = 0; i < num_rows; i++) {
+		others->cpu_pct += rows[i].cpu_pct;
+		others->mem += xenstat_domain_cur_mem(rows[i].domain);
+		others->net_tx += rows[i].net_tx;
+		others->net_rx += rows[i].net_rx;
+		others->vbd_rd += rows[i].vbd_rd;
+		others->vbd_wr += rows[i].vbd_wr;
+	}
+}
+
+/* Prints the totals of the domains left out in top-N mode */
+static void do_others(domain_row *rows, unsigned int num_rows)
+{
+	const char *per = show_rate ? "/s" : "";
+	struct others others;
+
+	sum_others(rows, num_rows, &others);
+	print("Others: %u domains  CPU(%%) %.1f  MEM(k) %llu  NETTX(k)%s %llu  "
+	      "NETRX(k)%s %llu  VBD_RD%s %llu  VBD_WR%s %llu\n",
+	      others.num_domains, others.cpu_pct, others.mem / 1024,
+	      per, others.net_tx / 1024, per, others.net_rx / 1024,
+	      per, others.vbd_rd, per, others.vbd_wr);
+}
+
+static void do_json_others(domain_row *rows, unsigned int num_rows)
+{
+	struct others others;
+
+	sum_others(rows, num_rows, &others);
+
+	GEN_OR_FAIL(yajl_gen_map_open(yghandle));
+	json_uint("domains", others.num_domains);
+	json_fixed("cpu_pct", others.cpu_pct, 1);
+	json_uint("mem_k", others.mem / 1024);
+	json_uint("nettx_k", others.net_tx / 1024);
+	json_uint("netrx_k", others.net_rx / 1024);
+	json_uint("vbd_rd", others.vbd_rd);
+	json_uint("vbd_wr", others.vbd_wr);
+	GEN_OR_FAIL(yajl_gen_map_close(yghandle));
 }
 
 static void top(void) {
-	xenstat_domain **domains;
-	unsigned int i, num_domains = 0;
+	domain_row *domains;
+	unsigned int i, num_domains = 0, num_shown;
 	
 	/* Now get the node information */
 	if (prev_node != NULL)
 		xenstat_free_node(prev_node);
 	prev_node = cur_node;
-	cur_node = xenstat_get_node(xhandle, XENSTAT_ALL);
+	cur_node = xenstat_get_node(xhandle, collect_flags);
 	if (cur_node == NULL)
 		fail("Failed to retrieve statistics from libxenstat\n");
 	
@@ -1559,156 +2338,728 @@ static void top(void) {
 	/* dump summary top information */
 	do_summary();
 		
-	/* Count the number of domains for which to report data */
-	num_domains = xenstat_node_num_domains(cur_node);
-
-	domains = calloc(num_domains, sizeof(xenstat_domain *));
-	if(domains == NULL)
-		fail("Failed to allocate memory\n");
-
-	for (i=0; i < num_domains; i++)
-		domains[i] = xenstat_node_domain_by_index(cur_node, i);
+	domains = get_rows(&num_domains);
+	num_shown = (top_n != 0 && top_n < num_domains) ? top_n : num_domains;
 
-	/* Sort */
-	qsort(domains, num_domains, sizeof(xenstat_domain *),
-	      (int(*)(const void *, const void *))compare_domains);
-
-	if(first_domain_index >= num_domains)
-		first_domain_index = num_domains-1;
+	if(first_domain_index >= num_shown)
+		first_domain_index = num_shown-1;
 		
-	for (i = first_domain_index; i < num_domains; i++) {
+	for (i = first_domain_index; i < num_shown; i++) {
 		
 		if (i == first_domain_index || repeat_header)
 			do_header();
 		
-		do_domain(domains[i]);
+		do_domain(&domains[i]);
 		
 		if (show_vcpus)
-			do_vcpu(domains[i]);
+			do_vcpu(domains[i].domain);
 		
 		if (show_networks)
-			do_network(domains[i]);
+			do_network(&domains[i]);
 		
 		if (show_vbds)
-			do_vbd(domains[i]);
+			do_vbd(&domains[i]);
 		
 		if (show_tmem)
-			do_tmem(domains[i]);
+			do_tmem(domains[i].domain);
+		
+		if (show_numa)
+			do_numa(domains[i].domain);
 		
 		if (i+1<num_domains) print("--\n");
 	}
 	
-	print("----------------\n");
+	if (num_shown < num_domains)
+		do_others(domains + num_shown, num_domains - num_shown);
 	
-	free(domains);
+	print("----------------\n");
 }
 
-static void json_top(void) {
-	
-	xenstat_domain **domains;
-	unsigned int i, num_domains = 0;
-	
-#define NUMDOMAINS_MAX_DIGITS sizeof(unsigned int)*3 // by num_domains type
-	int len;
-	char buf[NUMDOMAINS_MAX_DIGITS] = {0};
-	
-	/* Now get the node information */
-	if (prev_node != NULL)
+/* Writes one CSV value, quoted as in RFC 4180 when it needs to be */
+static void csv_value(struct csv_stream *csv, const char *value, int len)
+{
+	int i;
+
+	if (csv->col++ > 0)
+		output_char(csv->out, ',');
+	if (len == 0)
+		return;
+	if (strcspn(value, ",\"\r\n") >= len &&
+	    value[0] != ' ' && value[len-1] != ' ') {
+		output_write(csv->out, value, len);
+		return;
+	}
+	output_char(csv->out, '"');
+	for (i = 0; i < len; i++) {
+		if (value[i] == '"')
+			output_char(csv->out, '"');
+		output_char(csv->out, value[i]);
+	}
+	output_char(csv->out, '"');
+}
+
+static void csv_string(struct csv_stream *csv, const char *value)
+{
+	csv_value(csv, value, strlen(value));
+}
+
+static void csv_uint(struct csv_stream *csv, unsigned long long value)
+{
+	char buf[24];
+
+	csv_value(csv, buf, fmt_uint(buf, value));
+}
+
+static void csv_fixed(struct csv_stream *csv, double value, int prec)
+{
+	char buf[32];
+	int len = fmt_fixed(buf, sizeof(buf), value, prec);
+
+	/* Out of range values are left empty rather than truncated */
+	csv_value(csv, buf, len < sizeof(buf) ? len : 0);
+}
+
+static void csv_end_row(struct csv_stream *csv)
+{
+	output_char(csv->out, '\n');
+	csv->col = 0;
+}
+
+/* Writes the time, intervals missed so far, domain id and name that start
+ * every row */
+static void csv_row_start(struct csv_stream *csv, xenstat_domain *domain)
+{
+	csv_fixed(csv, curtime.tv_sec + curtime.tv_usec / 1000000.0, 3);
+	csv_uint(csv, overruns);
+	csv_uint(csv, xenstat_domain_id(domain));
+	csv_string(csv, xenstat_domain_name(domain));
+}
+
+static void csv_header_start(struct csv_stream *csv)
+{
+	csv_string(csv, "time");
+	csv_string(csv, "overruns");
+	csv_string(csv, "id");
+	csv_string(csv, "name");
+}
+
+/* Writes the header of a counter column, with a _ps suffix when --rate makes
+ * its values rates per second */
+static void csv_counter_key(struct csv_stream *csv, const char *key)
+{
+	char buf[64];
+
+	if (!show_rate) {
+		csv_string(csv, key);
+		return;
+	}
+	snprintf(buf, sizeof(buf), "%s_ps", key);
+	csv_string(csv, buf);
+}
+
+/* One row per domain, with a column per field */
+static void do_csv_domain(domain_row *row)
+{
+	struct csv_stream *csv = &csv_domains;
+	unsigned int c, i;
+	char info[32];
+	int len;
+
+	if (!csv->header_done) {
+		csv_header_start(csv);
+		for (c = 0; c < num_columns; c++) {
+			i = columns[c];
+			if (fields[i].key == NULL)
+				continue;
+			if (fields[i].rate_header != NULL)
+				csv_counter_key(csv, fields[i].key);
+			else
+				csv_string(csv, fields[i].key);
+		}
+		csv_end_row(csv);
+		csv->header_done = 1;
+	}
+
+	csv_row_start(csv, row->domain);
+	for (c = 0; c < num_columns; c++) {
+		i = columns[c];
+		if (fields[i].key == NULL)
+			continue;
+		len = sizeof(info);
+		fields[i].get(row, info, &len);
+		/* Numeric fields without a value ("no limit", "n/a") are empty */
+		if (fields[i].num != FIELD_STATE &&
+		    !isdigit((unsigned char)info[0]) && info[0] != '-')
+			len = 0;
+		csv_value(csv, info, len);
+	}
+	csv_end_row(csv);
+}
+
+static void do_csv_vifs(domain_row *row)
+{
+	struct csv_stream *csv = &csv_vifs;
+	unsigned int i, j, num_networks;
+	xenstat_network *network, *old;
+
+	if (!csv->header_done) {
+		csv_header_start(csv);
+		csv_string(csv, "vif");
+		csv_string(csv, "vif_name");
+		csv_string(csv, "mac");
+		for (j = 0; j < sizeof(net_counters)/sizeof(net_counters[0]); j++)
+			csv_counter_key(csv, net_counters[j].key);
+		csv_end_row(csv);
+		csv->header_done = 1;
+	}
+
+	num_networks = xenstat_domain_num_networks(row->domain);
+	for (i = 0; i < num_networks; i++) {
+		network = xenstat_domain_network(row->domain, i);
+		old = old_network(row->old_domain, i, network);
+
+		csv_row_start(csv, row->domain);
+		csv_uint(csv, xenstat_network_id(network));
+		csv_string(csv, xenstat_network_name(network));
+		csv_string(csv, xenstat_network_mac(network));
+		for (j = 0; j < sizeof(net_counters)/sizeof(net_counters[0]); j++)
+			csv_uint(csv, net_value(network, old, net_counters[j].get));
+		csv_end_row(csv);
+	}
+}
+
+static void do_csv_vbds(domain_row *row)
+{
+	struct csv_stream *csv = &csv_vbds;
+	unsigned int i, j, num_vbds;
+	xenstat_vbd *vbd, *old;
+	struct vbd_load load;
+
+	if (!csv->header_done) {
+		csv_header_start(csv);
+		csv_string(csv, "dev");
+		csv_string(csv, "vbd_name");
+		for (j = 0; j < sizeof(vbd_counters)/sizeof(vbd_counters[0]); j++)
+			csv_counter_key(csv, vbd_counters[j].key);
+		csv_string(csv, "inflight");
+		csv_string(csv, "util_pct");
+		csv_string(csv, "avgqu");
+		csv_string(csv, "await_ms");
+		csv_end_row(csv);
+		csv->header_done = 1;
+	}
+
+	num_vbds = xenstat_domain_num_vbds(row->domain);
+	for (i = 0; i < num_vbds; i++) {
+		vbd = xenstat_domain_vbd(row->domain, i);
+		old = old_vbd(row->old_domain, i, vbd);
+		calc_vbd_load(old, vbd, &load);
+
+		csv_row_start(csv, row->domain);
+		csv_uint(csv, xenstat_vbd_dev(vbd));
+		csv_string(csv, xenstat_vbd_name(vbd));
+		for (j = 0; j < sizeof(vbd_counters)/sizeof(vbd_counters[0]); j++)
+			csv_uint(csv, vbd_value(vbd, old, vbd_counters[j].get));
+		csv_uint(csv, xenstat_vbd_inflight(vbd));
+		csv_fixed(csv, load.util, 1);
+		csv_fixed(csv, load.avgqu, 2);
+		csv_fixed(csv, load.await, 2);
+		csv_end_row(csv);
+	}
+}
+
+/* One interval of csv output: a row per domain, and per vif and vbd when
+ * those streams were asked for */
+static void csv_top(void)
+{
+	domain_row *domains;
+	unsigned int i, num_domains = 0, num_shown;
+
+	if (prev_node != NULL)
+		xenstat_free_node(prev_node);
+	prev_node = cur_node;
+	cur_node = xenstat_get_node(xhandle, collect_flags);
+	if (cur_node == NULL)
+		fail("Failed to retrieve statistics from libxenstat\n");
+
+	domains = get_rows(&num_domains);
+	num_shown = (top_n != 0 && top_n < num_domains) ? top_n : num_domains;
+
+	for (i = 0; i < num_shown; i++) {
+		do_csv_domain(&domains[i]);
+		if (csv_vifs.out != NULL)
+			do_csv_vifs(&domains[i]);
+		if (csv_vbds.out != NULL)
+			do_csv_vbds(&domains[i]);
+	}
+
+	if (csv_vifs.out != NULL)
+		output_flush(csv_vifs.out);
+	if (csv_vbds.out != NULL)
+		output_flush(csv_vbds.out);
+}
+
+static unsigned long long bin_domain_state(xenstat_domain *domain)
+{
+	unsigned long long state = 0;
+	unsigned int i;
+
+	/* A bit per STATE letter, in the order of state_funcs */
+	for (i = 0; i < NUM_STATES; i++)
+		if (state_funcs[i].get(domain))
+			state |= 1 << i;
+	return state;
+}
+
+static unsigned long long bin_domain_vcpus(xenstat_domain *domain)
+{
+	return xenstat_domain_num_vcpus(domain);
+}
+
+/* Domain values in binary output, followed by the sums of net_counters and
+ * vbd_counters over the vifs and vbds when those are shown */
+static const struct {
+	const char *key;
+	unsigned long long (*get)(xenstat_domain *);
+} bin_columns[] = {
+	{ "state",   bin_domain_state        },
+	{ "cpu_ns",  xenstat_domain_cpu_ns   },
+	{ "mem",     xenstat_domain_cur_mem  },
+	{ "max_mem", xenstat_domain_max_mem  },
+	{ "vcpus",   bin_domain_vcpus        },
+};
+
+#define NUM_BIN_COLUMNS (sizeof(bin_columns)/sizeof(bin_columns[0]))
+#define NUM_NET_COUNTERS (sizeof(net_counters)/sizeof(net_counters[0]))
+#define NUM_VBD_COUNTERS (sizeof(vbd_counters)/sizeof(vbd_counters[0]))
+
+/* Appends a little-endian integer of the given size to the output */
+static void bin_uint(unsigned long long value, int bytes)
+{
+	xsb_put((unsigned char *)output_reserve(&out, bytes), value, bytes);
+	out.len += bytes;
+}
+
+static void bin_string(const char *prefix, const char *value)
+{
+	size_t plen = strlen(prefix), len = strlen(value);
+
+	if (plen + len > 255)
+		len = plen > 255 ? 0 : 255 - plen;
+	bin_uint(plen + len, 1);
+	output_write(&out, prefix, plen);
+	output_write(&out, value, len);
+}
+
+/* Starts a frame, returning where its length goes once it is known */
+static size_t bin_frame_open(unsigned int type)
+{
+	size_t start = out.len;
+
+	bin_uint(0, 4);
+	bin_uint(type, 1);
+	return start;
+}
+
+static void bin_frame_close(size_t start)
+{
+	xsb_put((unsigned char *)out.buf + start, out.len - start - 4, 4);
+}
+
+static void bin_schema(void)
+{
+	size_t frame = bin_frame_open(XSB_FRAME_SCHEMA);
+	unsigned int i;
+
+	bin_num_columns = NUM_BIN_COLUMNS;
+	if (show_networks)
+		bin_num_columns += NUM_NET_COUNTERS;
+	if (show_vbds)
+		bin_num_columns += NUM_VBD_COUNTERS;
+
+	bin_uint(XSB_MAGIC, 4);
+	bin_uint(XSB_VERSION, 2);
+	bin_uint(bin_num_columns, 2);
+	for (i = 0; i < NUM_BIN_COLUMNS; i++)
+		bin_string("", bin_columns[i].key);
+	for (i = 0; show_networks && i < NUM_NET_COUNTERS; i++)
+		bin_string("net_", net_counters[i].key);
+	for (i = 0; show_vbds && i < NUM_VBD_COUNTERS; i++)
+		bin_string("vbd_", vbd_counters[i].key);
+	bin_frame_close(frame);
+}
+
+/* Fills in the values of a domain, in the order of the schema */
+static void bin_values(xenstat_domain *domain, unsigned long long *values)
+{
+	unsigned int i, j, num;
+	xenstat_network *network;
+	xenstat_vbd *vbd;
+
+	for (i = 0; i < NUM_BIN_COLUMNS; i++)
+		*values++ = bin_columns[i].get(domain);
+
+	if (show_networks) {
+		memset(values, 0, NUM_NET_COUNTERS * sizeof(*values));
+		num = xenstat_domain_num_networks(domain);
+		for (i = 0; i < num; i++) {
+			network = xenstat_domain_network(domain, i);
+			for (j = 0; j < NUM_NET_COUNTERS; j++)
+				values[j] += net_counters[j].get(network);
+		}
+		values += NUM_NET_COUNTERS;
+	}
+
+	if (show_vbds) {
+		memset(values, 0, NUM_VBD_COUNTERS * sizeof(*values));
+		num = xenstat_domain_num_vbds(domain);
+		for (i = 0; i < num; i++) {
+			vbd = xenstat_domain_vbd(domain, i);
+			for (j = 0; j < NUM_VBD_COUNTERS; j++)
+				values[j] += vbd_counters[j].get(vbd);
+		}
+	}
+}
+
+/* Writes the sample frame of cur_node, after the schema frame on the first
+ * sample */
+static void bin_sample(void)
+{
+	struct bin_sample *cur = &bin_samples[bin_cur];
+	struct bin_sample *prev = &bin_samples[!bin_cur];
+	unsigned long long *values, *old;
+	unsigned int i, j, p, id, num_domains;
+	xenstat_domain *domain;
+	size_t frame;
+
+	if (bin_num_columns == 0)
+		bin_schema();
+
+	num_domains = xenstat_node_num_domains(cur_node);
+	if (num_domains > cur->size) {
+		cur->ids = realloc(cur->ids, num_domains * sizeof(*cur->ids));
+		cur->values = realloc(cur->values, num_domains * bin_num_columns
+				      * sizeof(*cur->values));
+		if (cur->ids == NULL || cur->values == NULL)
+			fail("Failed to allocate memory\n");
+		cur->size = num_domains;
+	}
+
+	frame = bin_frame_open(XSB_FRAME_SAMPLE);
+	bin_uint(curtime.tv_sec * 1000000ULL + curtime.tv_usec, 8);
+	bin_uint(num_domains, 4);
+	for (i = 0, p = 0; i < num_domains; i++) {
+		domain = xenstat_node_domain_by_index(cur_node, i);
+		id = xenstat_domain_id(domain);
+		values = cur->values + i * bin_num_columns;
+		cur->ids[i] = id;
+		bin_values(domain, values);
+
+		/* Domains are listed by id, so the previous sample is walked
+		 * alongside; a domain not found there is written in full */
+		while (p < prev->num_domains && prev->ids[p] < id)
+			p++;
+		bin_uint(id, 4);
+		if (p < prev->num_domains && prev->ids[p] == id) {
+			old = prev->values + p * bin_num_columns;
+			bin_uint(0, 1);
+		} else {
+			old = NULL;
+			bin_uint(XSB_DOMAIN_NEW, 1);
+			bin_string("", xenstat_domain_name(domain));
+		}
+		for (j = 0; j < bin_num_columns; j++)
+			bin_uint(values[j] - (old != NULL ? old[j] : 0), 8);
+	}
+	bin_frame_close(frame);
+
+	cur->num_domains = num_domains;
+	bin_cur = !bin_cur;
+}
+
+/* One interval of binary output */
+static void bin_top(void)
+{
+	if (prev_node != NULL)
 		xenstat_free_node(prev_node);
 	prev_node = cur_node;
-	cur_node = xenstat_get_node(xhandle, XENSTAT_ALL);
+	cur_node = xenstat_get_node(xhandle, collect_flags);
 	if (cur_node == NULL)
 		fail("Failed to retrieve statistics from libxenstat\n");
+
+	bin_sample();
+}
+
+/* Writes the sections of a domain into the currently open map */
+static void do_json_record(domain_row *row)
+{
+	json_key("stat");
+	do_json_domain(row);
 	
+	if (show_vcpus) {
+		json_key("vcpus");
+		do_json_vcpu(row->domain);
+	}
+	
+	if (show_networks) {
+		json_key("vifs");
+		do_json_network(row);
+	}
+	
+	if (show_vbds) {
+		json_key("vbds");
+		do_json_vbd(row);
+	}
+	
+	if (show_tmem) {
+		json_key("tmem");
+		do_json_tmem(row->domain);
+	}
+	
+	if (show_numa) {
+		json_key("numa");
+		do_json_numa(row->domain);
+	}
+}
+
+static void json_top(void) {
+	
+	domain_row *domains;
+	unsigned int i, num_domains = 0, num_shown;
+	
+	/* Now get the node information */
+	if (prev_node != NULL)
+		xenstat_free_node(prev_node);
+	prev_node = cur_node;
+	cur_node = xenstat_get_node(xhandle, collect_flags);
+	if (cur_node == NULL)
+		fail("Failed to retrieve statistics from libxenstat\n");
 	
 	GEN_OR_FAIL(yajl_gen_map_open(yghandle));
 	
-	//const char *ver_str;
-	//ver_str = xenstat_node_xen_version(cur_node);
 	/* dump summary top information */
-	GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)"hypervisor", 10));
-	
+	json_key("hypervisor");
 	do_json_summary();
 		
-	/* Count the number of domains for which to report data */
-	num_domains = xenstat_node_num_domains(cur_node);
-
-	domains = calloc(num_domains, sizeof(xenstat_domain *));
-	if(domains == NULL)
-		fail("Failed to allocate memory\n");
-
-	for (i=0; i < num_domains; i++)
-		domains[i] = xenstat_node_domain_by_index(cur_node, i);
-
-	/* Sort */
-	qsort(domains, num_domains, sizeof(xenstat_domain *),
-	      (int(*)(const void *, const void *))compare_domains);
+	domains = get_rows(&num_domains);
+	num_shown = (top_n != 0 && top_n < num_domains) ? top_n : num_domains;
 
-	if(first_domain_index >= num_domains)
-		first_domain_index = num_domains-1;
+	if(first_domain_index >= num_shown)
+		first_domain_index = num_shown-1;
 	
-		
-	for (i = first_domain_index; i < num_domains; i++) {
-		
-		/* Do i really want to have the header always?
-		if (i == first_domain_index || repeat_header) {
-			
-			// Set key for headers
-			GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)"header", 6));
-			
-			do_json_header();
-		}
-		*/
-		
-		// Set key for domain
-		len = snprintf(buf, NUMDOMAINS_MAX_DIGITS, "%d", xenstat_domain_id(domains[i]));
-		GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)buf, len));
-		
+	/* Every domain has the same keys, whichever sections are shown */
+	json_key("domains");
+	GEN_OR_FAIL(yajl_gen_array_open(yghandle));
+	for (i = first_domain_index; i < num_shown; i++) {
 		GEN_OR_FAIL(yajl_gen_map_open(yghandle));
-		
-		{
-			GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)"stat", 4));
-			
-			do_json_domain(domains[i]);
-			
-			
-			if (show_vcpus) {
-				
-				// Set key for virtual cpus
-				GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)"vcpus", 5));
-				
-				do_json_vcpu(domains[i]);
-			}
-			
-			if (show_networks) {
-				
-				// Set key for network
-				GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)"vifs", 4));
-				
-				do_json_network(domains[i]);
-			}
-			
-			if (show_vbds) {
-				// Set key for virtual blocks
-				GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)"vblks", 5));
-				
-				do_json_vbd(domains[i]);
-			}
-			
-			if (show_tmem) {
-				
-				// Set key for tmem
-				GEN_OR_FAIL(yajl_gen_string(yghandle, (const unsigned char *)"tmem", 4));
-				
-				do_json_tmem(domains[i]);
-			}
-		}
+		do_json_record(&domains[i]);
 		GEN_OR_FAIL(yajl_gen_map_close(yghandle));
 	}
+	GEN_OR_FAIL(yajl_gen_array_close(yghandle));
+
+	if (num_shown < num_domains) {
+		/* Totals of the domains left out */
+		json_key("others");
+		do_json_others(domains + num_shown, num_domains - num_shown);
+	}
 
 	GEN_OR_FAIL(yajl_gen_map_close(yghandle));
+}
+
+/* Starts one NDJSON line, giving its record type and the sample time */
+static void ndjson_open(const char *type)
+{
+	GEN_OR_FAIL(yajl_gen_map_open(yghandle));
+	json_string("type", type);
+	json_fixed("time", curtime.tv_sec + curtime.tv_usec / 1000000.0, 3);
+}
+
+/* Ends the line and hands it to the consumer straight away */
+static void ndjson_close(void)
+{
+	GEN_OR_FAIL(yajl_gen_map_close(yghandle));
+	print_json(yghandle);
+	output_flush(&out);
+}
+
+/* One NDJSON line for the host, then one per domain as it is formatted,
+ * rather than one document for the whole host */
+static void ndjson_top(void)
+{
+	domain_row *domains;
+	unsigned int i, num_domains = 0, num_shown;
 	
-	free(domains);
+	if (prev_node != NULL)
+		xenstat_free_node(prev_node);
+	prev_node = cur_node;
+	cur_node = xenstat_get_node(xhandle, collect_flags);
+	if (cur_node == NULL)
+		fail("Failed to retrieve statistics from libxenstat\n");
+	
+	ndjson_open("host");
+	json_key("hypervisor");
+	do_json_summary();
+	ndjson_close();
+	
+	domains = get_rows(&num_domains);
+	num_shown = (top_n != 0 && top_n < num_domains) ? top_n : num_domains;
+	
+	for (i = 0; i < num_shown; i++) {
+		ndjson_open("domain");
+		do_json_record(&domains[i]);
+		ndjson_close();
+	}
+	
+	if (num_shown < num_domains) {
+		ndjson_open("others");
+		json_key("others");
+		do_json_others(domains + num_shown, num_domains - num_shown);
+		ndjson_close();
+	}
+}
+
+/* Host totals over the last interval, for --host */
+struct host_stats {
+	double pcpu_pct;		/* Average busy % of the physical CPUs */
+	double cpu_pct;			/* Sum of the CPU% of the domains */
+	unsigned long long net_rx;	/* Bytes per second */
+	unsigned long long net_tx;
+	unsigned long long iops;	/* VBD requests per second */
+	unsigned long long sects;	/* VBD sectors per second */
+	unsigned int run, block, pause, crash, dying, shutdown;
+};
+
+/* Collectors needed by --host */
+#define HOST_FLAGS (XENSTAT_NETWORK|XENSTAT_VBD|XENSTAT_PCPU)
+
+/* Computes the host totals in a single pass over the domains.  The rates are
+ * summed per device, over the domains and devices found in both samples, so
+ * that a domain or a device going away doesn't show up as a drop. */
+static void calc_host(struct host_stats *host)
+{
+	domain_row row;
+	unsigned long long idle_ns;
+	unsigned int i, j = 0, num_domains;
+	double ns_elapsed;
+
+	memset(host, 0, sizeof(*host));
+
+	num_domains = xenstat_node_num_domains(cur_node);
+	for (i = 0; i < num_domains; i++) {
+		row.domain = xenstat_node_domain_by_index(cur_node, i);
+		if (xenstat_domain_running(row.domain)) host->run++;
+		else if (xenstat_domain_blocked(row.domain)) host->block++;
+		else if (xenstat_domain_paused(row.domain)) host->pause++;
+		else if (xenstat_domain_shutdown(row.domain)) host->shutdown++;
+		else if (xenstat_domain_crashed(row.domain)) host->crash++;
+		else if (xenstat_domain_dying(row.domain)) host->dying++;
+
+		/* Domains new in this sample have nothing to compare with */
+		row.old_domain = find_old_domain(row.domain, &j);
+		if (row.old_domain == NULL)
+			continue;
+
+		host->cpu_pct += calc_cpu_pct(row.domain, row.old_domain);
+		rate_row(&row);
+		host->net_rx += row.net_rx;
+		host->net_tx += row.net_tx;
+		host->iops += row.vbd_rd + row.vbd_wr;
+		host->sects += row.vbd_rsect + row.vbd_wsect;
+	}
+
+	if (prev_node == NULL || xenstat_node_num_cpus(cur_node) == 0)
+		return;
+	ns_elapsed = elapsed_secs() * 1000000000.0
+		     * xenstat_node_num_cpus(cur_node);
+	idle_ns = xenstat_node_idle_ns(cur_node) - xenstat_node_idle_ns(prev_node);
+	if (ns_elapsed > 0 && idle_ns < ns_elapsed)
+		host->pcpu_pct = 100.0 - idle_ns * 100.0 / ns_elapsed;
+}
+
+/* Prints the header of the --host lines */
+static void do_host_header(void)
+{
+	const char *fmt = ftype == TYPE_CSV_OPT
+		? "%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s\n"
+		: "%-12s %5s %6s %6s %10s %10s %11s %9s %9s %7s %8s %4s %4s %4s %4s %4s %4s\n";
+
+	print(fmt, "TIME", "MISS", "PCPU%", "CPU%", "USED(k)", "FREE(k)",
+	      "FREEABLE(k)", "RX(k/s)", "TX(k/s)", "IOPS", "SECT/s",
+	      "run", "blk", "pau", "crs", "dyg", "sht");
+}
+
+/* Prints one line of host totals */
+static void do_host(struct host_stats *host)
+{
+	const char *fmt = ftype == TYPE_CSV_OPT
+		? "%s,%lu,%.1f,%.1f,%llu,%llu,%ld,%llu,%llu,%llu,%llu,%u,%u,%u,%u,%u,%u\n"
+		: "%-12s %5lu %6.1f %6.1f %10llu %10llu %11ld %9llu %9llu %7llu %8llu %4u %4u %4u %4u %4u %4u\n";
+	char time_str[16];
+	long freeable_mb = xenstat_node_freeable_mb(cur_node);
+	time_t curt = curtime.tv_sec;
+	size_t len;
+
+	len = strftime(time_str, sizeof(time_str), "%H:%M:%S", localtime(&curt));
+	snprintf(time_str + len, sizeof(time_str) - len, ".%03ld",
+		 (long)curtime.tv_usec / 1000);
+
+	print(fmt, time_str, overruns, host->pcpu_pct, host->cpu_pct,
+	      (xenstat_node_tot_mem(cur_node) - xenstat_node_free_mem(cur_node)) / 1024,
+	      xenstat_node_free_mem(cur_node) / 1024,
+	      freeable_mb > 0 ? freeable_mb * 1024 : 0,
+	      host->net_rx / 1024, host->net_tx / 1024, host->iops, host->sects,
+	      host->run, host->block, host->pause, host->crash, host->dying,
+	      host->shutdown);
+}
+
+static void do_json_host(struct host_stats *host)
+{
+	long freeable_mb = xenstat_node_freeable_mb(cur_node);
+	unsigned long long used = xenstat_node_tot_mem(cur_node) - xenstat_node_free_mem(cur_node);
+
+	GEN_OR_FAIL(yajl_gen_map_open(yghandle));
+	json_fixed("time", curtime.tv_sec + curtime.tv_usec / 1000000.0, 3);
+	json_uint("overruns", overruns);
+	json_fixed("pcpu_pct", host->pcpu_pct, 1);
+	json_fixed("cpu_pct", host->cpu_pct, 1);
+	json_uint("used_k", used / 1024);
+	json_uint("free_k", xenstat_node_free_mem(cur_node) / 1024);
+	json_uint("freeable_k", freeable_mb > 0 ? freeable_mb * 1024 : 0);
+	json_uint("rx_kps", host->net_rx / 1024);
+	json_uint("tx_kps", host->net_tx / 1024);
+	json_uint("iops", host->iops);
+	json_uint("sectps", host->sects);
+	json_uint("running", host->run);
+	json_uint("blocked", host->block);
+	json_uint("paused", host->pause);
+	json_uint("crashed", host->crash);
+	json_uint("dying", host->dying);
+	json_uint("shutdown", host->shutdown);
+	GEN_OR_FAIL(yajl_gen_map_close(yghandle));
+}
+
+/* One interval of --host: only the collectors the totals need are run, and
+ * nothing is formatted per domain */
+static void host_top(void)
+{
+	struct host_stats host;
+
+	if (prev_node != NULL)
+		xenstat_free_node(prev_node);
+	prev_node = cur_node;
+	cur_node = xenstat_get_node(xhandle, HOST_FLAGS);
+	if (cur_node == NULL)
+		fail("Failed to retrieve statistics from libxenstat\n");
+
+	calc_host(&host);
+
+	if (ftype == TYPE_JSON_OPT || ftype == TYPE_NDJSON_OPT) {
+		do_json_host(&host);
+		return;
+	}
+	if (prev_node == NULL || repeat_header)
+		do_host_header();
+	do_host(&host);
 }
 
 static int signal_exit;
@@ -1718,34 +3069,121 @@ static void signal_exit_handler(int sig)
 	signal_exit = 1;
 }
 
-// Print the json
-void print_json(yajl_gen g) {
-	
-	const unsigned char * buf;
-	size_t len;
-	
-	yajl_gen_get_buf(g, &buf, &len);
-	fwrite(buf, 1, len, stdout);
-	yajl_gen_clear(g);
-	print("\n");
+static void timespec_add_ns(struct timespec *ts, unsigned long long ns)
+{
+	ns += ts->tv_nsec;
+	ts->tv_sec += ns / 1000000000;
+	ts->tv_nsec = ns % 1000000000;
+}
+
+/* Sets the deadline of the first interval: now, or with --align the next
+ * multiple of the interval in wall clock time */
+static void first_deadline(struct timespec *deadline)
+{
+	unsigned long long interval_ns = interval_ms * 1000000ULL, now_ns;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	if (!align)
+		return;
+	clock_gettime(CLOCK_REALTIME, &now);
+	now_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+	timespec_add_ns(deadline, interval_ns - now_ns % interval_ns);
+}
+
+/* Moves the deadline on by an interval, from the last deadline rather than
+ * from now so that the time taken by a tick doesn't add up.  When the tick
+ * ran past deadlines these are skipped, keeping the phase, and counted */
+static void next_deadline(struct timespec *deadline)
+{
+	unsigned long long interval_ns = interval_ms * 1000000ULL, late_ns;
+	struct timespec now;
+
+	timespec_add_ns(deadline, interval_ns);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec < deadline->tv_sec ||
+	    (now.tv_sec == deadline->tv_sec && now.tv_nsec < deadline->tv_nsec))
+		return;
+	late_ns = (now.tv_sec - deadline->tv_sec) * 1000000000ULL
+		  + now.tv_nsec - deadline->tv_nsec;
+	overruns += late_ns / interval_ns + 1;
+	timespec_add_ns(deadline, (late_ns / interval_ns + 1) * interval_ns);
+}
+
+/* Sleeps until the deadline, or until a signal asks to exit */
+static void wait_deadline(const struct timespec *deadline)
+{
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline,
+			       NULL) == EINTR)
+		if (signal_exit)
+			return;
+}
+
+/* libxenstat keeps the statistics files of the VBDs open within half of the
+ * soft limit on open files, so raise it to the hard limit, up to 65536, for
+ * hosts with many VBDs */
+static void raise_nofile(void)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == -1 || rl.rlim_cur == RLIM_INFINITY ||
+	    rl.rlim_cur >= 65536 || rl.rlim_cur >= rl.rlim_max)
+		return;
+	rl.rlim_cur = rl.rlim_max < 65536 ? rl.rlim_max : 65536;
+	setrlimit(RLIMIT_NOFILE, &rl);
+}
+
+/* Long options without a short form */
+enum {
+	OPT_VIF_CSV = 256,
+	OPT_VBD_CSV,
+};
+
+/* Opens the file of a per-device CSV stream */
+static struct output *csv_open(const char *path)
+{
+	struct output *o = calloc(1, sizeof(*o));
+
+	if (o == NULL)
+		fail("Failed to allocate memory\n");
+	o->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (o->fd == -1) {
+		fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	return o;
 }
 
 int main(int argc, char **argv)
 {
 	int opt, optind = 0;
 	char *subopts, *value;
+	const char *vif_csv = NULL, *vbd_csv = NULL;
+	int sort_given = 0;
+	struct timespec deadline;
 	
 	struct option lopts[] = {
 		{ "help",				no_argument,       NULL, 'h' },
 		{ "version",			no_argument,       NULL, 'V' },
 		{ "repeat-header",		no_argument,       NULL, 'r' },
 		{ "interval",			required_argument, NULL, 'i' },
+		{ "align",				no_argument,       NULL, 'a' },
 		{ "iteration-count",	required_argument, NULL, 'c' },
 		{ "identifier",			required_argument, NULL, 'f' },
 		{ "type",				required_argument, NULL, 't' },
+		{ "net-source",			required_argument, NULL, 'N' },
+		{ "sort",				required_argument, NULL, 's' },
+		{ "top",				required_argument, NULL, 'T' },
+		{ "rate",				no_argument,       NULL, 'R' },
+		{ "host",				no_argument,       NULL, 'H' },
+		{ "output",				required_argument, NULL, 'o' },
+		{ "domain",				required_argument, NULL, 'd' },
+		{ "state",				required_argument, NULL, 'S' },
+		{ "vif-csv",			required_argument, NULL, OPT_VIF_CSV },
+		{ "vbd-csv",			required_argument, NULL, OPT_VBD_CSV },
 		{ 0, 0, 0, 0 },
 	};
-	const char *sopts = "hVri:c:f:t:";
+	const char *sopts = "hVri:ac:f:t:N:s:T:RHo:d:S:";
 	struct sigaction sa = {
 		.sa_handler = signal_exit_handler,
 		.sa_flags = 0
@@ -1772,6 +3210,9 @@ int main(int argc, char **argv)
 			case 'i':
 				set_interval(optarg);
 				break;
+			case 'a':
+				align = 1;
+				break;
 			case 'c':
 				iterationCount = atoi(optarg);
 				loop = 0;
@@ -1805,52 +3246,165 @@ int main(int argc, char **argv)
 						case TYPE_ORG_OPT:
 						case TYPE_CSV_OPT:
 						case TYPE_JSON_OPT:
+						case TYPE_NDJSON_OPT:
+						case TYPE_BINARY_OPT:
 							ftype = opt;
 					}
 				}
 				
+				break;
+			case 'N':
+				subopts = optarg;
+				while (*subopts != '\0') {
+					switch (opt = getsubopt(&subopts, (char * const *)net_source_opts, &value)) {
+						default:
+							/* Unknown suboption. */
+							print("Unknown suboption %d, `%s'\n", opt, value);
+							break;
+						
+						case XENSTAT_NETSRC_AUTO:
+						case XENSTAT_NETSRC_PROCFS:
+						case XENSTAT_NETSRC_NETLINK:
+							net_source = opt;
+					}
+				}
+				
+				break;
+			case 's':
+				set_sort_field(optarg);
+				sort_given = 1;
+				break;
+			case 'T':
+				set_top(optarg);
+				break;
+			case 'R':
+				show_rate = 1;
+				break;
+			case 'H':
+				show_host = 1;
+				break;
+			case 'o':
+				set_columns(optarg);
+				break;
+			case 'd':
+				add_domain_filter(optarg);
+				break;
+			case 'S':
+				domain_filter.states = optarg;
+				break;
+			case OPT_VIF_CSV:
+				vif_csv = optarg;
+				break;
+			case OPT_VBD_CSV:
+				vbd_csv = optarg;
 				break;
 		}
 	}
-	
-	/* What to show */
-	show_vcpus = 1;
-	show_networks = 1;
-	show_vbds = 1;
-	show_tmem = 1;
-	
+
+	/* The per-device files are only written alongside the domain rows of
+	 * -t csv, so check that before truncating any file */
+	if ((vif_csv != NULL || vbd_csv != NULL) &&
+	    (ftype != TYPE_CSV_OPT || show_host)) {
+		fprintf(stderr, "--vif-csv and --vbd-csv need -t csv without --host\n");
+		exit(1);
+	}
+	/* Binary output has its own fixed columns, with the absolute values
+	 * of every domain in id order */
+	if (ftype == TYPE_BINARY_OPT && (show_rate || show_host || top_n != 0 ||
+					 sort_given || num_columns > 0)) {
+		fprintf(stderr, "-t binary can't be used with --rate, --host, "
+			"--sort, --top or -o fields\n");
+		exit(1);
+	}
+	if (vif_csv != NULL)
+		csv_vifs.out = csv_open(vif_csv);
+	if (vbd_csv != NULL)
+		csv_vbds.out = csv_open(vbd_csv);
+	
+	/* What to show: everything unless -o chose, and then only collect what
+	 * the choice needs.  Binary output only needs the net and vbd sections
+	 * on top of its fixed columns, which come with the domain info. */
+	if (ftype == TYPE_BINARY_OPT) {
+		if (!(show_vcpus || show_networks || show_vbds || show_tmem ||
+		      show_numa)) {
+			show_networks = 1;
+			show_vbds = 1;
+		}
+		collect_flags = (show_networks ? XENSTAT_NETWORK : 0) |
+				(show_vbds ? XENSTAT_VBD : 0);
+	} else if (num_columns == 0 && !(show_vcpus || show_networks ||
+					 show_vbds || show_tmem || show_numa)) {
+		for (num_columns = 0; num_columns < NUM_FIELDS; num_columns++)
+			columns[num_columns] = num_columns;
+		show_vcpus = 1;
+		show_networks = 1;
+		show_vbds = 1;
+		show_tmem = 1;
+		show_numa = 1;
+		collect_flags = XENSTAT_ALL | needed_flags();
+	} else
+		collect_flags = needed_flags();
+
+	if (collect_flags & XENSTAT_VBD)
+		raise_nofile();
+
 	/* Get xenstat handle */
 	xhandle = xenstat_init();
 	if (xhandle == NULL)
 		fail("Failed to initialize xenstat library\n");
+	xenstat_set_network_source(xhandle, net_source);
+	if (domain_filter.num_ids > 0 || domain_filter.num_names > 0 ||
+	    domain_filter.states != NULL)
+		xenstat_set_domain_filter(xhandle, filter_domain, &domain_filter);
 	
 	sigemptyset(&sa.sa_mask);
 	sigaction(SIGINT, &sa, NULL);
 	sigaction(SIGTERM, &sa, NULL);
 
+	if (ftype == TYPE_JSON_OPT || ftype == TYPE_NDJSON_OPT)
+		json_init();
+
+	first_deadline(&deadline);
 	do {
+		wait_deadline(&deadline);
+		if (signal_exit)
+			break;
 		gettimeofday(&curtime, NULL);
+		clock_gettime(CLOCK_MONOTONIC, &curmono);
 		
 		
-		if (ftype == TYPE_JSON_OPT) {
-			// Allocate json object
-			yghandle = yajl_gen_alloc(NULL);
+		if (ftype == TYPE_BINARY_OPT)
+			bin_top();
+		else if (show_host) {
+			host_top();
 			
+			if (ftype == TYPE_JSON_OPT || ftype == TYPE_NDJSON_OPT)
+				print_json(yghandle);
+		}
+		else if (ftype == TYPE_JSON_OPT) {
 			json_top();
 			
 			// Print json object
 			print_json(yghandle);
 		}
+		else if (ftype == TYPE_NDJSON_OPT)
+			ndjson_top();
+		else if (ftype == TYPE_CSV_OPT)
+			csv_top();
 		else
 			top();
 		
-		fflush(stdout);
-		oldtime = curtime;
+		output_flush(&out);
+		oldmono = curmono;
 		if ((!loop) && !(--iterationCount))
 			break;
-		sleep(interval);
+		next_deadline(&deadline);
 	} while (!signal_exit);
 
+	if (overruns > 0)
+		fprintf(stderr, "%lu intervals were missed by late updates\n",
+			overruns);
+
 	/* Cleanup occurs in cleanup(), so no work to do here. */
 	
 	return 0;
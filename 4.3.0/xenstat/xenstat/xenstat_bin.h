@@ -0,0 +1,62 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; under version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+/*
+ * Binary output of xenstat (-t binary), read back by xenstat-decode.
+ *
+ * The stream is a sequence of frames: a u32 giving the length of the rest of
+ * the frame, a u8 frame type and the payload.  Integers are little-endian.
+ *
+ * XSB_FRAME_SCHEMA starts the stream, and starts it over wherever another
+ * one appears, e.g. between concatenated runs:
+ *	u32 XSB_MAGIC, u16 XSB_VERSION, u16 column count, and per column a u8
+ *	key length and the key.
+ *
+ * XSB_FRAME_SAMPLE follows once per interval:
+ *	u64 time in microseconds since the epoch, u32 domain count, and per
+ *	domain a u32 id, a u8 of XSB_DOMAIN_* flags, with XSB_DOMAIN_NEW a u8
+ *	name length and the name, and then a u64 per column.  The values of a
+ *	new domain are absolute; those of a domain in the previous sample are
+ *	the difference from it, modulo 2^64.
+ */
+
+#ifndef XENSTAT_BIN_H
+#define XENSTAT_BIN_H
+
+#define XSB_MAGIC		0x42535358	/* "XSSB" */
+#define XSB_VERSION		1
+
+#define XSB_FRAME_SCHEMA	1
+#define XSB_FRAME_SAMPLE	2
+
+#define XSB_DOMAIN_NEW		0x01	/* Name follows, values are absolute */
+
+#define XSB_MAX_FRAME		(64 << 20)
+
+static inline void xsb_put(unsigned char *p, unsigned long long value,
+			   int bytes)
+{
+	int i;
+
+	for (i = 0; i < bytes; i++, value >>= 8)
+		p[i] = value & 0xff;
+}
+
+static inline unsigned long long xsb_get(const unsigned char *p, int bytes)
+{
+	unsigned long long value = 0;
+
+	while (bytes-- > 0)
+		value = (value << 8) | p[bytes];
+	return value;
+}
+
+#endif /* XENSTAT_BIN_H */
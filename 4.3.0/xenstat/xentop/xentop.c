@@ -21,6 +21,7 @@
 #include <curses.h>
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -76,10 +77,13 @@ static int lines(void);
 static void print(const char *, ...) __attribute__((format(printf,1,2)));
 static void attr_addstr(int attr, const char *str);
 static void set_delay(char *value);
+static void set_sort_field(char *value);
+static void set_top(char *value);
 static void set_prompt(char *new_prompt, void (*func)(char *));
 static int handle_key(int);
 static int compare(unsigned long long, unsigned long long);
 static int compare_domains(xenstat_domain **, xenstat_domain **);
+static void select_domains(xenstat_domain **, unsigned int, unsigned int);
 static unsigned long long tot_net_bytes( xenstat_domain *, int);
 static unsigned long long tot_vbd_reqs( xenstat_domain *, int);
 
@@ -130,6 +134,7 @@ static void do_domain(xenstat_domain *);
 static void do_vcpu(xenstat_domain *);
 static void do_network(xenstat_domain *);
 static void do_vbd(xenstat_domain *);
+static void do_others(xenstat_domain **, unsigned int);
 static void top(void);
 
 /* Field types */
@@ -195,6 +200,7 @@ xenstat_node *prev_node = NULL;
 xenstat_node *cur_node = NULL;
 field_id sort_field = FIELD_DOMID;
 unsigned int first_domain_index = 0;
+unsigned int top_n = 0;			/* Domains shown, 0 for all */
 unsigned int delay = 3;
 unsigned int batch = 0;
 unsigned int loop = 1;
@@ -234,6 +240,9 @@ static void usage(const char *program)
 	       "-b, --batch	     output in batch mode, no user input accepted\n"
 	       "-i, --iterations     number of iterations before exiting\n"
 	       "-f, --full-name      output the full domain name (not truncated)\n"
+	       "-s, --sort=FIELD     sort domains by the column with header FIELD\n"
+	       "-T, --top=N          only output the first N domains, and a line\n"
+	       "                     totalling the others\n"
 	       "\n" XENTOP_BUGSTO,
 	       program);
 	return;
@@ -333,6 +342,37 @@ static void set_delay(char *value)
 		delay = new_delay;
 }
 
+/* Handle setting the sort field from the user-supplied column header */
+static void set_sort_field(char *value)
+{
+	unsigned int i;
+
+	for (i = 0; i < NUM_FIELDS; i++) {
+		if (strcasecmp(value, fields[i].header) == 0) {
+			sort_field = i;
+			return;
+		}
+	}
+	fprintf(stderr, "Unknown sort field `%s'\n", value);
+	exit(1);
+}
+
+/* Handle setting the number of domains shown from the user-supplied count */
+static void set_top(char *value)
+{
+	unsigned long n;
+	char *end;
+
+	errno = 0;
+	n = strtoul(value, &end, 10);
+	if (value[0] < '0' || value[0] > '9' || *end != '\0' || errno != 0 ||
+	    n > UINT_MAX) {
+		fprintf(stderr, "Invalid number of domains `%s'\n", value);
+		exit(1);
+	}
+	top_n = n;
+}
+
 /* Enable prompting mode with the given prompt string; call the given function
  * when a value is available. */
 static void set_prompt(char *new_prompt, void (*func)(char *))
@@ -422,6 +462,52 @@ static int compare_domains(xenstat_domain **domain1, xenstat_domain **domain2)
 	return fields[sort_field].compare(*domain1, *domain2);
 }
 
+/* Moves the domain at index i of a heap of n domains down until the domains
+ * below it all sort before it */
+static void sift_domain(xenstat_domain **heap, unsigned int n, unsigned int i)
+{
+	xenstat_domain *tmp;
+	unsigned int child;
+
+	while ((child = 2 * i + 1) < n) {
+		if (child + 1 < n &&
+		    compare_domains(&heap[child + 1], &heap[child]) > 0)
+			child++;
+		if (compare_domains(&heap[child], &heap[i]) <= 0)
+			break;
+		tmp = heap[i];
+		heap[i] = heap[child];
+		heap[child] = tmp;
+		i = child;
+	}
+}
+
+/* Moves the n domains that sort first to the front of the array, in order,
+ * leaving the others unsorted after them.  The front of the array is kept as
+ * a heap with the last of the domains selected so far on top, so this is
+ * O(num_domains log n) rather than a full sort. */
+static void select_domains(xenstat_domain **domains, unsigned int num_domains,
+			   unsigned int n)
+{
+	xenstat_domain *tmp;
+	unsigned int i;
+
+	for (i = n / 2; i-- > 0; )
+		sift_domain(domains, n, i);
+
+	for (i = n; i < num_domains; i++) {
+		if (compare_domains(&domains[i], &domains[0]) >= 0)
+			continue;
+		tmp = domains[0];
+		domains[0] = domains[i];
+		domains[i] = tmp;
+		sift_domain(domains, n, 0);
+	}
+
+	qsort(domains, n, sizeof(xenstat_domain *),
+	      (int(*)(const void *, const void *))compare_domains);
+}
+
 /* Field functions */
 
 /* Compare domain names, returning -1,0,1 for <,=,> */
@@ -999,6 +1085,7 @@ void do_vbd(xenstat_domain *domain)
 		"Unidentified",           /* number 0 */
 		"BlkBack",           /* number 1 */
 		"BlkTap",            /* number 2 */
+		"QDisk",             /* number 3 */
 	};
 	
 	num_vbds = xenstat_domain_num_vbds(domain);
@@ -1044,10 +1131,33 @@ void do_tmem(xenstat_domain *domain)
 
 }
 
+/* Prints the totals of the domains left out in top-N mode */
+static void do_others(xenstat_domain **domains, unsigned int num_domains)
+{
+	unsigned long long mem = 0, net_tx = 0, net_rx = 0;
+	unsigned long long vbd_rd = 0, vbd_wr = 0;
+	double cpu_pct = 0.0;
+	unsigned int i;
+
+	for (i = 0; i < num_domains; i++) {
+		cpu_pct += get_cpu_pct(domains[i]);
+		mem += xenstat_domain_cur_mem(domains[i]);
+		net_tx += tot_net_bytes(domains[i], FALSE);
+		net_rx += tot_net_bytes(domains[i], TRUE);
+		vbd_rd += tot_vbd_reqs(domains[i], FIELD_VBD_RD);
+		vbd_wr += tot_vbd_reqs(domains[i], FIELD_VBD_WR);
+	}
+
+	print("Others: %u domains  CPU(%%) %.1f  MEM(k) %llu  NETTX(k) %llu  "
+	      "NETRX(k) %llu  VBD_RD %llu  VBD_WR %llu\n",
+	      num_domains, cpu_pct, mem / 1024, net_tx / 1024, net_rx / 1024,
+	      vbd_rd, vbd_wr);
+}
+
 static void top(void)
 {
 	xenstat_domain **domains;
-	unsigned int i, num_domains = 0;
+	unsigned int i, num_domains = 0, num_shown;
 
 	/* Now get the node information */
 	if (prev_node != NULL)
@@ -1071,14 +1181,19 @@ static void top(void)
 	for (i=0; i < num_domains; i++)
 		domains[i] = xenstat_node_domain_by_index(cur_node, i);
 
-	/* Sort */
-	qsort(domains, num_domains, sizeof(xenstat_domain *),
-	      (int(*)(const void *, const void *))compare_domains);
+	/* Sort, or in top-N mode only select and sort the domains shown */
+	num_shown = num_domains;
+	if (top_n != 0 && top_n < num_domains) {
+		select_domains(domains, num_domains, top_n);
+		num_shown = top_n;
+	} else
+		qsort(domains, num_domains, sizeof(xenstat_domain *),
+		      (int(*)(const void *, const void *))compare_domains);
 
-	if(first_domain_index >= num_domains)
-		first_domain_index = num_domains-1;
+	if(first_domain_index >= num_shown)
+		first_domain_index = num_shown-1;
 
-	for (i = first_domain_index; i < num_domains; i++) {
+	for (i = first_domain_index; i < num_shown; i++) {
 		if(!batch && current_row() == lines()-1)
 			break;
 		if (i == first_domain_index || repeat_header)
@@ -1094,6 +1209,10 @@ static void top(void)
 			do_tmem(domains[i]);
 	}
 
+	if (num_shown < num_domains &&
+	    (batch || current_row() < lines()-1))
+		do_others(domains + num_shown, num_domains - num_shown);
+
 	if (!batch)
 		do_bottom_line();
 
@@ -1123,9 +1242,11 @@ int main(int argc, char **argv)
 		{ "batch",	   no_argument,	      NULL, 'b' },
 		{ "iterations",	   required_argument, NULL, 'i' },
 		{ "full-name",     no_argument,       NULL, 'f' },
+		{ "sort",          required_argument, NULL, 's' },
+		{ "top",           required_argument, NULL, 'T' },
 		{ 0, 0, 0, 0 },
 	};
-	const char *sopts = "hVnxrvd:bi:f";
+	const char *sopts = "hVnxrvd:bi:fs:T:";
 
 	if (atexit(cleanup) != 0)
 		fail("Failed to install cleanup handler.\n");
@@ -1170,6 +1291,12 @@ int main(int argc, char **argv)
 		case 't':
 			show_tmem = 1;
 			break;
+		case 's':
+			set_sort_field(optarg);
+			break;
+		case 'T':
+			set_top(optarg);
+			break;
 		}
 	}
 